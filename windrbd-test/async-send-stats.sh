@@ -0,0 +1,28 @@
+#!/bin/bash
+
+# Compares small write throughput with synchronous and asynchronous
+# kernel_sendmsg(). Needs a connected Primary WinDRBD device with
+# minor MINOR. Statistics are printed by the driver (see windrbd
+# log / syslog).
+#
+# WARNING: this overwrites the data on the device (and on its
+# peers). Run it with --destroy-data if you really want that.
+
+minor=${MINOR:-1}
+threads=${THREADS:-16}
+ios=${IOS:-10000}
+
+if [ "$1" != "--destroy-data" ]
+then
+	echo "This overwrites all data on DRBD device $minor, run it with --destroy-data if you really want that." >&2
+	exit 1
+fi
+
+for max_size in 0 8192
+do
+	echo "async send max size: $max_size"
+	windrbd run-test "send_stats async_send_max_size $max_size"
+	windrbd run-test "send_stats reset"
+	windrbd run-test "io_benchmark $minor $threads $ios 4096 write destroy-data"
+	windrbd run-test "send_stats"
+done
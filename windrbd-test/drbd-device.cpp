@@ -804,6 +804,97 @@ TEST(windrbd, flush_disk)
 	CloseHandle(h);
 }
 
+static bool trim_enabled(HANDLE h)
+{
+	STORAGE_PROPERTY_QUERY query;
+	DEVICE_TRIM_DESCRIPTOR trim;
+	DWORD size;
+	BOOL ret;
+
+	memset(&query, 0, sizeof(query));
+	memset(&trim, 0, sizeof(trim));
+	query.PropertyId = StorageDeviceTrimProperty;
+	query.QueryType = PropertyStandardQuery;
+
+	ret = DeviceIoControl(h, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &trim, sizeof(trim), &size, NULL);
+	EXPECT_NE(ret, 0);
+	EXPECT_EQ(size, sizeof(trim));
+
+	return trim.TrimEnabled;
+}
+
+TEST(windrbd, get_trim_property)
+{
+	HANDLE h = do_open_device(0);
+
+	printf("TRIM is %s\n", trim_enabled(h) ? "enabled" : "disabled");
+
+	CloseHandle(h);
+}
+
+	/* Unsorted, overlapping and adjacent ranges, like NTFS
+	 * sends them (driver merges them). Stays away from the
+	 * start of the device (partition table, file system
+	 * superblocks).
+	 */
+
+#define TRIM_BASE (16*1024*1024)
+
+TEST(windrbd, trim_ranges)
+{
+	HANDLE h = do_open_device(0);
+	struct trim_request {
+		DEVICE_MANAGE_DATA_SET_ATTRIBUTES attrs;
+		DEVICE_DATA_SET_RANGE ranges[4];
+	} dsm;
+	DWORD size;
+	BOOL ret;
+	int err;
+	bool enabled = trim_enabled(h);
+
+	if (!p.force) {
+	        char answer[10];
+
+		fprintf(stderr, "This test will *DESTROY* data on the disk of the underlying backing device.\n");
+		fprintf(stderr, "Please type y<enter> if you wish to do this.\n");
+		fgets(answer, sizeof(answer)-1, stdin);
+		if (answer[0] != 'y') {
+			fprintf(stderr, "TRIM test not done.\n");
+			CloseHandle(h);
+			return;
+		}
+	}
+
+	memset(&dsm, 0, sizeof(dsm));
+	dsm.attrs.Size = sizeof(dsm.attrs);
+	dsm.attrs.Action = DeviceDsmAction_Trim;
+	dsm.attrs.DataSetRangesOffset = offsetof(struct trim_request, ranges);
+	dsm.attrs.DataSetRangesLength = sizeof(dsm.ranges);
+
+	dsm.ranges[0].StartingOffset = TRIM_BASE + 1024*1024;
+	dsm.ranges[0].LengthInBytes = 64*1024;
+	dsm.ranges[1].StartingOffset = TRIM_BASE;
+	dsm.ranges[1].LengthInBytes = 4096;
+	dsm.ranges[2].StartingOffset = TRIM_BASE + 1024*1024 + 32*1024;
+	dsm.ranges[2].LengthInBytes = 64*1024;
+	dsm.ranges[3].StartingOffset = TRIM_BASE + 4096;
+	dsm.ranges[3].LengthInBytes = 4096;
+
+	ret = DeviceIoControl(h, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &dsm, sizeof(dsm), NULL, 0, &size, NULL);
+
+	if (enabled) {
+		if (!ret) {
+			err = GetLastError();
+			EXPECT_EQ(err, ERROR_SUCCESS);
+		}
+		EXPECT_NE(ret, 0);
+	} else {
+		EXPECT_EQ(ret, 0);
+	}
+
+	CloseHandle(h);
+}
+
 TEST(windrbd, dismount_volume)
 {
 	HANDLE h = do_open_device(0);
@@ -831,6 +922,101 @@ TEST(windrbd, disable_file_cache)
 }
 #endif
 
+	/* Reads with 1, 2, 4, ... 64 requests in flight and prints
+	 * IOPS and average time from submit to complete for each
+	 * queue depth. Compare with disk timeout set (drbdsetup
+	 * disk-options --disk-timeout) and not set, with the disk
+	 * timeout this should not get slower with larger queue
+	 * depths.
+	 */
+
+#define QD_BENCHMARK_REQUEST_SIZE 4096
+#define QD_BENCHMARK_IOS 20000
+#define QD_BENCHMARK_MAX_DEPTH 64
+
+TEST(windrbd, queue_depth_benchmark)
+{
+	HANDLE h = do_open_device(DIRECT);
+	HANDLE port;
+	struct _OVERLAPPED overlapped[QD_BENCHMARK_MAX_DEPTH];
+	LARGE_INTEGER submitted[QD_BENCHMARK_MAX_DEPTH];
+	LARGE_INTEGER freq, started, now;
+	char *buf;
+	int depth, i, in_flight, done, errors;
+	unsigned long long offset, num_blocks, next_block;
+	double total_latency, elapsed;
+	DWORD bytes;
+	ULONG_PTR key;
+	LPOVERLAPPED o;
+	BOOL ret;
+
+	port = CreateIoCompletionPort(h, NULL, 0, 1);
+	ASSERT_NE(port, (HANDLE) NULL);
+
+	buf = (char*) VirtualAlloc(NULL, QD_BENCHMARK_REQUEST_SIZE*QD_BENCHMARK_MAX_DEPTH, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	ASSERT_NE(buf, (char*) NULL);
+
+	QueryPerformanceFrequency(&freq);
+	num_blocks = p.expected_size / QD_BENCHMARK_REQUEST_SIZE;
+	ASSERT_GE(num_blocks, QD_BENCHMARK_MAX_DEPTH);
+
+	for (depth=1;depth<=QD_BENCHMARK_MAX_DEPTH;depth*=2) {
+		in_flight = done = errors = 0;
+		next_block = 0;
+		memset(submitted, 0, sizeof(submitted));
+		total_latency = 0;
+		QueryPerformanceCounter(&started);
+
+		while (done < QD_BENCHMARK_IOS) {
+			while (in_flight < depth && done + in_flight < QD_BENCHMARK_IOS) {
+					/* Find a free slot */
+				for (i=0;i<depth;i++)
+					if (submitted[i].QuadPart == 0)
+						break;
+
+				offset = (next_block++ % num_blocks) * QD_BENCHMARK_REQUEST_SIZE;
+				memset(&overlapped[i], 0, sizeof(overlapped[i]));
+				overlapped[i].Offset = (DWORD) offset;
+				overlapped[i].OffsetHigh = (DWORD) (offset >> 32);
+				QueryPerformanceCounter(&submitted[i]);
+
+				ret = ReadFile(h, buf+i*QD_BENCHMARK_REQUEST_SIZE, QD_BENCHMARK_REQUEST_SIZE, NULL, &overlapped[i]);
+				if (ret == 0 && GetLastError() != ERROR_IO_PENDING) {
+					submitted[i].QuadPart = 0;
+					errors++;
+					done++;
+					continue;
+				}
+				in_flight++;
+			}
+			if (in_flight == 0)
+				break;
+
+			ret = GetQueuedCompletionStatus(port, &bytes, &key, &o, INFINITE);
+			if (o == NULL)
+				break;
+			if (ret == 0 || bytes != QD_BENCHMARK_REQUEST_SIZE)
+				errors++;
+
+			i = o - overlapped;
+			QueryPerformanceCounter(&now);
+			total_latency += (double) (now.QuadPart - submitted[i].QuadPart) / freq.QuadPart;
+			submitted[i].QuadPart = 0;
+			in_flight--;
+			done++;
+		}
+		QueryPerformanceCounter(&now);
+		elapsed = (double) (now.QuadPart - started.QuadPart) / freq.QuadPart;
+
+		printf("queue depth %2d: %d reads of %d bytes in %.1f ms: %.0f IOPS, %.1f usecs from submit to complete (%d errors)\n", depth, done, QD_BENCHMARK_REQUEST_SIZE, elapsed * 1000, done / elapsed, total_latency * 1000000 / done, errors);
+		EXPECT_EQ(errors, 0);
+	}
+
+	VirtualFree(buf, 0, MEM_RELEASE);
+	CloseHandle(port);
+	CloseHandle(h);
+}
+
 TEST(windrbd, io_depth)
 {
 	int fd;
@@ -0,0 +1,30 @@
+#!/bin/bash
+
+# Shows IOPS of the DRBD device with minor MINOR for increasing
+# numbers of submitting threads. Run once with registry value
+# io_queues_per_device set to 1 (one queue per device) and once
+# with 0 (one queue per processor), then compare. Results are
+# printed by the driver (see windrbd log / syslog).
+#
+# MODE=write overwrites the data on the device (and on its peers),
+# run it with --destroy-data then.
+
+minor=${MINOR:-1}
+ios=${IOS:-100000}
+size=${REQ_SIZE:-4096}
+mode=${MODE:-read}
+
+if [ "$mode" == "write" ]
+then
+	if [ "$1" != "--destroy-data" ]
+	then
+		echo "MODE=write overwrites all data on DRBD device $minor, run it with --destroy-data if you really want that." >&2
+		exit 1
+	fi
+	mode="write destroy-data"
+fi
+
+for threads in 1 2 4 8 16
+do
+	windrbd run-test "io_benchmark $minor $threads $ios $size $mode"
+done
@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# Compares bytes copied per READ request with and without zero
+# copy reads. Needs a Primary WinDRBD device of at least SIZE megabytes.
+# Statistics are printed by the driver (see windrbd log / syslog).
+
+drive=${DRIVE:-'M:'}
+size=${SIZE:-45}
+
+for zero_copy in 0 1
+do
+	echo "zero copy reads: $zero_copy"
+	windrbd run-test "read_copy_stats zero_copy $zero_copy"
+	windrbd run-test "read_copy_stats reset"
+	./windrbd-test --gtest_filter=windrbd.do_write_read_whole_disk_by_1meg_requests --mode=r --drive=$drive --force --expected-size=$[ $size*1024*1024 ]
+	windrbd run-test "read_copy_stats"
+done
@@ -74,6 +74,7 @@
 #include <ctype.h>
 
 #include <linux/part_stat.h>
+#include <linux/rbtree.h>	/* for corked bios */
 
 void init_windrbd(void);
 void msleep(int ms);
@@ -106,11 +107,12 @@ enum
 };
 
 
-void flush_all_cpu_caches(void);
-
-#define smp_mb() flush_all_cpu_caches()
-#define smp_rmb() flush_all_cpu_caches()
-#define smp_wmb() flush_all_cpu_caches()
+	/* x86 and x64 reorder only loads after earlier stores, so
+	 * read and write barriers only need to stop the compiler.
+	 */
+#define smp_mb() KeMemoryBarrier()
+#define smp_rmb() KeMemoryBarrierWithoutFence()
+#define smp_wmb() KeMemoryBarrierWithoutFence()
 
 
 
@@ -133,21 +135,99 @@ typedef int atomic_t;
 #define atomic_inc64(_v)		atomic_inc_return64(_v)
 #define atomic_dec64(_v)		atomic_dec_return64(_v)
 
-extern LONG_PTR xchg(LONG_PTR *target, LONG_PTR value);
-extern void atomic_set(atomic_t *v, int i);
-extern void atomic_add(int i, atomic_t *v);
-extern void atomic_add64(LONGLONG a, atomic_t64 *v);
-extern int atomic_add_return(int i, atomic_t *v);
-extern void atomic_sub(int i, atomic_t *v);
-extern void atomic_sub64(LONGLONG a, atomic_t64 *v);
-extern int atomic_sub_return(int i, atomic_t *v);
-extern LONGLONG atomic_sub_return64(LONGLONG a, atomic_t64 *v);
-extern int atomic_dec_and_test(atomic_t *v);
-extern int atomic_sub_and_test(int i, atomic_t *v);
-extern int atomic_cmpxchg(atomic_t *v, int old, int new);
-extern int atomic_read(const atomic_t *v);
-extern LONGLONG atomic_read64(const atomic_t64 *v);
-extern int atomic_xchg(atomic_t *v, int n);
+/* Like on Linux, atomic_read() and atomic_set() are plain (volatile)
+ * accesses: with MSVC's default /volatile:ms on x86 and x64 they
+ * have acquire and release semantics, but they are no full barriers.
+ * All read-modify-write operations are interlocked operations and
+ * as such full barriers.
+ */
+
+static __inline LONG_PTR xchg(LONG_PTR *target, LONG_PTR value)
+{
+#ifdef _WIN64
+	return InterlockedExchange64(target, value);
+#else
+	return InterlockedExchange(target, value);
+#endif
+}
+
+static __inline int atomic_read(const atomic_t *v)
+{
+	return *(volatile const int *)v;
+}
+
+static __inline void atomic_set(atomic_t *v, int i)
+{
+	*(volatile int *)v = i;
+}
+
+static __inline LONGLONG atomic_read64(const atomic_t64 *v)
+{
+#ifdef _WIN64
+	return *(volatile const LONGLONG *)v;
+#else
+		/* 64 bit loads are not atomic on x86 */
+	return InterlockedCompareExchange64((LONGLONG *)v, 0, 0);
+#endif
+}
+
+static __inline void atomic_add(int i, atomic_t *v)
+{
+	InterlockedExchangeAdd((LONG *)v, i);
+}
+
+static __inline void atomic_add64(LONGLONG a, atomic_t64 *v)
+{
+	InterlockedExchangeAdd64((LONGLONG *)v, a);
+}
+
+static __inline int atomic_add_return(int i, atomic_t *v)
+{
+	return InterlockedExchangeAdd((LONG *)v, i) + i;
+}
+
+static __inline int atomic_sub_return(int i, atomic_t *v)
+{
+	return InterlockedExchangeAdd((LONG *)v, -i) - i;
+}
+
+static __inline LONGLONG atomic_sub_return64(LONGLONG a, atomic_t64 *v)
+{
+	return InterlockedExchangeAdd64((LONGLONG *)v, -a) - a;
+}
+
+static __inline void atomic_sub(int i, atomic_t *v)
+{
+	InterlockedExchangeAdd((LONG *)v, -i);
+}
+
+static __inline void atomic_sub64(LONGLONG a, atomic_t64 *v)
+{
+	InterlockedExchangeAdd64((LONGLONG *)v, -a);
+}
+
+static __inline int atomic_dec_and_test(atomic_t *v)
+{
+	return InterlockedDecrement((LONG *)v) == 0;
+}
+
+static __inline int atomic_sub_and_test(int i, atomic_t *v)
+{
+	return atomic_sub_return(i, v) == 0;
+}
+
+static __inline int atomic_cmpxchg(atomic_t *v, int old, int new)
+{
+	return InterlockedCompareExchange((LONG *)v, new, old);
+}
+
+static __inline int atomic_xchg(atomic_t *v, int n)
+{
+	return InterlockedExchange((LONG *)v, n);
+}
+
+	/* Raises *max to val (if val is greater), for statistics */
+extern void update_max64(atomic_t64 *max, LONGLONG val);
 
 #define WARN_ON(x)				__noop
 #define ATOMIC_INIT(i)			(i)
@@ -398,6 +478,46 @@ struct hlist_node {
 	struct hlist_node *next, **pprev;
 };
 
+static inline int hlist_unhashed(const struct hlist_node *h)
+{
+	return !h->pprev;
+}
+
+static inline void __hlist_del(struct hlist_node *n)
+{
+	struct hlist_node *next = n->next;
+	struct hlist_node **pprev = n->pprev;
+
+	*pprev = next;
+	if (next)
+		next->pprev = pprev;
+}
+
+static inline void INIT_HLIST_NODE(struct hlist_node *h)
+{
+	h->next = NULL;
+	h->pprev = NULL;
+}
+
+static inline void hlist_del_init(struct hlist_node *n)
+{
+	if (!hlist_unhashed(n)) {
+		__hlist_del(n);
+		INIT_HLIST_NODE(n);
+	}
+}
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	if (first)
+		first->pprev = &n->next;
+	h->first = n;
+	n->pprev = &h->first;
+}
+
 struct kobject { 
     const char          *name;
     struct kobject      *parent;
@@ -406,28 +526,22 @@ struct kobject {
 };
 
 #define WQ_MEM_RECLAIM 0
+#define WQ_UNBOUND	(1 << 1)
+#define WQ_HIGHPRI	(1 << 4)	/* ignored */
+#define WQ_CPU_INTENSIVE (1 << 5)	/* ignored */
 #define WQNAME_LEN	32
-struct workqueue_struct {
-	struct list_head work_list;
-	spinlock_t work_list_lock;
-
-	int run;
-	int about_to_destroy;
-	KEVENT	wakeupEvent;
-	KEVENT	killEvent;
-	KEVENT	workFinishedEvent;
-	KEVENT	readyToFreeEvent;
-
-	void (*func)();
-	char name[WQNAME_LEN];
-	struct task_struct *thread;
-};
 
+	/* See windrbd_workqueue.c */
+struct workqueue_struct;
+
+struct timer_base;
+
+	/* See windrbd_timer.c */
 struct timer_list {
-    KTIMER ktimer;
-    KDPC dpc;
-    void (*function)(struct timer_list *data);
-    ULONG_PTR expires; 
+	struct list_head entry;		/* empty if not pending */
+	void (*function)(struct timer_list *data);
+	ULONG_PTR expires;
+	struct timer_base *base;	/* wheel of the CPU it was first armed on */
 };
 
 extern void add_timer(struct timer_list *t);
@@ -439,11 +553,25 @@ extern int timer_pending(const struct timer_list * timer);
 extern int mod_timer_pending(struct timer_list *timer, ULONG_PTR expires);
 void timer_setup(struct timer_list *timer, void(*callback)(struct timer_list *timer), ULONG_PTR flags_unused);
 
+void init_timers(void);
+void shutdown_timers(void);
+
+void windrbd_timer_stats(LONGLONG *ticks, LONGLONG *fired, LONGLONG *mods, bool reset);
+
+	/* Print them with windrbd run-test waitqueue_stats. Declared
+	 * here and not in linux/wait.h since atomic_t64 is not
+	 * defined yet there (wait_event() only expands later).
+	 */
+
+extern atomic_t64 windrbd_wake_up_calls;
+extern atomic_t64 windrbd_wake_up_tasks;
+extern atomic_t64 windrbd_spurious_wakeups;
+
 
 struct work_struct {
-	int pending;
-	spinlock_t pending_lock;
-	struct list_head work_list;
+	volatile LONG pending;
+	struct work_struct *next;	/* on a worker's inbox */
+	struct list_head work_list;	/* on a worker's list */
 
 	void (*func)(struct work_struct *work);
 
@@ -494,6 +622,32 @@ struct completion {
 	wait_queue_head_t wait;
 };
 
+	/* Counters for corked I/O: bios submitted while corked,
+	 * requests sent to the backing device after merging and
+	 * bios that have been merged with other bios into one
+	 * request.
+	 */
+
+struct cork_stats {
+	atomic_t64 bios;
+	atomic_t64 requests;
+	atomic_t64 merged_bios;
+};
+
+	/* Counters for auto plugging: bios held back and why
+	 * the plug was flushed (timer expired, enough bytes
+	 * collected, backing device completed a request or
+	 * a PREFLUSH/FUA bio arrived).
+	 */
+
+struct plug_stats {
+	atomic_t64 plugged_bios;
+	atomic_t64 timer_flushes;
+	atomic_t64 size_flushes;
+	atomic_t64 idle_flushes;
+	atomic_t64 sync_flushes;
+};
+
 /* TODO: this is used as device extension for the DRBD devices and
    also as block device for the backing devices. This is probably
    not a good idea.
@@ -592,6 +746,15 @@ struct block_device {
 
 	struct workqueue_struct *io_workqueue;
 
+	/* Multi-queue: with io_queues_per_device != 1 (registry) there
+	 * is more than one I/O workqueue, the one used is selected
+	 * by the current processor (windrbd_select_io_workqueue()).
+	 * io_workqueues[0] is io_workqueue.
+	 */
+
+	struct workqueue_struct **io_workqueues;
+	int num_io_workqueues;
+
 	/* Wait queue for waiting for all bios completed. This solves
 	 * a BSOD on disconnect while sync. To be called at the 
 	 * beginning of conn_disconnect() (see drbd_receiver.c).
@@ -647,13 +810,44 @@ struct block_device {
 
 	bool corked;
 	spinlock_t cork_spinlock;
-	struct list_head corked_list;
+
+		/* Corked bios sorted by sector (see
+		 * windrbd_merge_corked_bios()). Protected by
+		 * cork_spinlock.
+		 */
+	struct rb_root corked_tree;
+	struct cork_stats cork_stats;
+
+		/* Auto plugging (see generic_make_request()). Plugged
+		 * bios are in corked_tree, plugged_bios and
+		 * plugged_bytes are protected by cork_spinlock.
+		 * plug_latency is the average completion latency of
+		 * the backing device (in 100ns units), it determines
+		 * how long we hold bios back.
+		 */
+	int plugged_bios;
+	unsigned long long plugged_bytes;
+	bool plug_flush_queued;
+		/* Not a timer_list: needs sub-jiffy precision. */
+	KTIMER plug_ktimer;
+	KDPC plug_dpc;
+	struct work_struct plug_work;
+	LONGLONG plug_latency;
+	struct plug_stats plug_stats;
 
 	spinlock_t in_flight_bios_lock;
-	struct list_head in_flight_bios;
+	struct list_head in_flight_bios;	/* oldest first */
 
 	unsigned long long disk_timeout;
 	struct timer_list disk_timeout_timer;
+	bool disk_timeout_armed;	/* protected by in_flight_bios_lock */
+
+		/* Set when the backing device rejected a request
+		 * described by one MDL built from the bio's pages
+		 * (see build_scatter_gather_irp()). We use the
+		 * big buffer (with a copy) from then on.
+		 */
+	bool scatter_gather_disabled;
 };
 
 	/* Starting with version 0.7.1, this is the device extension
@@ -719,6 +913,22 @@ struct bio_collection {
 };
 
 #define BI_WINDRBD_FLAG_BOOTSECTOR_PATCHED 0
+	/* Set for READ bios created by windrbd_make_drbd_requests()
+	 * when the bio_vec page points directly into the caller's
+	 * (locked) buffer. No copy is done on completion then.
+	 */
+#define BI_WINDRBD_FLAG_ZERO_COPY_READ 1
+	/* Set for WRITE bios created by blkdev_issue_zeroout() and
+	 * blkdev_issue_write_same(): bi_io_vec[0] holds one page
+	 * which is repeated to fill bi_size bytes (the MDL points
+	 * to the same physical page over and over again).
+	 */
+#define BI_WINDRBD_FLAG_REPEAT_PAGE 2
+	/* Set for discard bios used to zero out a range: if the
+	 * backing device rejects the TRIM, the bio fails (instead
+	 * of being ignored) so the caller can write zeroes.
+	 */
+#define BI_WINDRBD_FLAG_MUST_ZERO 3
 
 /* from: linux/bvec.h */
 
@@ -787,6 +997,17 @@ struct bio {
 	unsigned int bi_big_buffer_size;
 	bool bi_using_big_buffer;
 
+	/* Better: build one MDL which describes the pages of all
+	 * bio vec elements and send that to the disk driver
+	 * without copying anything. Used if the vector elements
+	 * are page aligned (which they usually are). If the
+	 * backing device rejects the request, it is resubmitted
+	 * from bi_retry_work using the big buffer.
+	 */
+
+	bool bi_using_scatter_gather;
+	struct work_struct bi_retry_work;
+
 	/* If set, indicates that the memory is paged, in which case
 	 * we must lock it to memory. If not set, must unlock memory
 	 * locked by IoBuildAsynchronousFsdRequest().
@@ -801,6 +1022,7 @@ struct bio {
 
 	/* Bit 0: Set by read completion routine to avoid calling
 	 * patch_boot_sector multiple times.
+	 * Bit 1: READ bio reads directly into the upper IRP's buffer.
 	 */
 	ULONG_PTR bi_windrbd_flags;
 
@@ -819,12 +1041,11 @@ struct bio {
 
 	blk_status_t bi_status;
 
-	/* We have to free the bio when IRQL is PASSIVE, so we
-	 * put them on this list in the IRQ and free it later
-	 * from a thread.
+	/* If the bio cannot be freed at the current IRQL we put
+	 * it on a per-CPU list and free it later from a thread.
 	 */
-	struct list_head to_be_freed_list;
-	struct list_head to_be_freed_list2;
+	SLIST_ENTRY to_be_freed_entry;
+	ULONGLONG bi_free_queued_time;	/* KeQueryInterruptTime() */
 
 		/* This indicates that the free_mdls_and_irp thread
 		 * should complete the upper IRP. It should do so
@@ -842,6 +1063,7 @@ struct bio {
 	struct bio *is_cloned_from;
 
 	struct list_head corked_bios;  /* used to link the bios */
+	struct rb_node corked_node;    /* in bdev's corked_tree */
 	struct list_head joined_bios;  /* a list containg bios which we do the big buffer for. Must end_io them once this joined bio is finished */
 
 	/* Set when a bio is created in windrbd_make_drbd_requests.
@@ -867,8 +1089,20 @@ struct bio {
 
 	char *where_i_am;	/* checkpoints for debugging backing dev timeout. */
 	unsigned long long submission_timestamp;
+	ULONGLONG irp_submission_time;	/* KeQueryInterruptTime() */
 	bool disk_has_timed_out;
 
+	/* Set if the bio was carved out of a bio slab object (see
+	 * windrbd_bioset.c): 1-based size class, 0 means kzalloc'ed.
+	 * The object also holds bi_num_inline_irps IRP pointer slots
+	 * (used instead of a separate bi_irps allocation) and a
+	 * private area for the windrbd device layer.
+	 */
+	int bi_slab_class;
+	struct _IRP **bi_inline_irps;
+	int bi_num_inline_irps;
+	void *bi_slab_private;
+
 	/* TODO: may be put members here again? Update: Not sure,
 	 * we've put a KEVENT here and it didn't work .. might also
 	 * have been something else.
@@ -879,6 +1113,28 @@ struct bio {
 
 void init_free_bios(void);
 void shutdown_free_bios(void);
+int windrbd_bio_free_queue_length(void);
+
+extern int windrbd_immediate_bio_free;
+extern atomic_t64 windrbd_bios_freed_immediately;
+extern atomic_t64 windrbd_bios_freed_deferred;
+extern atomic_t64 windrbd_bio_free_batches;
+extern atomic_t64 windrbd_bio_free_queue_max;
+extern atomic_t64 windrbd_bio_free_latency_total;
+extern atomic_t64 windrbd_bio_free_latency_max;
+
+	/* Size of the private area of a bio slab object. */
+#define BIO_SLAB_PRIVATE_SIZE 256
+
+void init_bio_slab(void);
+void shutdown_bio_slab(void);
+struct bio *windrbd_bio_slab_alloc(int nr_iovecs);
+void windrbd_bio_slab_free(struct bio *bio);
+
+extern int windrbd_bio_slab;
+extern atomic_t64 windrbd_bio_slab_allocations;
+extern atomic_t64 windrbd_bio_slab_cpu_cache_hits;
+extern atomic_t64 windrbd_bio_pool_allocations;
 
 struct bio_set {
 	mempool_t *bio_pool;
@@ -1054,7 +1310,7 @@ extern int fsync_bdev(struct block_device *bdev);
 	       /* __init_work((_work), _onstack);        */  \
 	       /*  (_work)->data = (atomic_long_t) WORK_DATA_INIT(); */ \
 		INIT_LIST_HEAD(&(_work)->work_list);			\
-		spin_lock_init(&(_work)->pending_lock);			\
+		(_work)->next = NULL;					\
 		PREPARE_WORK((_work), (_func));                         \
 		(_work)->pending = 0;					\
 	} while (0)
@@ -1075,6 +1331,7 @@ struct queue_limits {
 	unsigned int            max_write_same_sectors;
 	unsigned int		max_write_zeroes_sectors;
 	unsigned int            discard_granularity;    
+	unsigned int		discard_alignment;
 	unsigned int		discard_zeroes_data;
 	unsigned int		seg_boundary_mask;
 };
@@ -1101,16 +1358,17 @@ static inline void queue_flag_clear(unsigned int flag, struct request_queue *q)
 		__clear_bit(flag, &q->queue_flags);
 }
 
-/* TODO: compute with HZ */
+	/* Interrupt time (100ns units since boot) is updated by the
+	 * kernel once per clock tick in KUSER_SHARED_DATA, so reading
+	 * it is a memory load (no function call) and the division by
+	 * a constant is compiled to a multiplication. Monotonic.
+	 * Resolution is the clock tick, usually 15.6ms (less if some
+	 * application called timeBeginPeriod()), not 1/HZ. Use
+	 * ktime_get() for measuring latencies.
+	 */
 static __inline unsigned long long JIFFIES()
 {
-	LARGE_INTEGER Tick;
-	LARGE_INTEGER Elapse;
-	KeQueryTickCount(&Tick);
-	Elapse.QuadPart = Tick.QuadPart * KeQueryTimeIncrement();
-	Elapse.QuadPart /= (10000);
-// printk("KeQueryTimeIncrement is %lld tick count is %lld jiffies is %lld\n", KeQueryTimeIncrement(), Tick.QuadPart, Elapse.QuadPart);
-	return Elapse.QuadPart;
+	return KeQueryInterruptTime() / (10*1000*1000 / HZ);
 }
 
 #define jiffies				JIFFIES()
@@ -1192,9 +1450,20 @@ static inline void assert_spin_locked(spinlock_t *lock)
 
 
 struct workqueue_struct *alloc_ordered_workqueue(const char * fmt, int flags, ...);
+	/* max_active is the number of workers of WQ_UNBOUND queues
+	 * (0: number of CPUs). Per-CPU queues have one worker per CPU.
+	 */
+struct workqueue_struct *alloc_workqueue(const char *fmt, int flags, int max_active, ...);
 extern void queue_work(struct workqueue_struct* queue, struct work_struct* work);
 extern void flush_workqueue(struct workqueue_struct *wq);
+extern bool cancel_work_sync(struct work_struct *work);
 extern void destroy_workqueue(struct workqueue_struct *wq);
+extern const char *workqueue_name(struct workqueue_struct *wq);
+extern int workqueue_num_workers(struct workqueue_struct *wq);
+
+extern atomic_t64 windrbd_wq_works_queued;
+extern atomic_t64 windrbd_wq_works_stolen;
+extern atomic_t64 windrbd_wq_worker_wakeups;
 
 extern struct workqueue_struct *system_wq;
 
@@ -1289,16 +1558,11 @@ static inline int queue_io_opt(struct request_queue *q)
 
 extern struct block_device *blkdev_get_by_path(const char *path, fmode_t mode, void *holder);
 
-extern void hlist_add_head(struct hlist_node *n, struct hlist_head *h);
-extern void hlist_del_init(struct hlist_node *entry);
-extern int hlist_unhashed(const struct hlist_node *h);
-extern void __hlist_del(struct hlist_node *n);
 
 extern uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length);
 extern unsigned long crc32(const char *s, size_t len);
 extern bool lc_is_used(struct lru_cache *lc, unsigned int enr);
 extern void get_random_bytes(void *buf, int nbytes);
-extern int fls(int x);
 struct sk_buff;
 extern unsigned char *skb_put(struct sk_buff *skb, unsigned int len);
 extern char *kstrdup(const char *s, int gfp);
@@ -1313,6 +1577,14 @@ void windrbd_shutdown_wsk(void);
 extern int initRegistry(__in PUNICODE_STRING RegistryPath);
 extern void delete_block_device(struct kref *kref);
 
+	/* See windrbd_locking.c */
+void init_rcu(void);
+void shutdown_rcu(void);
+
+extern atomic_t64 windrbd_rcu_grace_periods;
+extern atomic_t64 windrbd_rcu_callbacks;
+extern atomic_t64 windrbd_rcu_callback_batches;
+
 extern void list_add_rcu(struct list_head *new, struct list_head *head);
 extern void list_add_tail_rcu(struct list_head *new,   struct list_head *head);
 extern void list_del_rcu(struct list_head *entry);
@@ -1361,17 +1633,31 @@ typedef struct _PTR_ENTRY
 // Bitops.h
 #define BITS_PER_BYTE		8
 
+	/* Mutex statistics, see windrbd_locking.c */
+extern int windrbd_mutex_stats;
+extern atomic_t64 windrbd_mutex_acquisitions;
+extern atomic_t64 windrbd_mutex_contended;
+extern atomic_t64 windrbd_mutex_spin_acquired;
+extern atomic_t64 windrbd_mutex_sleeps;
+extern atomic_t64 windrbd_mutex_hold_time_total;
+extern atomic_t64 windrbd_mutex_hold_time_max;
+
 extern void down(struct semaphore *s);
 extern int down_trylock(struct semaphore *s);
 extern void up(struct semaphore *s);
 
+	/* See windrbd_locking.c */
 struct rw_semaphore {
-	struct semaphore the_semaphore;
+	volatile LONG state;
+	spinlock_t wait_lock;
+	struct list_head waiters;
 };
 
 extern void init_rwsem(struct rw_semaphore *sem);
 extern void down_write(struct rw_semaphore *sem);
+extern int down_write_trylock(struct rw_semaphore *sem);
 extern void down_read(struct rw_semaphore *sem);
+extern int down_read_trylock(struct rw_semaphore *sem);
 extern void down_read_non_owner(struct rw_semaphore *sem);
 extern void up_write(struct rw_semaphore *sem);
 extern void up_read(struct rw_semaphore *sem);
@@ -1386,12 +1672,8 @@ extern void downgrade_write(struct rw_semaphore *sem);
 #define DECLARE_RWSEM(sem) \
 	struct rw_semaphore sem;
 
-static int blkdev_issue_zeroout(struct block_device *bdev, sector_t sector,
-	sector_t nr_sects, gfp_t gfp_mask, bool discard)
-{
-	// WDRBD: Not support
-	return 0;
-}
+extern int blkdev_issue_zeroout(struct block_device *bdev, sector_t sector,
+	sector_t nr_sects, gfp_t gfp_mask, bool discard);
 
 
 #define snprintf(a, b, c,...) scnprintf(a, b, c, ##__VA_ARGS__)
@@ -1599,6 +1881,14 @@ int set_driver_locked_state(int state);
 void windrbd_bdev_cork(struct block_device *bdev);
 int windrbd_bdev_uncork(struct block_device *bdev);
 
+	/* Bios in one run are contiguous, have the same operation
+	 * and flags and are submitted as one request.
+	 */
+typedef int (*submit_corked_fn)(struct list_head *run, int num_vector_elements, unsigned long long size, int num_bios);
+
+void windrbd_insert_corked_bio(struct rb_root *tree, struct bio *bio);
+int windrbd_merge_corked_bios(struct rb_root *tree, struct cork_stats *stats, submit_corked_fn submit);
+
 int windrbd_application_io_suspended(struct block_device *bdev);
 void windrbd_suspend_application_io(struct block_device *bdev, const char *msg);
 void windrbd_resume_application_io(struct block_device *bdev, const char *msg);
@@ -1606,4 +1896,53 @@ void windrbd_resume_application_io(struct block_device *bdev, const char *msg);
 // void windrbd_fail_all_in_flight_bios(struct block_device *bdev, int bi_status);
 void windrbd_set_disk_timeout(struct block_device *bdev, unsigned long long timeout);
 
+struct workqueue_struct *windrbd_select_io_workqueue(struct block_device *bdev);
+NTSTATUS windrbd_io_sync(struct block_device *bdev, char *buffer, unsigned int size, sector_t sector, unsigned long rw);
+
+/* I/O path tunables (read from registry on driver load) and
+ * statistics, implemented in windrbd_device.c and drbd_windows.c
+ */
+
+void windrbd_init_io_tunables(void);
+
+extern int windrbd_zero_copy_reads;
+
+extern atomic_t64 windrbd_read_requests;
+extern atomic_t64 windrbd_read_bytes;
+extern atomic_t64 windrbd_read_bytes_copied;
+
+extern int windrbd_scatter_gather_io;
+extern int windrbd_io_queues_per_device;
+
+extern int windrbd_inline_submission;
+extern int windrbd_inline_submission_min_stack;
+
+extern atomic_t64 windrbd_inline_submissions;
+extern atomic_t64 windrbd_queued_submissions;
+
+extern atomic_t64 windrbd_scatter_gather_requests;
+extern atomic_t64 windrbd_big_buffer_requests;
+extern atomic_t64 windrbd_big_buffer_bytes_copied;
+extern atomic_t64 windrbd_scatter_gather_rejected;
+
+extern int windrbd_auto_plug;
+extern int windrbd_auto_plug_max_usecs;
+extern int windrbd_auto_plug_max_bytes;
+
+extern atomic_t64 windrbd_discard_requests;
+extern atomic_t64 windrbd_discard_ranges;
+extern atomic_t64 windrbd_discard_bios;
+extern atomic_t64 windrbd_backing_discards;
+
+extern int windrbd_merge_discard_ranges(struct _DEVICE_DATA_SET_RANGE *ranges, int num_ranges);
+
+extern int windrbd_zeroout_offload;
+
+extern atomic_t64 windrbd_zeroout_offload_bytes;
+extern atomic_t64 windrbd_zeroout_zero_page_bytes;
+extern atomic_t64 windrbd_zeroout_requests;
+
+extern void init_zero_page(void);
+extern void shutdown_zero_page(void);
+
 #endif // DRBD_WINDOWS_H
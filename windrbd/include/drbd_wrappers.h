@@ -142,7 +142,9 @@ static  inline int drbd_always_getpeername(struct socket *sock, struct sockaddr
 #ifndef COMPAT_HAVE_BDEV_DISCARD_ALIGNMENT
 static inline int bdev_discard_alignment(struct block_device *bdev)
 {
-	return 0;
+	struct request_queue *q = bdev_get_queue(bdev);
+
+	return q != NULL ? q->limits.discard_alignment : 0;
 }
 #endif
 
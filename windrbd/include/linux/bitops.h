@@ -13,8 +13,6 @@ static void inline barrier(void)
 #define BIT_MASK(_nr)				(1ULL << ((_nr) % BITS_PER_LONG))
 #define BIT_WORD(_nr)				((_nr) / BITS_PER_LONG)
 
-extern int test_and_change_bit(int nr, volatile ULONG_PTR *vaddr);
-
 extern ULONG_PTR find_first_bit(const ULONG_PTR* addr, ULONG_PTR size); //reference linux 3.x kernel. 64bit compatible
 extern ULONG_PTR find_next_bit(const ULONG_PTR *addr, ULONG_PTR size, ULONG_PTR offset);
 extern int find_next_zero_bit(const ULONG_PTR * addr, ULONG_PTR size, ULONG_PTR offset);
@@ -58,6 +56,27 @@ void clear_bit_unlock(int bit, volatile ULONG_PTR * base)
     test_and_clear_bit(bit, base);
 }
 
+	/* The interlocked bit test intrinsics above take any bit
+	 * offset, for XOR we have to find the word ourselves.
+	 */
+
+static __inline int test_and_change_bit(int nr, volatile ULONG_PTR *addr)
+{
+	ULONG_PTR mask = BIT_MASK(nr);
+	volatile ULONG_PTR *p = addr + BIT_WORD(nr);
+
+#ifdef _WIN64
+	return (InterlockedXor64((volatile LONG64 *)p, mask) & mask) != 0;
+#else
+	return (InterlockedXor((volatile LONG *)p, mask) & mask) != 0;
+#endif
+}
+
+static __inline void change_bit(int nr, volatile ULONG_PTR *addr)
+{
+	test_and_change_bit(nr, addr);
+}
+
 #define __clear_bit(__n, __p) clear_bit(__n, __p)
 
 static __inline void __set_bit(int nr, volatile ULONG_PTR *addr)
@@ -88,6 +107,41 @@ static __inline int __test_and_clear_bit(int nr, volatile ULONG_PTR *addr)
 	return (old & mask) != 0;
 }
 
+static __inline void __change_bit(int nr, volatile ULONG_PTR *addr)
+{
+	ULONG_PTR *p = ((ULONG_PTR *) addr) + BIT_WORD(nr);
+
+	*p ^= BIT_MASK(nr);
+}
+
+	/* Index of the lowest set bit, word must not be 0 */
+
+static __inline ULONG_PTR __ffs(ULONG_PTR word)
+{
+	unsigned long index;
+
+#ifdef _WIN64
+	_BitScanForward64(&index, word);
+#else
+	_BitScanForward(&index, word);
+#endif
+	return index;
+}
+
+#define ffz(x)  __ffs(~(x))
+
+	/* Index of the highest set bit plus one, 0 if x is 0 */
+
+static __inline int fls(int x)
+{
+	unsigned long index;
+
+	if (!_BitScanReverse(&index, (unsigned long) x))
+		return 0;
+
+	return index + 1;
+}
+
 static __inline int test_bit(int nr, const ULONG_PTR *addr)
 {
 #ifdef _WIN64
@@ -59,6 +59,12 @@ static inline void blk_queue_flag_clear(unsigned int flag, struct request_queue
 	clear_bit(flag, &q->queue_flags);
 }
 
+	/* Set on backing devices that support TRIM and on WinDRBD
+	 * devices whose DRBD layer accepts discards.
+	 */
+#define QUEUE_FLAG_DISCARD	14
+#define blk_queue_discard(q)	test_bit(QUEUE_FLAG_DISCARD, &(q)->queue_flags)
+
 static inline void blk_queue_max_write_same_sectors(struct request_queue *q,
 				      unsigned int max_write_same_sectors)
 {
@@ -3,8 +3,14 @@
 
 #include <ntddk.h>
 
+	/* See windrbd_locking.c */
 struct mutex {
-	KMUTEX mtx;
+	volatile LONG state;	/* 0: unlocked, 1: locked, 2: locked, maybe waiters */
+	PKTHREAD volatile owner;
+	int recursion;		/* KMUTEX semantics: owner may lock again */
+	int spins;		/* average spins needed to get it */
+	LONGLONG locked_at;	/* for hold time statistics */
+	KEVENT event;		/* wakes one waiter */
 };
 
 extern void mutex_init(struct mutex *m);
@@ -89,6 +89,102 @@ struct _WSK_SOCKET;
 
 #define RECEIVE_BUFFER_DEFAULT_SIZE (128*1024)
 
+/* Receiver cache ring. There is exactly one producer (the
+ * socket_receive_thread()) and one consumer (kernel_recvmsg()),
+ * so no lock is needed.
+ *
+ * The ring is split into num_segments segments of segment_size
+ * bytes (both powers of 2). The producer hands segments to
+ * receive requests (posted), several of them may be outstanding
+ * at a time. Requests complete in any order with any number of
+ * bytes (0 for a cancelled request), rx_ring_publish() makes
+ * completed segments visible to the consumer in the order they
+ * were posted. head (published) and tail (consumed) count
+ * segments, each is only written by one side.
+ *
+ * A side that sleeps sets its waiting flag first, the other
+ * side only calls wake_up() when that flag is set.
+ */
+
+#define RX_RING_CACHE_LINE 64
+
+struct rx_ring {
+	char *buffer;
+	ULONG size;
+	ULONG segment_size;
+	ULONG num_segments;
+	ULONG *segment_len;
+	volatile LONG *segment_done;
+	struct wait_queue_head *data_available;		/* consumer waits */
+	struct wait_queue_head *buffer_available;	/* producer waits */
+
+	volatile ULONG head;		/* written by producer */
+	ULONG posted;			/* producer only */
+	volatile LONG consumer_waiting;
+		/* Keep producer and consumer data on different
+		 * cache lines.
+		 */
+	char pad[RX_RING_CACHE_LINE];
+	volatile ULONG tail;		/* written by consumer */
+	ULONG read_offset;		/* consumer only, within tail */
+	volatile LONG producer_waiting;
+};
+
+extern int rx_ring_init(struct rx_ring *r, ULONG size, ULONG num_segments, struct wait_queue_head *data_available, struct wait_queue_head *buffer_available);
+extern void rx_ring_free(struct rx_ring *r);
+extern ULONG rx_ring_readable(struct rx_ring *r, char **p);
+extern void rx_ring_consumed(struct rx_ring *r, ULONG n);
+extern ULONG rx_ring_bytes(struct rx_ring *r);
+extern ULONG rx_ring_writable(struct rx_ring *r, char **p);
+extern ULONG rx_ring_post(struct rx_ring *r);
+extern void rx_ring_completed(struct rx_ring *r, ULONG segment, ULONG n);
+extern int rx_ring_can_publish(struct rx_ring *r);
+extern int rx_ring_publish(struct rx_ring *r);
+
+extern atomic_t64 windrbd_rx_ring_wakeups;
+
+	/* Receive requests (WskReceive IRPs) the receive thread keeps
+	 * outstanding per socket, registry value receive_irps_per_socket.
+	 */
+#define RECEIVE_IRPS_DEFAULT 4
+#define RECEIVE_IRPS_MAX 16
+
+struct rx_irp;
+
+extern atomic_t64 windrbd_receive_irps;
+extern atomic_t64 windrbd_receive_irps_cancelled;
+
+extern atomic_t64 windrbd_wsk_sends;
+extern atomic_t64 windrbd_sent_packets;
+extern atomic_t64 windrbd_sendmsg_kvecs;
+extern atomic_t64 windrbd_async_sends;
+extern atomic_t64 windrbd_sync_sends;
+extern int windrbd_async_send_max_size;
+
+/* Large MSG_WAITALL reads (DRBD payloads) bypass the receiver
+ * cache: kernel_recvmsg() hands the caller's buffer to the socket
+ * receive thread which receives directly into it once the
+ * outstanding receives into the ring are completed (they are not
+ * cancelled), so the data stays in order. Whatever they delivered
+ * is copied by kernel_recvmsg().
+ */
+
+enum direct_receive_state {
+	DIRECT_RECEIVE_NONE,
+	DIRECT_RECEIVE_REQUESTED,	/* by kernel_recvmsg() */
+	DIRECT_RECEIVE_RUNNING,		/* receive thread took it */
+	DIRECT_RECEIVE_DONE
+};
+
+	/* Registry value zero_copy_receive_threshold, 0 disables
+	 * direct receives.
+	 */
+extern int windrbd_zero_copy_receive_threshold;
+
+extern atomic_t64 windrbd_receive_bytes_copied;
+extern atomic_t64 windrbd_receive_bytes_zero_copy;
+extern atomic_t64 windrbd_zero_copy_receives;
+
 struct socket {
 	struct _WSK_SOCKET *wsk_socket;
 	ULONG wsk_flags;
@@ -115,16 +211,22 @@ struct socket {
 	int is_closed;
 
 	int receiver_cache_enabled;
-	char *receive_buffer;
-	int receive_buffer_size;
-	int write_index;
-	int read_index;
-	bool receive_buffer_full;
+	struct rx_ring rx_ring;
+	int num_rx_irps;
+	struct rx_irp *rx_irps;		/* rx_irps[segment & (num_rx_irps-1)] */
+	volatile LONG rx_irps_completing;
+
+	volatile LONG direct_state;	/* enum direct_receive_state */
+	char *direct_buf;
+	ULONG direct_len;
+	ULONG direct_buffered;		/* part of it still in rx_ring */
+	int direct_result;
+	volatile LONG direct_abort;	/* caller was signalled */
+	struct task_struct *receive_thread;
 	struct wait_queue_head buffer_available;
 	struct wait_queue_head data_available;
 	bool receive_thread_should_run;
 	struct completion receiver_thread_completion;
-	spinlock_t receive_lock;
 	bool have_printed_status;
 
 	struct wait_queue_head connected_waitqueue;
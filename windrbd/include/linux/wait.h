@@ -12,8 +12,15 @@ struct wait_queue_entry
 {
 	struct list_head entry;
 	KEVENT windows_event;
+	unsigned int flags;
 };
 
+/* Exclusive waiters are queued at the tail and wake_up() wakes
+ * only one of them (wake_up_nr() nr of them). Non-exclusive
+ * waiters are always woken.
+ */
+#define WQ_FLAG_EXCLUSIVE	0x01
+
 struct wait_queue_head
 {
 	spinlock_t lock;
@@ -30,13 +37,16 @@ static __inline void init_waitqueue_head(wait_queue_head_t *q)
 
 #define DEFINE_WAIT(name) struct wait_queue_entry (name) = {	\
 		.entry = LIST_HEAD_INIT((name).entry),		\
+		.flags = 0,					\
 	};							\
 	KeInitializeEvent(&(name).windows_event, SynchronizationEvent, FALSE);
 
 void prepare_to_wait_debug(struct wait_queue_head *w, struct wait_queue_entry *e, int interruptible, const char *file, int line, const char *func);
+void prepare_to_wait_exclusive_debug(struct wait_queue_head *w, struct wait_queue_entry *e, int interruptible, const char *file, int line, const char *func);
 void finish_wait_debug(struct wait_queue_head *w, struct wait_queue_entry *e, const char *file, int line, const char *func);
 
 #define prepare_to_wait(w, e, i) prepare_to_wait_debug(w, e, i, __FILE__, __LINE__, __func__)
+#define prepare_to_wait_exclusive(w, e, i) prepare_to_wait_exclusive_debug(w, e, i, __FILE__, __LINE__, __func__)
 #define finish_wait(w, e) finish_wait_debug(w, e, __FILE__, __LINE__, __func__)
 
 void schedule_debug(const char *file, int line, const char *func);
@@ -57,12 +67,18 @@ LONG_PTR ll_schedule_debug(LONG_PTR timeout, int return_error, int interruptible
 
 /* One macro for all cases of wait_event: if there is a bug it is
  * most likely in here ...
+ *
+ * A wakeup after which the condition is still false counts as
+ * spurious.
  */
 
-#define ll_wait_event_macro(ret, wait_queue, condition, timeout, interruptible) \
+#define ll_wait_event_macro(ret, wait_queue, condition, timeout, interruptible, exclusive) \
 do {									\
 	LONG_PTR __timeout = timeout;					\
+	int __woken = 0;						\
 	DEFINE_WAIT(__wait);						\
+	if (exclusive)							\
+		__wait.flags |= WQ_FLAG_EXCLUSIVE;			\
 	while (1) {							\
 		prepare_to_wait(&wait_queue, &__wait, interruptible);	\
 		if (condition) {					\
@@ -70,6 +86,8 @@ do {									\
 				__timeout = 1;				\
 			break;						\
 		}							\
+		if (__woken)						\
+			atomic_inc64(&windrbd_spurious_wakeups); \
 									\
 		__timeout = ll_schedule_debug(				\
 			__timeout, 1, interruptible,			\
@@ -77,7 +95,7 @@ do {									\
 									\
 		if (__timeout <= 0) 					\
 			break;						\
-									\
+		__woken = 1;						\
 	}								\
 	finish_wait(&wait_queue, &__wait);				\
 	ret = __timeout;						\
@@ -88,13 +106,13 @@ do {									\
 do {									\
 	int unused;							\
 	ll_wait_event_macro(unused, wait_queue, condition,		\
-		MAX_SCHEDULE_TIMEOUT, TASK_UNINTERRUPTIBLE);		\
+		MAX_SCHEDULE_TIMEOUT, TASK_UNINTERRUPTIBLE, 0);		\
 } while (0);
 
 #define wait_event_timeout(ret, wait_queue, condition, timeout)		\
 do {									\
 	ll_wait_event_macro(ret, wait_queue, condition,			\
-		timeout, TASK_UNINTERRUPTIBLE);				\
+		timeout, TASK_UNINTERRUPTIBLE, 0);			\
 	if (ret == -ETIMEDOUT) 						\
 		ret = 0;						\
 } while (0);
@@ -102,7 +120,7 @@ do {									\
 #define wait_event_interruptible(ret, wait_queue, condition)		\
 do {									\
 	ll_wait_event_macro(ret, wait_queue, condition,			\
-		MAX_SCHEDULE_TIMEOUT, TASK_INTERRUPTIBLE);		\
+		MAX_SCHEDULE_TIMEOUT, TASK_INTERRUPTIBLE, 0);		\
 	if (ret > 0)							\
 		ret = 0;						\
 } while (0);
@@ -110,15 +128,37 @@ do {									\
 #define wait_event_interruptible_timeout(ret, wait_queue, condition, timeout) \
 do {									\
 	ll_wait_event_macro(ret, wait_queue, condition,			\
-		timeout, TASK_INTERRUPTIBLE);				\
+		timeout, TASK_INTERRUPTIBLE, 0);			\
 	if (ret == -ETIMEDOUT) 						\
 		ret = 0;						\
 } while (0);
 
+/* Like wait_event() and wait_event_interruptible() but as an
+ * exclusive waiter: use them when any one of the waiters can
+ * handle the event (like a worker waiting for work).
+ */
+
+#define wait_event_exclusive(wait_queue, condition)			\
+do {									\
+	int unused;							\
+	ll_wait_event_macro(unused, wait_queue, condition,		\
+		MAX_SCHEDULE_TIMEOUT, TASK_UNINTERRUPTIBLE, 1);		\
+} while (0);
+
+#define wait_event_interruptible_exclusive(ret, wait_queue, condition)	\
+do {									\
+	ll_wait_event_macro(ret, wait_queue, condition,			\
+		MAX_SCHEDULE_TIMEOUT, TASK_INTERRUPTIBLE, 1);		\
+	if (ret > 0)							\
+		ret = 0;						\
+} while (0);
+
 void wake_up_debug(wait_queue_head_t *q, const char *file, int line, const char *func);
+void wake_up_nr_debug(wait_queue_head_t *q, int nr, const char *file, int line, const char *func);
 void wake_up_all_debug(wait_queue_head_t *q, const char *file, int line, const char *func);
 
 #define wake_up(q) wake_up_debug(q, __FILE__, __LINE__, __func__)
+#define wake_up_nr(q, nr) wake_up_nr_debug(q, nr, __FILE__, __LINE__, __func__)
 #define wake_up_all(q) wake_up_all_debug(q, __FILE__, __LINE__, __func__)
 
 void init_waitqueue(void);
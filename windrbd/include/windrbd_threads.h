@@ -26,9 +26,14 @@ void windrbd_reap_threads(void);
 	/* This waits forever, only use this on driver unload */
 void windrbd_reap_all_threads(void);
 
+	/* O(1) and lock free, see windrbd_threads.c */
 struct task_struct* windrbd_find_thread(PKTHREAD id);
 #define current	windrbd_find_thread(KeGetCurrentThread())
 
+	/* For the current_benchmark and thread_stats run-tests */
+struct task_struct *windrbd_find_thread_in_list(PKTHREAD id);
+void windrbd_print_thread_hash_stats(void);
+
 #define TASK_COMM_LEN 32
 
 struct task_struct {
@@ -63,6 +68,7 @@ struct task_struct {
 	int is_zombie:1;
 	int is_root:1;
 	int in_rcu:1;
+	int in_thread_hash:1;	/* else on thread_list only */
 
 	const char *rcu_file;
 	int rcu_line;
@@ -143,6 +143,7 @@ DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING RegistryPath)
 	init_windrbd();
 	init_locking();
 	init_waitqueue();
+	init_timers();
 
 	/* Next, the threads subsystem (so DRBD can create threads).
          * Also makes current valid (needed in spinlock debugging).
@@ -163,7 +164,10 @@ DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING RegistryPath)
 #endif
 
 	init_transport();
+	init_rcu();
 	init_free_bios();
+	init_zero_page();
+	init_bio_slab();
 
 	make_me_a_windrbd_thread("driver-init");
 	sudo();
@@ -177,6 +181,7 @@ DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING RegistryPath)
 
 	initRegistry(RegistryPath);
 	init_event_log();
+	windrbd_init_io_tunables();
 
 	status = create_device(WINDRBD_ROOT_DEVICE_NAME, &SDDL_DEVOBJ_SYS_ALL_ADM_ALL, &mvolRootDeviceObject);
 	if (status != STATUS_SUCCESS)
@@ -201,7 +206,10 @@ DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING RegistryPath)
 
 	dtt_initialize();
 
-	system_wq = alloc_ordered_workqueue("system workqueue", 0);
+		/* Per-CPU like on Linux: plug flushes and bio retries
+		 * of different devices need not wait for each other.
+		 */
+	system_wq = alloc_workqueue("events", 0, 0);
 	if (system_wq == NULL) {
 		printk("Could not allocate system work queue\n");
 		IoDeleteDevice(mvolRootDeviceObject);
@@ -317,6 +325,12 @@ void mvolUnload(IN PDRIVER_OBJECT DriverObject)
 	shutdown_free_bios();
 	printk("Free bios shut down.\n");
 
+	shutdown_rcu();
+	printk("RCU shut down.\n");
+
+	shutdown_zero_page();
+	shutdown_bio_slab();
+
 	windrbd_shutdown_netlink();
 	printk("Netlink layer shut down.\n");
 
@@ -325,6 +339,9 @@ void mvolUnload(IN PDRIVER_OBJECT DriverObject)
 	windrbd_reap_all_threads();
 	printk("Reaped remaining DRBD threads\n");
 
+	shutdown_timers();
+	printk("Timers shut down.\n");
+
 	shutdown_registry();
 	printk("Registry layer shut down\n");
 
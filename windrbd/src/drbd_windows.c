@@ -151,69 +151,6 @@ uint64_t roundup(uint64_t x, uint64_t y)
 	return (((x) + (y - 1)) / y) * y;
 }
 
-//__ffs - find first bit in word.
-ULONG_PTR __ffs(ULONG_PTR word) 
-{
-	int num = 0;
-
-#if BITS_PER_LONG == 64
-	if ((word & 0xffffffff) == 0) {
-		num += 32;
-		word >>= 32;
-	}
-#endif
-	if ((word & 0xffff) == 0) {
-		num += 16;
-		word >>= 16;
-	}
-	if ((word & 0xff) == 0) {
-		num += 8;
-		word >>= 8;
-	}
-	if ((word & 0xf) == 0) {
-		num += 4;
-		word >>= 4;
-	}
-	if ((word & 0x3) == 0) {
-		num += 2;
-		word >>= 2;
-	}
-	if ((word & 0x1) == 0)
-		num += 1;
-	return num;
-}
-
-#define ffz(x)  __ffs(~(x))
-
-int fls(int x)
-{
-	int r = 32;
-
-	if (!x)
-		return 0;
-	if (!(x & 0xffff0000u)) {
-		x <<= 16;
-		r -= 16;
-	}
-	if (!(x & 0xff000000u)) {
-		x <<= 8;
-		r -= 8;
-	}
-	if (!(x & 0xf0000000u)) {
-		x <<= 4;
-		r -= 4;
-	}
-	if (!(x & 0xc0000000u)) {
-		x <<= 2;
-		r -= 2;
-	}
-	if (!(x & 0x80000000u)) {
-		x <<= 1;
-		r -= 1;
-	}
-	return r;
-}
-
 #define BITOP_WORD(nr)          ((nr) / BITS_PER_LONG)
 
 ULONG_PTR find_first_bit(const ULONG_PTR* addr, ULONG_PTR size)
@@ -386,123 +323,6 @@ int find_next_zero_bit(const ULONG_PTR * addr, ULONG_PTR size, ULONG_PTR offset)
     return offset + find_first_zero_bit(p, size);
  }
 
-static spinlock_t g_test_and_change_bit_lock;
-
-int test_and_change_bit(int nr, volatile ULONG_PTR *addr)
-{
-	ULONG_PTR mask = BIT_MASK(nr);
-	ULONG_PTR *p = ((ULONG_PTR *) addr);
-	ULONG_PTR old;
-	KIRQL flags;
-
-	spin_lock_irqsave(&g_test_and_change_bit_lock, flags);
-	old = *p;
-	*p = old ^ mask;
-	spin_unlock_irqrestore(&g_test_and_change_bit_lock, flags);
-
-	return (old & mask) != 0;
-}
-
-LONG_PTR xchg(LONG_PTR *target, LONG_PTR value)
-{
-#ifdef _WIN64
-	return (InterlockedExchange64(target, value));
-#else
-	return (InterlockedExchange(target, value));
-#endif
-}
-
-
-void atomic_set(atomic_t *v, int i)
-{
-	InterlockedExchange((long *)v, i);
-}
-
-void atomic_add(int i, atomic_t *v)
-{
-	InterlockedExchangeAdd((long *)v, i);
-}
-
-void atomic_add64(LONGLONG a, atomic_t64 *v)
-{
-	InterlockedExchangeAdd64((LONGLONG*)v, a);
-}
-
-	/* TODO: atomic? Results may be non-monotonic decreasing, not
-	 * sure if double values can occur.
-	 */
-int atomic_add_return(int i, atomic_t *v)
-{
-	int retval;
-	retval = InterlockedExchangeAdd((LONG*)v, i);
-	retval += i;
-	return retval;
-}
-
-void atomic_sub(int i, atomic_t *v)
-{
-	atomic_sub_return(i, v);
-}
-
-void atomic_sub64(LONGLONG a, atomic_t64 *v)
-{
-	atomic_sub_return64(a, v);
-}
-
-	/* TODO: atomic? Results may be non-monotonic decreasing, not
-	 * sure if double values can occur.
-	 */
-int atomic_sub_return(int i, atomic_t *v)
-{
-	int retval;
-	retval = InterlockedExchangeAdd((LONG*)v, -i);
-	retval -= i;
-	return retval;
-}
-
-LONGLONG atomic_sub_return64(LONGLONG a, atomic_t64 *v)
-{
-	LONGLONG retval;
-	retval = InterlockedExchangeAdd64((LONGLONG*)v, -a);
-	retval -= a;
-	return retval;
-}
-
-	/* TODO: this is really atomic? */
-
-int atomic_dec_and_test(atomic_t *v)
-{
-	return (0 == InterlockedDecrement((LONG*)v));
-}
-
-int atomic_sub_and_test(int i, atomic_t *v)
-{
-	LONG_PTR retval;
-	retval = InterlockedExchangeAdd((LONG*)v, -i);
-	retval -= i;
-	return (retval == 0);
-}
-
-int atomic_cmpxchg(atomic_t *v, int old, int new)
-{
-	return InterlockedCompareExchange((long *)v, new, old);
-}
-
-int atomic_xchg(atomic_t *v, int n)
-{
-	return InterlockedExchange((LONG*)v, n);
-}
-
-int atomic_read(const atomic_t *v)
-{
-	return InterlockedAnd((LONG*)v, 0xffffffff);
-}
-
-LONGLONG atomic_read64(const atomic_t64 *v)
-{
-	return InterlockedAnd64((LONGLONG*)v, 0xffffffffffffffff);
-}
-
 #ifndef KMALLOC_DEBUG
 
 	/* TODO: we would save patches to DRBD if we skip the tag
@@ -810,10 +630,14 @@ static struct bio *bio_alloc_ll(gfp_t gfp_mask, int nr_iovecs, ULONG Tag)
 {
 	struct bio *bio;
 
-	bio = kzalloc(sizeof(struct bio) + nr_iovecs * sizeof(struct bio_vec), gfp_mask, Tag);
-	if (!bio)
-	{
-		return 0;
+	bio = windrbd_bio_slab_alloc(nr_iovecs);
+	if (bio == NULL) {
+		bio = kzalloc(sizeof(struct bio) + nr_iovecs * sizeof(struct bio_vec), gfp_mask, Tag);
+		if (!bio)
+		{
+			return 0;
+		}
+		atomic_inc64(&windrbd_bio_pool_allocations);
 	}
 	bio->bi_max_vecs = nr_iovecs;
 	bio->bi_cnt = 1;
@@ -904,6 +728,14 @@ static void free_mdls_and_irp(struct bio *bio)
 		if (bio->bi_irps[r] == NULL)
 			continue;
 
+			/* The scatter/gather (and repeated page) MDL does
+			 * not lock the pages itself, they belong to the bio. Don't let
+			 * free_mdl_chain_and_irp() unlock them.
+			 */
+		if ((bio->bi_using_scatter_gather || test_bit(BI_WINDRBD_FLAG_REPEAT_PAGE, &bio->bi_windrbd_flags)) &&
+		    bio->bi_irps[r]->MdlAddress != NULL)
+			bio->bi_irps[r]->MdlAddress->MdlFlags &= ~MDL_PAGES_LOCKED;
+
 		/* This has to be done before freeing the buffers with
 		 * __free_page(). Else we get a PFN list corrupted (or
 		 * so) BSOD.
@@ -912,7 +744,8 @@ static void free_mdls_and_irp(struct bio *bio)
 		free_mdl_chain_and_irp(bio->bi_irps[r]);
 	}
 
-	kfree(bio->bi_irps);
+	if (bio->bi_irps != bio->bi_inline_irps)
+		kfree(bio->bi_irps);
 	bio->bi_irps = NULL;
 }
 
@@ -946,85 +779,190 @@ void bio_put(struct bio *bio)
 
 #endif
 
-static LIST_HEAD(bios_to_be_freed_list);
-static LIST_HEAD(bios_to_be_freed_list2);
-static spinlock_t bios_to_be_freed_lock;
-static struct wait_queue_head bios_to_be_freed_event;
+	/* Bios that cannot be freed right away (see can_free_bio_now())
+	 * are put on a per-CPU lock-free list. A small pool of threads
+	 * drains them in batches, worker n takes the lists of CPUs
+	 * n, n+num_free_bios_workers, ...
+	 */
+
+#define MAX_FREE_BIOS_WORKERS 4
+
+struct free_bios_worker {
+	struct task_struct *thread;
+	struct wait_queue_head event;
+	atomic_t queued;	/* wake up if this goes from 0 to 1 */
+	int num;
+};
+
+static SLIST_HEADER *bio_free_queues;	/* one per CPU */
+static ULONG num_bio_free_queues;
+static struct free_bios_worker free_bios_workers[MAX_FREE_BIOS_WORKERS];
+static int num_free_bios_workers;
 static bool free_bios_thread_should_run;
-static struct task_struct *free_bios_thread;
 
-	/* That just puts to bio on the to_be_freed list. Reason
-	 * is that free_mdl...() must not run at IRQL > PASSIVE_LEVEL
+	/* Registry value immediate_bio_free. If 0 all bios are
+	 * freed by the free bios threads.
 	 */
 
-void bio_free(struct bio *bio)
+int windrbd_immediate_bio_free = 1;
+
+	/* Print them with windrbd run-test bio_free_stats.
+	 * Latencies are in 100ns units (KeQueryInterruptTime()).
+	 */
+
+atomic_t64 windrbd_bios_freed_immediately;
+atomic_t64 windrbd_bios_freed_deferred;
+atomic_t64 windrbd_bio_free_batches;
+atomic_t64 windrbd_bio_free_queue_max;
+atomic_t64 windrbd_bio_free_latency_total;
+atomic_t64 windrbd_bio_free_latency_max;
+
+int windrbd_bio_free_queue_length(void)
+{
+	int i, n;
+
+	n = 0;
+	for (i=0;i<num_free_bios_workers;i++)
+		n += atomic_read(&free_bios_workers[i].queued);
+
+	return n;
+}
+
+void update_max64(atomic_t64 *max, LONGLONG val)
+{
+	LONGLONG old;
+
+	while ((old = atomic_read64(max)) < val)
+		if (InterlockedCompareExchange64(max, val, old) == old)
+			break;
+}
+
+static void free_bio_now(struct bio *bio)
 {
-	KIRQL flags;
-	int i;
 	struct bio *upper_bio = bio->is_cloned_from;
+	int i;
+
+	free_mdls_and_irp(bio);
+// printk("out of free_mdls_and_irp(%p) page is %p page refcount is %d\n", bio, bio->bi_io_vec[0].bv_page, refcount_read(&bio->bi_io_vec[0].bv_page->kref.refcount));
+	for (i=0;i<bio->bi_vcnt;i++) {
+		put_page(bio->bi_io_vec[i].bv_page);
+	}
+	if (bio->patched_bootsector_buffer != NULL)
+		kfree(bio->patched_bootsector_buffer);
+
+	if (bio->bi_big_buffer != NULL)
+		kfree(bio->bi_big_buffer);
+
+	if (bio->delayed_io_completion && bio->bi_upper_irp != NULL)
+		IoCompleteRequest(bio->bi_upper_irp, bio->bi_upper_irp->IoStatus.Status != STATUS_SUCCESS ? IO_NO_INCREMENT : IO_DISK_INCREMENT);
+
+	if (bio->bi_slab_class != 0)
+		windrbd_bio_slab_free(bio);
+	else
+		kfree(bio);
+
+		/* Only now: the upper bio completes its IRP when freed
+		 * (delayed_io_completion), our MDLs referencing the
+		 * IRP's buffer must be gone by then.
+		 */
+	if (upper_bio != NULL)
+		bio_put(upper_bio);
+}
+
+	/* Freeing MDLs of pageable memory (locked by
+	 * IoBuildAsynchronousFsdRequest()) must happen at
+	 * PASSIVE_LEVEL. Everything else is allowed up to
+	 * DISPATCH_LEVEL (completion routines run there).
+	 */
+
+static bool can_free_bio_now(struct bio *bio)
+{
+	KIRQL irql = KeGetCurrentIrql();
+
+	if (!windrbd_immediate_bio_free)
+		return false;
+	if (irql == PASSIVE_LEVEL)
+		return true;
+	if (irql > DISPATCH_LEVEL)
+		return false;
+
+	return bio->bi_irps == NULL || !bio->bi_paged_memory;
+}
+
+void bio_free(struct bio *bio)
+{
+	struct free_bios_worker *worker;
+	ULONG cpu;
+	int queued;
 
 	if (!list_empty(&bio->locally_submitted_bios)) {
 		printk("Warning: bio->locally_submitted_bios not empty.\n");
 	}
 
+	if (can_free_bio_now(bio)) {
+		atomic_inc64(&windrbd_bios_freed_immediately);
+		free_bio_now(bio);
+		return;
+	}
+	if (num_free_bios_workers == 0)
+		return;		/* leak, see init_free_bios() */
+
 		/* DRBD considers pages here as not in use any more.
 		 * however we still have MDLs referencing memory
-		 * of the page. So take a reference here and drop
-		 * it as soon as MDLs are freed.
+		 * of the page. They are freed by the worker.
 		 */
 
-	spin_lock_irqsave(&bios_to_be_freed_lock, flags);
-	list_add(&bio->to_be_freed_list, &bios_to_be_freed_list);
-	spin_unlock_irqrestore(&bios_to_be_freed_lock, flags);
+	cpu = KeGetCurrentProcessorNumberEx(NULL) % num_bio_free_queues;
+	worker = &free_bios_workers[cpu % num_free_bios_workers];
 
-		/* starting here bio might be invalid */
+	bio->bi_free_queued_time = KeQueryInterruptTime();
+	InterlockedPushEntrySList(&bio_free_queues[cpu], &bio->to_be_freed_entry);
 
-	if (upper_bio != NULL)
-		bio_put(upper_bio);
+		/* starting here bio might be invalid */
 
-	wake_up(&bios_to_be_freed_event);
+	queued = atomic_inc(&worker->queued);
+	update_max64(&windrbd_bio_free_queue_max, queued);
+	if (queued == 1)
+		wake_up(&worker->event);
 }
 
-	/* Since freeing parts of MDLs must happen at IRQL = PASSIVE_LEVEL
-	 * (for user space allocated data) we use this thread to free
-	 * the IRPs.
-	 */
-
-static int free_bios_thread_fn(void *unused)
+static int free_bios_thread_fn(void *p)
 {
-	KIRQL flags;
-	struct bio *bio, *bio2;
-	int i;
+	struct free_bios_worker *worker = p;
+	PSLIST_ENTRY e, next;
+	struct bio *bio;
+	ULONGLONG latency;
+	ULONG cpu;
+	int n;
 
 	while (1) {
-		wait_event(bios_to_be_freed_event, !list_empty(&bios_to_be_freed_list) || !free_bios_thread_should_run);
+		wait_event(worker->event, atomic_read(&worker->queued) > 0 || !free_bios_thread_should_run);
 		if (!free_bios_thread_should_run)
 			break;
 
-		spin_lock_irqsave(&bios_to_be_freed_lock, flags);
-		list_for_each_entry_safe(struct bio, bio, bio2, &bios_to_be_freed_list, to_be_freed_list) {
-			list_del(&bio->to_be_freed_list);
-			list_add(&bio->to_be_freed_list2, &bios_to_be_freed_list2);
-		}
-		spin_unlock_irqrestore(&bios_to_be_freed_lock, flags);
-
-		list_for_each_entry_safe(struct bio, bio, bio2, &bios_to_be_freed_list2, to_be_freed_list2) {
-			list_del(&bio->to_be_freed_list2);
-			free_mdls_and_irp(bio);
-// printk("out of free_mdls_and_irp(%p) page is %p page refcount is %d\n", bio, bio->bi_io_vec[0].bv_page, refcount_read(&bio->bi_io_vec[0].bv_page->kref.refcount));
-			for (i=0;i<bio->bi_vcnt;i++) {
-				put_page(bio->bi_io_vec[i].bv_page);
-			}
-			if (bio->patched_bootsector_buffer != NULL)
-				kfree(bio->patched_bootsector_buffer);
-
-			if (bio->bi_big_buffer != NULL)
-				kfree(bio->bi_big_buffer);
+		n = 0;
+		for (cpu=worker->num; cpu<num_bio_free_queues; cpu+=num_free_bios_workers) {
+			for (e = InterlockedFlushSList(&bio_free_queues[cpu]); e != NULL; e = next) {
+				next = e->Next;
+				bio = container_of(e, struct bio, to_be_freed_entry);
 
-			if (bio->delayed_io_completion && bio->bi_upper_irp != NULL)
-				IoCompleteRequest(bio->bi_upper_irp, bio->bi_upper_irp->IoStatus.Status != STATUS_SUCCESS ? IO_NO_INCREMENT : IO_DISK_INCREMENT);
+				latency = KeQueryInterruptTime() - bio->bi_free_queued_time;
+				atomic_add64(latency, &windrbd_bio_free_latency_total);
+				update_max64(&windrbd_bio_free_latency_max, latency);
 
-			kfree(bio);
+				free_bio_now(bio);
+				n++;
+			}
+		}
+			/* The producer increments after pushing, so this
+			 * may become negative for a short time. It is
+			 * positive again (with a wake up) when the
+			 * increments are done.
+			 */
+		if (n > 0) {
+			atomic_inc64(&windrbd_bio_free_batches);
+			atomic_add64(n, &windrbd_bios_freed_deferred);
+			atomic_sub(n, &worker->queued);
 		}
 	}
 
@@ -1033,20 +971,46 @@ static int free_bios_thread_fn(void *unused)
 
 void init_free_bios(void)
 {
-	spin_lock_init(&bios_to_be_freed_lock);
-	init_waitqueue_head(&bios_to_be_freed_event);
+	ULONG cpu;
+	int i;
+
+	num_bio_free_queues = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+		/* Pool memory is 16 byte aligned as SLIST_HEADER
+		 * needs it.
+		 */
+	bio_free_queues = ExAllocatePoolWithTag(NonPagedPool, num_bio_free_queues * sizeof(*bio_free_queues), 'FBDW');
+	if (bio_free_queues == NULL) {
+		printk("Warning: could not allocate free bios queues, bios will not be freed.\n");
+		return;
+	}
+	for (cpu=0;cpu<num_bio_free_queues;cpu++)
+		InitializeSListHead(&bio_free_queues[cpu]);
+
 	free_bios_thread_should_run = true;
-	free_bios_thread = kthread_run(free_bios_thread_fn, NULL, "free_bios");
-	if (free_bios_thread == NULL)
-		printk("Warning: could not start free_bios thread, bios will not be freed.\n");
+	for (i=0;i<MAX_FREE_BIOS_WORKERS && i<num_bio_free_queues;i++) {
+		free_bios_workers[i].num = i;
+		atomic_set(&free_bios_workers[i].queued, 0);
+		init_waitqueue_head(&free_bios_workers[i].event);
+	}
+	num_free_bios_workers = i;
+
+	for (i=0;i<num_free_bios_workers;i++) {
+		free_bios_workers[i].thread = kthread_run(free_bios_thread_fn, &free_bios_workers[i], "free_bios");
+		if (free_bios_workers[i].thread == NULL)
+			printk("Warning: could not start free_bios thread %d, some bios will not be freed.\n", i);
+	}
 }
 
 	/* Call this only when driver should be unloaded. */
 
 void shutdown_free_bios(void)
 {
+	int i;
+
 	free_bios_thread_should_run = false;
-	wake_up(&bios_to_be_freed_event);
+	for (i=0;i<num_free_bios_workers;i++)
+		wake_up(&free_bios_workers[i].event);
 
 		/* Let thread reaper do the rest */
 }
@@ -1069,6 +1033,10 @@ struct bio *bio_clone(struct bio * bio_src, int flag)
 	bio->bi_iter.bi_idx = bio_src->bi_iter.bi_idx;
 	bio->bi_num_requests = bio_src->bi_num_requests;
 	bio->bi_this_request = bio_src->bi_this_request;
+		/* Pages are shared, so MDLs of the clone must be
+		 * unlocked at PASSIVE_LEVEL too (see can_free_bio_now()).
+		 */
+	bio->bi_paged_memory = bio_src->bi_paged_memory;
 
 	for (i=0;i<bio->bi_vcnt;i++) {
 		get_page(bio->bi_io_vec[i].bv_page);
@@ -1178,163 +1146,6 @@ void complete_all_debug(struct completion *c, const char *file, int line, const
 // printk("%p completed\n", c);
 }
 
-struct workqueue_struct *system_wq;
-
-void queue_work(struct workqueue_struct *queue, struct work_struct *work)
-{
-	KIRQL flags, flags2;
-
-	if (queue->about_to_destroy) {
-		printk("Warning: Attempt to queue_work while destroying workqueue\n");
-		return;
-	}
-	spin_lock_irqsave(&queue->work_list_lock, flags2);
-	spin_lock_irqsave(&work->pending_lock, flags);
-
-	if (work->pending) {
-		spin_unlock_irqrestore(&work->pending_lock, flags);
-		spin_unlock_irqrestore(&queue->work_list_lock, flags2);
-		if (queue != work->orig_queue || work->orig_func != work->func)
-			printk("work %p pending on queue %s: queue or func have changed: queue is %p (%s) work->orig_queue is %p (%s) work->orig_func is %p work->func is %p\n", queue, queue->name, work->orig_queue, work->orig_queue->name, work->orig_func, work->func);
-
-		return;
-	}
-	work->pending = 1;
-
-	work->orig_queue = queue;
-	work->orig_func = work->func;
-
-	list_add_tail(&work->work_list, &queue->work_list);
-	spin_unlock_irqrestore(&work->pending_lock, flags);
-	spin_unlock_irqrestore(&queue->work_list_lock, flags2);
-
-		/* signal to run_singlethread_workqueue */
-	KeSetEvent(&queue->wakeupEvent, 0, FALSE);
-}
-
-static int run_singlethread_workqueue(struct workqueue_struct* wq)
-{
-	NTSTATUS status = STATUS_UNSUCCESSFUL;
-	PVOID waitObjects[2] = { &wq->wakeupEvent, &wq->killEvent };
-	int maxObj = 2;
-	struct work_struct *w;
-	KIRQL flags, flags2;
-
-	while (wq->run) {
-		status = KeWaitForMultipleObjects(maxObj, &waitObjects[0], WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
-
-		switch (status) {
-		case STATUS_WAIT_0:
-			while (1) {
-				spin_lock_irqsave(&wq->work_list_lock, flags);
-				if (list_empty(&wq->work_list)) {
-					spin_unlock_irqrestore(&wq->work_list_lock, flags);
-					break;
-				}
-				w = list_first_entry(&wq->work_list, struct work_struct, work_list);
-				spin_lock_irqsave(&w->pending_lock, flags2);
-				list_del(&w->work_list);
-
-		/* If we do this after calling func, it hangs in Disconnecting
-		 * (or disk Failed) state forever ... Update: no this also
-		 * happens when this is after calling func. Must be something
-		 * else ... If this is here we get use after free.
-		 */
-				w->pending = 0;
-				spin_unlock_irqrestore(&w->pending_lock, flags2);
-				spin_unlock_irqrestore(&wq->work_list_lock, flags);
-
-				if (wq->about_to_destroy) {
-					printk("About to destroy workqueue %s not calling function\n", wq->name);
-				} else {
-// printk("into func\n");
-					w->func(w);
-				}
-			}
-			KeSetEvent(&wq->workFinishedEvent, 0, FALSE);
-			break;
-
-		case STATUS_WAIT_1:
-			wq->run = FALSE;
-			break;
-		}
-	}
-	KeSetEvent(&wq->readyToFreeEvent, 0, FALSE);
-	return 0;
-}
-
-struct workqueue_struct *alloc_ordered_workqueue(const char * fmt, int flags, ...)
-{
-	struct workqueue_struct *wq;
-	va_list args;
-
-	wq = kzalloc(sizeof(*wq), GFP_KERNEL, '31DW');
-	if (wq == NULL) {
-		printk("Warning: not enough memory for workqueue\n");
-		return NULL;
-	}
-
-	KeInitializeEvent(&wq->wakeupEvent, SynchronizationEvent, FALSE);
-	KeInitializeEvent(&wq->killEvent, SynchronizationEvent, FALSE);
-	KeInitializeEvent(&wq->workFinishedEvent, SynchronizationEvent, FALSE);
-	KeInitializeEvent(&wq->readyToFreeEvent, SynchronizationEvent, FALSE);
-
-	INIT_LIST_HEAD(&wq->work_list);
-	spin_lock_init(&wq->work_list_lock);
-	wq->about_to_destroy = 0;
-
-	va_start(args, flags);
-		/* ignore error if string is too long */
-	(void) RtlStringCbVPrintfA(wq->name, sizeof(wq->name)-1, fmt, args);
-	wq->name[sizeof(wq->name)-1] = '\0';
-	va_end(args);
-
-	wq->run = TRUE;
-
-	wq->thread = kthread_create(run_singlethread_workqueue, wq, "wq_%s", wq->name);
-	if (IS_ERR(wq->thread)) {
-		printk("kthread_run failed on creating workqueue thread, err is %d\n", PTR_ERR(wq->thread));
-		kfree(wq);
-		return NULL;
-	}
-	wake_up_process(wq->thread);
-
-	return wq;
-}
-
-/* This should ensure that all work on the workqueue is done (has finished).
- * It is typically invoked when a driver shuts down a resource (for example
- * on drbdadm down).
- */
-void flush_workqueue(struct workqueue_struct *wq)
-{
-	PVOID waitObjects[2] = { &wq->workFinishedEvent, &wq->killEvent };
-	NTSTATUS status;
-
-	KeResetEvent(&wq->workFinishedEvent);
-	KeSetEvent(&wq->wakeupEvent, 0, FALSE);
-	status = KeWaitForMultipleObjects(2, &waitObjects[0], WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
-	if (!list_empty(&wq->work_list)) {
-		printk("Warning: wq->work_list not empty at exiting flush_workqueue\n");
-	}
-}
-
-void destroy_workqueue(struct workqueue_struct *wq)
-{
-// printk("1 wq is %s\n", wq->name);
-	wq->about_to_destroy = 1;
-// printk("2 wq is %s\n", wq->name);
-	flush_workqueue(wq);
-// printk("3 wq is %s\n", wq->name);
-	KeSetEvent(&wq->killEvent, 0, FALSE);
-// printk("4 wq is %s\n", wq->name);
-	KeWaitForSingleObject(&wq->readyToFreeEvent, Executive, KernelMode, FALSE, NULL);
-// printk("5 wq is %s\n", wq->name);
-
-	kfree(wq);
-// printk("6 wq is %s\n", wq->name);
-}
-
 int threads_sleeping;
 
 void enter_interruptible_debug(const char *file, int line, const char *func)
@@ -1405,136 +1216,33 @@ int page_count(struct page *page)
 	return atomic_read(&page->kref.refcount.refs);
 }
 
-static void timer_callback(PKDPC dpc, struct timer_list* timer, PVOID arg1, PVOID arg2)
-{
-	(void)arg1;
-	(void)arg2;
-	(void)dpc;
-	timer->function(timer);
-}
-
-void timer_setup(struct timer_list *timer, void(*callback)(struct timer_list *timer), ULONG_PTR flags_unused)
+void kobject_put(struct kobject *kobj)
 {
-	timer->function = callback;
-	KeInitializeTimer(&timer->ktimer);
-	KeInitializeDpc(&timer->dpc, (PKDEFERRED_ROUTINE)timer_callback, timer);
-}
+    if (kobj) 
+    {
+        if (kobj->name == NULL)
+        {
+            return;
+        }
 
-void add_timer(struct timer_list *t)
-{
-	mod_timer(t, t->expires);
+		if (atomic_sub_and_test(1, &kobj->kref.refcount.refs))
+		{
+			void(*release)(struct kobject *kobj);
+			release = kobj->ktype->release;
+			if (release == 0)
+			{
+				return;
+			}
+			release(kobj);
+		}
+    }
+    else
+    {
+        return;
+    }
 }
 
-void del_timer(struct timer_list *t)
-{
-	KeCancelTimer(&t->ktimer);
-    t->expires = 0;
-}
-
-/**
- * timer_pending - is a timer pending?
- * @timer: the timer in question
- *
- * timer_pending will tell whether a given timer is currently pending,
- * or not. Callers must ensure serialization wrt. other operations done
- * to this timer, eg. interrupt contexts, or other CPUs on SMP.
- *
- * return value: 1 if the timer is pending, 0 if not.
- */
-int timer_pending(const struct timer_list * timer)
-{
-    return timer->ktimer.Header.Inserted;
-}
-
-
-	/* TODO: sync? */
-
-int del_timer_sync(struct timer_list *t)
-{
-	bool pending = 0;
-	pending = timer_pending(t);
-	
-	del_timer(t);
-
-	return pending;
-}
-
-
-static int __mod_timer(struct timer_list *timer, ULONG_PTR expires, bool pending_only)
-{
-	int pending = timer_pending(timer);
-
-	if (!pending && pending_only)
-		return 0;
-
-	LARGE_INTEGER nWaitTime = { .QuadPart = 0 };
-	ULONG_PTR current_milisec = jiffies;
-
-	timer->expires = expires;
-
-	if (current_milisec >= expires)
-		nWaitTime.QuadPart = -1;
-	else {
-		expires -= current_milisec;
-		nWaitTime.QuadPart = RELATIVE(MILLISECONDS(expires));
-	}
-
-/*
-  printk("%s timer(0x%p) current(%d) expires(%d) gap(%d) nWaitTime(%lld)\n",
-        timer->name, timer, current_milisec, timer->expires, timer->expires - current_milisec, nWaitTime.QuadPart);
-*/
-
-	KeSetTimer(&timer->ktimer, nWaitTime, &timer->dpc);
-	return pending;
-}
-
-/**
- * mod_timer_pending - modify a pending timer's timeout
- * @timer: the pending timer to be modified
- * @expires: new timeout in jiffies
- *
- * mod_timer_pending() is the same for pending timers as mod_timer(),
- * but will not re-activate and modify already deleted timers.
- *
- * It is useful for unserialized use of timers.
- */
-int mod_timer_pending(struct timer_list *timer, ULONG_PTR expires)
-{
-	return __mod_timer(timer, expires, true);
-}
-
-int mod_timer(struct timer_list *timer, ULONG_PTR expires)
-{
-	return __mod_timer(timer, expires, false);
-}
-
-void kobject_put(struct kobject *kobj)
-{
-    if (kobj) 
-    {
-        if (kobj->name == NULL)
-        {
-            return;
-        }
-
-		if (atomic_sub_and_test(1, &kobj->kref.refcount.refs))
-		{
-			void(*release)(struct kobject *kobj);
-			release = kobj->ktype->release;
-			if (release == 0)
-			{
-				return;
-			}
-			release(kobj);
-		}
-    }
-    else
-    {
-        return;
-    }
-}
-
-void kobject_del(struct kobject *kobj)
+void kobject_del(struct kobject *kobj)
 {
     if (!kobj)
     {
@@ -1778,10 +1486,39 @@ static void windrbd_fail_all_in_flight_bios(struct block_device *bdev, int bi_st
 	}
 }
 
+static unsigned long long oldest_bio_timestamp_locked(struct block_device *bdev);
+
+	/* The timer is not moved on every completion. When it
+	 * expires we check the oldest bio still in flight and either
+	 * rearm it for that bio or (if it is really too old) fail
+	 * all bios.
+	 */
+
 static void disk_timeout_timer_fn(struct timer_list *t)
 {
 	struct block_device *bdev = from_timer(bdev, t, disk_timeout_timer, struct block_device);
+	unsigned long long oldest, timeout, now;
+	KIRQL flags;
 
+		/* Read jiffies only once: both decisions must be the
+		 * same, else we fail the bios and leave
+		 * disk_timeout_armed set with no timer pending.
+		 */
+	spin_lock_irqsave(&bdev->in_flight_bios_lock, flags);
+	now = jiffies;
+	oldest = oldest_bio_timestamp_locked(bdev);
+	timeout = bdev->disk_timeout;
+	if (oldest == 0 || timeout == 0 || oldest + timeout <= now)
+		bdev->disk_timeout_armed = false;
+	spin_unlock_irqrestore(&bdev->in_flight_bios_lock, flags);
+
+	if (oldest == 0 || timeout == 0)
+		return;
+
+	if (oldest + timeout > now) {
+		mod_timer(&bdev->disk_timeout_timer, oldest + timeout);
+		return;
+	}
 	printk("Disk timeout timer expired, failing all I/O requests for block device %p...\n", bdev);
 	windrbd_fail_all_in_flight_bios(bdev, BLK_STS_TIMEOUT);
 }
@@ -1803,32 +1540,35 @@ static void disk_timeout_timer_fn(struct timer_list *t)
 	9.) Done: DRBD should tell WinDRBD about the disk timeout setting
  */
 
-static unsigned long long oldest_bio_timestamp(struct block_device *bdev)
-{
-	struct bio *bio;
-	unsigned long long oldest = jiffies;
-	KIRQL flags;
-
-	spin_lock_irqsave(&bdev->in_flight_bios_lock, flags);
-
-	if (list_empty(&bdev->in_flight_bios)) {
-		oldest = 0;
-	} else {
-		list_for_each_entry(struct bio, bio, &bdev->in_flight_bios, locally_submitted_bios) {
-			if (bio->submission_timestamp != 0 && bio->submission_timestamp < oldest)
-				oldest = bio->submission_timestamp;
-		}
-	}
+	/* in_flight_bios is in submission order (bios are added
+	 * to the tail with the jiffies of submission while holding
+	 * in_flight_bios_lock), so the oldest bio is the first one.
+	 * Returns 0 if there are no bios in flight.
+	 */
 
-	spin_unlock_irqrestore(&bdev->in_flight_bios_lock, flags);
+static unsigned long long oldest_bio_timestamp_locked(struct block_device *bdev)
+{
+	if (list_empty(&bdev->in_flight_bios))
+		return 0;
 
-	return oldest;
+	return list_first_entry(&bdev->in_flight_bios, struct bio, locally_submitted_bios)->submission_timestamp;
 }
 
+	/* Only used when the disk timeout changes. On submission
+	 * the timer is armed only if it is not already (see
+	 * generic_make_request()), on completion it is left alone.
+	 */
+
 static void rearm_disk_timeout_timer(struct block_device *bdev)
 {
 	unsigned long long now = jiffies;
-	unsigned long long oldest = oldest_bio_timestamp(bdev);
+	unsigned long long oldest;
+	KIRQL flags;
+
+	spin_lock_irqsave(&bdev->in_flight_bios_lock, flags);
+	oldest = oldest_bio_timestamp_locked(bdev);
+	bdev->disk_timeout_armed = (bdev->disk_timeout != 0 && oldest != 0 && oldest + bdev->disk_timeout > now);
+	spin_unlock_irqrestore(&bdev->in_flight_bios_lock, flags);
 
 	if (bdev->disk_timeout == 0 || oldest == 0)
 		del_timer(&bdev->disk_timeout_timer);
@@ -1853,6 +1593,62 @@ void windrbd_set_disk_timeout(struct block_device *bdev, unsigned long long time
 }
 
 static void bio_endio_impl(struct bio *bio, bool was_accounted);
+static int generic_make_request2(struct bio *bio);
+static void plug_io_completed(struct block_device *bdev, ULONGLONG irp_submission_time);
+
+	/* If set (the default), multi page bios are sent to the
+	 * backing device as one IRP with one MDL describing all
+	 * pages of the bio. Else (or if the backing device does
+	 * not accept such requests) the data is copied into a
+	 * linear buffer (bi_big_buffer). Registry value
+	 * scatter_gather_io.
+	 */
+
+int windrbd_scatter_gather_io = 1;
+
+atomic_t64 windrbd_scatter_gather_requests;
+atomic_t64 windrbd_big_buffer_requests;
+atomic_t64 windrbd_big_buffer_bytes_copied;
+atomic_t64 windrbd_scatter_gather_rejected;
+
+	/* TRIM requests sent to backing devices. */
+
+atomic_t64 windrbd_backing_discards;
+
+	/* blkdev_issue_zeroout() uses TRIM if the backing device
+	 * reads back zeroes from trimmed blocks and the caller
+	 * allows unmapping. Registry value zeroout_offload, off by
+	 * default: TRIM is only a hint, the device may ignore all
+	 * or part of the range and LBPRZ only covers blocks that
+	 * really got unmapped, so stale data could be left on the
+	 * disk (that is why Linux dropped discard_zeroes_data).
+	 * Only enable it for backing devices known to unmap every
+	 * aligned block they are asked to.
+	 */
+
+int windrbd_zeroout_offload = 0;
+
+atomic_t64 windrbd_zeroout_requests;
+atomic_t64 windrbd_zeroout_offload_bytes;
+atomic_t64 windrbd_zeroout_zero_page_bytes;
+
+	/* Runs in system_wq (at PASSIVE_LEVEL, we have to free the
+	 * MDLs). Holds the reference of the rejected IRP.
+	 */
+
+static void retry_without_scatter_gather(struct work_struct *w)
+{
+	struct bio *bio = container_of(w, struct bio, bi_retry_work);
+
+	free_mdls_and_irp(bio);
+	bio->bi_using_scatter_gather = false;
+
+		/* generic_make_request2() counts it again */
+	atomic_dec(&bio->bi_bdev->num_bios_pending);
+	generic_make_request2(bio);
+
+	bio_put(bio);
+}
 
 NTSTATUS DrbdIoCompletion(
   _In_     PDEVICE_OBJECT DeviceObject,
@@ -1870,12 +1666,27 @@ NTSTATUS DrbdIoCompletion(
 	bool one_big_request;
 
 	atomic_dec(&bio->bi_bdev->num_irps_pending);
+	plug_io_completed(bio->bi_bdev, bio->irp_submission_time);
 
 bio->where_i_am = "in io completion";
 
 	if (status != STATUS_SUCCESS) {
 		if (status == STATUS_INVALID_DEVICE_REQUEST && stack_location->MajorFunction == IRP_MJ_FLUSH_BUFFERS)
 			status = STATUS_SUCCESS;
+
+			/* Discard is only a hint: if the backing device
+			 * does not support it after all, stop sending
+			 * discards but do not fail the bio.
+			 */
+		if ((status == STATUS_INVALID_DEVICE_REQUEST || status == STATUS_NOT_SUPPORTED) && stack_location->MajorFunction == IRP_MJ_DEVICE_CONTROL) {
+			printk(KERN_WARNING "Backing device rejected TRIM request (status %x), disabling discards.\n", status);
+			if (bio->bi_bdev->bd_disk != NULL && bio->bi_bdev->bd_disk->queue != NULL) {
+				blk_queue_flag_clear(QUEUE_FLAG_DISCARD, bio->bi_bdev->bd_disk->queue);
+				bio->bi_bdev->bd_disk->queue->limits.discard_zeroes_data = 0;
+			}
+			if (!test_bit(BI_WINDRBD_FLAG_MUST_ZERO, &bio->bi_windrbd_flags))
+				status = STATUS_SUCCESS;
+		}
 	}
 
 	if (status != STATUS_SUCCESS) {
@@ -1889,7 +1700,29 @@ bio->where_i_am = "in io completion";
 	if (test_inject_faults(&inject_on_completion, "assuming completion routine was send an error (enabled for all devices)"))
 		status = STATUS_IO_DEVICE_ERROR;
 
-	one_big_request = bio->bi_using_big_buffer;
+		/* Some drivers cannot handle our hand made MDLs. Fall
+		 * back to the big buffer for this bio and all further
+		 * bios on this backing device. Flush requests would
+		 * complete this bio again, so don't retry those.
+		 */
+
+	if (bio->bi_using_scatter_gather && bio->bi_num_requests == 1 &&
+	    (status == STATUS_INVALID_PARAMETER ||
+	     status == STATUS_INVALID_DEVICE_REQUEST ||
+	     status == STATUS_NOT_SUPPORTED)) {
+		if (!bio->bi_bdev->scatter_gather_disabled)
+			printk(KERN_WARNING "Backing device rejected scatter/gather request (status %x), falling back to copying data.\n", status);
+
+		bio->bi_bdev->scatter_gather_disabled = true;
+		atomic_inc64(&windrbd_scatter_gather_rejected);
+
+		INIT_WORK(&bio->bi_retry_work, retry_without_scatter_gather);
+		queue_work(system_wq, &bio->bi_retry_work);
+
+		return STATUS_MORE_PROCESSING_REQUIRED;
+	}
+
+	one_big_request = bio->bi_using_big_buffer || bio->bi_using_scatter_gather;
 
 	if (bio->bi_using_big_buffer) {
 		if (stack_location->MajorFunction == IRP_MJ_READ) {
@@ -1902,6 +1735,7 @@ bio->where_i_am = "in io completion";
 				RtlCopyMemory(((char*)bio->bi_io_vec[i].bv_page->addr)+bio->bi_io_vec[i].bv_offset, ((char*)bio->bi_big_buffer)+offset, bio->bi_io_vec[i].bv_len);
 				offset += bio->bi_io_vec[i].bv_len;
 			}
+			atomic_add64(offset, &windrbd_big_buffer_bytes_copied);
 			if (offset != bio->bi_big_buffer_size) {
 				printk("Warning: size mismatch in DrbdIoCompletin(): offset is %d bio->bi_big_buffer_size is %d\n", offset, bio->bi_big_buffer_size);
 			}
@@ -2018,6 +1852,303 @@ static LONGLONG windrbd_get_volsize(struct block_device *dev)
 	return ret;
 }
 
+	/* Synchronously query a storage property of the backing
+	 * device (IOCTL_STORAGE_QUERY_PROPERTY, standard query).
+	 */
+
+static NTSTATUS windrbd_query_storage_property(struct block_device *dev, STORAGE_PROPERTY_ID id, void *out, ULONG out_size)
+{
+	STORAGE_PROPERTY_QUERY query;
+	struct _IO_STATUS_BLOCK io_status;
+	struct _IRP *irp;
+	struct _IO_STACK_LOCATION *s;
+	KEVENT event;
+	NTSTATUS status;
+
+	if (KeGetCurrentIrql() >= APC_LEVEL)
+		return STATUS_INVALID_DEVICE_STATE;
+
+	memset(&query, 0, sizeof(query));
+	query.PropertyId = id;
+	query.QueryType = PropertyStandardQuery;
+
+	KeInitializeEvent(&event, NotificationEvent, FALSE);
+	irp = IoBuildDeviceIoControlRequest(IOCTL_STORAGE_QUERY_PROPERTY,
+		dev->windows_device, &query, sizeof(query),
+		out, out_size, FALSE, &event, &io_status);
+
+	if (irp == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	s = IoGetNextIrpStackLocation(irp);
+	s->DeviceObject = dev->windows_device;
+	s->FileObject = dev->file_object;
+
+	status = IoCallDriver(dev->windows_device, irp);
+	if (status == STATUS_PENDING) {
+		KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, (PLARGE_INTEGER)NULL);
+		status = io_status.Status;
+	}
+	return status;
+}
+
+	/* Largest discard we send to the backing device in one
+	 * request (bi_size is 32 bit).
+	 */
+
+#define MAX_DISCARD_SECTORS (1 << 22)
+
+	/* Set discard queue limits of a backing device from what
+	 * the Windows storage stack tells us. If TRIM is not
+	 * enabled, discards are not supported (and DRBD will
+	 * not use them). The granularity is the device's optimal
+	 * unmap granularity (falling back to the physical sector
+	 * size) and the alignment its unmap granularity alignment
+	 * (both in bytes). If the device reads back zeroes from
+	 * trimmed blocks (LBPRZ), blkdev_issue_zeroout() may
+	 * use TRIM instead of writing zeroes.
+	 */
+
+static void windrbd_set_discard_limits(struct block_device *dev)
+{
+	struct request_queue *q = dev->bd_disk->queue;
+	DEVICE_TRIM_DESCRIPTOR trim;
+	STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR alignment;
+	DEVICE_LB_PROVISIONING_DESCRIPTOR lbp;
+	unsigned int granularity = 512;
+	NTSTATUS status;
+
+	q->limits.discard_zeroes_data = 0;
+	q->limits.max_write_zeroes_sectors = 0;
+	q->limits.discard_alignment = 0;
+
+	memset(&trim, 0, sizeof(trim));
+	status = windrbd_query_storage_property(dev, StorageDeviceTrimProperty, &trim, sizeof(trim));
+	if (status != STATUS_SUCCESS || !trim.TrimEnabled) {
+		printk(KERN_INFO "Backing device does not support TRIM (status %x), discards disabled.\n", status);
+		blk_queue_flag_clear(QUEUE_FLAG_DISCARD, q);
+		q->limits.max_discard_sectors = 0;
+		q->limits.discard_granularity = 0;
+		return;
+	}
+
+	memset(&lbp, 0, sizeof(lbp));
+	status = windrbd_query_storage_property(dev, StorageDeviceLBProvisioningProperty, &lbp, sizeof(lbp));
+	if (status != STATUS_SUCCESS)
+		memset(&lbp, 0, sizeof(lbp));
+
+	if (lbp.OptimalUnmapGranularity >= 512 &&
+	    lbp.OptimalUnmapGranularity <= ((ULONGLONG) MAX_DISCARD_SECTORS << 9) &&
+	    lbp.OptimalUnmapGranularity % 512 == 0) {
+		granularity = (unsigned int) lbp.OptimalUnmapGranularity;
+	} else {
+		memset(&alignment, 0, sizeof(alignment));
+		status = windrbd_query_storage_property(dev, StorageAccessAlignmentProperty, &alignment, sizeof(alignment));
+		if (status == STATUS_SUCCESS && alignment.BytesPerPhysicalSector >= 512)
+			granularity = alignment.BytesPerPhysicalSector;
+	}
+
+	blk_queue_flag_set(QUEUE_FLAG_DISCARD, q);
+	q->limits.discard_granularity = granularity;
+	q->limits.max_discard_sectors = MAX_DISCARD_SECTORS - MAX_DISCARD_SECTORS % (granularity / 512);
+
+	if (lbp.UnmapGranularityAlignmentValid && lbp.UnmapGranularityAlignment % 512 == 0)
+		q->limits.discard_alignment = (unsigned int) (lbp.UnmapGranularityAlignment % granularity);
+
+	if (lbp.ThinProvisioningReadZeros) {
+		q->limits.discard_zeroes_data = 1;
+		q->limits.max_write_zeroes_sectors = q->limits.max_discard_sectors;
+	}
+
+	printk(KERN_INFO "Backing device supports TRIM, discard granularity is %u bytes (alignment %u bytes), trimmed blocks read back %s.\n", granularity, q->limits.discard_alignment, q->limits.discard_zeroes_data ? "zeroes" : "undefined data");
+}
+
+	/* Discards are sent to the backing device as a
+	 * IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES (TRIM) request
+	 * with one range. The buffer is freed together with the
+	 * bio (we use bi_big_buffer for that).
+	 */
+
+static int make_discard_request(struct bio *bio)
+{
+	struct _DEVICE_MANAGE_DATA_SET_ATTRIBUTES *attrs;
+	struct _DEVICE_DATA_SET_RANGE *range;
+	struct _IRP *irp;
+	PIO_STACK_LOCATION next_stack_location;
+	ULONG ranges_offset, size;
+	NTSTATUS status;
+
+	ranges_offset = ALIGN(sizeof(*attrs), sizeof(ULONGLONG));
+	size = ranges_offset + sizeof(*range);
+
+	attrs = kzalloc(size, GFP_KERNEL, 'DSMW');
+	if (attrs == NULL)
+		return -ENOMEM;
+	bio->bi_big_buffer = attrs;
+
+	attrs->Size = sizeof(*attrs);
+	attrs->Action = DeviceDsmAction_Trim;
+	attrs->Flags = 0;
+	attrs->DataSetRangesOffset = ranges_offset;
+	attrs->DataSetRangesLength = sizeof(*range);
+
+	range = (struct _DEVICE_DATA_SET_RANGE *) (((char*)attrs)+ranges_offset);
+	range->StartingOffset = bio->bi_iter.bi_sector << 9;
+	range->LengthInBytes = bio->bi_iter.bi_size;
+
+	irp = IoAllocateIrp(bio->bi_bdev->windows_device->StackSize, FALSE);
+	if (irp == NULL) {
+		printk(KERN_ERR "Cannot build IRP.\n");
+		return -ENOMEM;
+	}
+	bio->bi_irps[bio->bi_this_request] = irp;
+	irp->AssociatedIrp.SystemBuffer = attrs;
+
+	next_stack_location = IoGetNextIrpStackLocation(irp);
+	next_stack_location->MajorFunction = IRP_MJ_DEVICE_CONTROL;
+	next_stack_location->Parameters.DeviceIoControl.IoControlCode = IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES;
+	next_stack_location->Parameters.DeviceIoControl.InputBufferLength = size;
+	next_stack_location->Parameters.DeviceIoControl.OutputBufferLength = 0;
+	next_stack_location->DeviceObject = bio->bi_bdev->windows_device;
+	next_stack_location->FileObject = bio->bi_bdev->file_object;
+
+	IoSetCompletionRoutine(irp, DrbdIoCompletion, bio, TRUE, TRUE, TRUE);
+
+	bio_get(bio);	/* To be put in completion routine (bi_endio) */
+
+	atomic_inc64(&windrbd_backing_discards);
+	atomic_inc(&bio->bi_bdev->num_irps_pending);
+	bio->irp_submission_time = KeQueryInterruptTime();
+	status = IoCallDriver(bio->bi_bdev->windows_device, irp);
+
+	if (status != STATUS_SUCCESS && status != STATUS_PENDING) {
+		printk(KERN_WARNING "discard request failed with status %x\n", status);
+		return EIO;	/* Positive value means do not call endio function */
+	}
+	return 0;
+}
+
+	/* One page of zeroes shared by all zero out requests. It is
+	 * never written to, so there is no need to allocate buffers
+	 * when zeroing. Allocated directly from the pool because it
+	 * must be page aligned (kmalloc debugging adds a header).
+	 */
+
+static struct page *windrbd_zero_page;
+
+void init_zero_page(void)
+{
+	struct page *p;
+
+	p = kzalloc(sizeof(*p), 0, 'ZPDW');
+	if (p == NULL)
+		goto fail;
+
+	p->addr = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, 'ZPDW');
+	if (p->addr == NULL) {
+		kfree(p);
+		goto fail;
+	}
+	RtlZeroMemory(p->addr, PAGE_SIZE);
+	p->size = PAGE_SIZE;
+	p->is_system_buffer = 1;	/* freed by shutdown_zero_page() */
+	kref_init(&p->kref);
+
+	windrbd_zero_page = p;
+	return;
+
+fail:
+	printk("Warning: could not allocate zero page, blkdev_issue_zeroout() will fail.\n");
+}
+
+	/* Call this only when driver should be unloaded. */
+
+void shutdown_zero_page(void)
+{
+	if (windrbd_zero_page == NULL)
+		return;
+
+	ExFreePool(windrbd_zero_page->addr);
+	kfree(windrbd_zero_page);
+	windrbd_zero_page = NULL;
+}
+
+	/* Largest zero out write. The MDL repeats the page, so this
+	 * only costs one PFN array entry per 4K.
+	 */
+
+#define MAX_REPEAT_PAGE_SECTORS (1 << 13)
+
+	/* Write the same page (bi_io_vec[0]) over the whole range
+	 * of the bio. The MDL lists the page's physical address for
+	 * each page of the request, so no data buffer is needed.
+	 * The MDL is freed together with the bio's IRPs.
+	 */
+
+static int make_repeat_page_request(struct bio *bio)
+{
+	struct _IRP *irp;
+	struct _MDL *mdl;
+	PPFN_NUMBER pfns;
+	PFN_NUMBER pfn;
+	PIO_STACK_LOCATION next_stack_location;
+	char *va = bio->bi_io_vec[0].bv_page->addr;
+	unsigned int size = bio->bi_iter.bi_size;
+	ULONG num_pages, p;
+	NTSTATUS status;
+
+		/* issue_batch_submit() does not create repeat page
+		 * bios for those, see bdev_can_repeat_page().
+		 */
+	if ((bio->bi_bdev->windows_device->Flags & DO_DIRECT_IO) == 0) {
+		printk(KERN_ERR "Backing device does not do direct I/O, cannot write repeated page.\n");
+		return -EOPNOTSUPP;
+	}
+
+	irp = IoAllocateIrp(bio->bi_bdev->windows_device->StackSize, FALSE);
+	if (irp == NULL) {
+		printk(KERN_ERR "Cannot build IRP.\n");
+		return -ENOMEM;
+	}
+	mdl = IoAllocateMdl(va, size, FALSE, FALSE, NULL);
+	if (mdl == NULL) {
+		IoFreeIrp(irp);
+		return -ENOMEM;
+	}
+	num_pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(va, size);
+	pfns = MmGetMdlPfnArray(mdl);
+	pfn = (PFN_NUMBER) (MmGetPhysicalAddress(va).QuadPart >> PAGE_SHIFT);
+	for (p=0;p<num_pages;p++)
+		pfns[p] = pfn;
+
+	mdl->MdlFlags |= MDL_PAGES_LOCKED;
+	irp->MdlAddress = mdl;
+	irp->UserIosb = &bio->bi_io_vec[0].io_stat;
+	bio->bi_irps[bio->bi_this_request] = irp;
+
+	next_stack_location = IoGetNextIrpStackLocation(irp);
+	next_stack_location->MajorFunction = IRP_MJ_WRITE;
+	next_stack_location->Parameters.Write.ByteOffset.QuadPart = bio->bi_iter.bi_sector << 9;
+	next_stack_location->Parameters.Write.Length = size;
+	next_stack_location->DeviceObject = bio->bi_bdev->windows_device;
+	next_stack_location->FileObject = bio->bi_bdev->file_object;
+
+	IoSetCompletionRoutine(irp, DrbdIoCompletion, bio, TRUE, TRUE, TRUE);
+
+	bio_get(bio);	/* To be put in completion routine (bi_endio) */
+
+	atomic_inc(&bio->bi_bdev->num_irps_pending);
+	part_stat_add(bio->bi_bdev, sectors[STAT_WRITE], size / 512);
+	bio->irp_submission_time = KeQueryInterruptTime();
+	status = IoCallDriver(bio->bi_bdev->windows_device, irp);
+
+	if (status != STATUS_SUCCESS && status != STATUS_PENDING) {
+		printk(KERN_WARNING "zero out request failed with status %x\n", status);
+		return EIO;	/* Positive value means do not call endio function */
+	}
+	return 0;
+}
+
 static int make_flush_request(struct bio *bio)
 {
 	NTSTATUS status;
@@ -2048,6 +2179,7 @@ static int make_flush_request(struct bio *bio)
 	bio_get(bio);	/* To be put in completion routine (bi_endio) */
 
 	atomic_inc(&bio->bi_bdev->num_irps_pending);
+	bio->irp_submission_time = KeQueryInterruptTime();
 	status = IoCallDriver(bio->bi_bdev->windows_device, bio->bi_irps[bio->bi_this_request]);
 
 	if (status != STATUS_SUCCESS && status != STATUS_PENDING) {
@@ -2067,6 +2199,102 @@ static int make_flush_request(struct bio *bio)
 	return 0;
 }
 
+	/* Can the vector elements of the bio be described by one
+	 * MDL? They can if they are virtually contiguous from the
+	 * device's point of view: all but the first element must
+	 * start at a page boundary and all but the last must end
+	 * at one.
+	 */
+
+static bool bio_can_scatter_gather(struct bio *bio)
+{
+	int i;
+	ULONG_PTR start, end;
+
+	if (!windrbd_scatter_gather_io || bio->bi_bdev->scatter_gather_disabled)
+		return false;
+
+		/* Can't send an MDL to a driver that wants buffered I/O */
+	if ((bio->bi_bdev->windows_device->Flags & DO_DIRECT_IO) == 0)
+		return false;
+
+		/* We must patch a copy of the boot sector (see
+		 * windrbd_generic_make_request()).
+		 */
+	if (bio_data_dir(bio) == WRITE && bio->bi_iter.bi_sector == 0 && !bio->dont_patch_boot_sector)
+		return false;
+
+	for (i=0;i<bio->bi_vcnt;i++) {
+		start = (ULONG_PTR) bio->bi_io_vec[i].bv_page->addr + bio->bi_io_vec[i].bv_offset;
+		end = start + bio->bi_io_vec[i].bv_len;
+
+		if (i > 0 && BYTE_OFFSET(start) != 0)
+			return false;
+		if (i < bio->bi_vcnt-1 && BYTE_OFFSET(end) != 0)
+			return false;
+	}
+	return true;
+}
+
+	/* Builds an IRP with one MDL describing the pages of all
+	 * bio vec elements (checked by bio_can_scatter_gather()).
+	 * Nothing is copied. The pages are ours (non-paged or already
+	 * locked) until the bio is freed, so we fill in the page
+	 * frame numbers ourselves instead of locking them again.
+	 * Returns NULL if out of memory.
+	 */
+
+static struct _IRP *build_scatter_gather_irp(struct bio *bio, ULONG io, unsigned int size)
+{
+	struct _IRP *irp;
+	struct _MDL *mdl;
+	PPFN_NUMBER pfns;
+	PIO_STACK_LOCATION s;
+	char *first, *va, *start, *end;
+	ULONG num_pages, p;
+	int i;
+
+	irp = IoAllocateIrp(bio->bi_bdev->windows_device->StackSize, FALSE);
+	if (irp == NULL)
+		return NULL;
+
+	first = ((char*) bio->bi_io_vec[0].bv_page->addr) + bio->bi_io_vec[0].bv_offset;
+	mdl = IoAllocateMdl(first, size, FALSE, FALSE, NULL);
+	if (mdl == NULL) {
+		IoFreeIrp(irp);
+		return NULL;
+	}
+	num_pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(first, size);
+	pfns = MmGetMdlPfnArray(mdl);
+	p = 0;
+
+	for (i=0;i<bio->bi_vcnt;i++) {
+		start = ((char*) bio->bi_io_vec[i].bv_page->addr) + bio->bi_io_vec[i].bv_offset;
+		end = start + bio->bi_io_vec[i].bv_len;
+
+		for (va = PAGE_ALIGN(start); va < end && p < num_pages; va += PAGE_SIZE)
+			pfns[p++] = (PFN_NUMBER) (MmGetPhysicalAddress(va).QuadPart >> PAGE_SHIFT);
+	}
+	if (p != num_pages) {
+		printk("Warning: scatter/gather MDL has %d pages, expected %d\n", p, num_pages);
+		IoFreeMdl(mdl);
+		IoFreeIrp(irp);
+		return NULL;
+	}
+	mdl->MdlFlags |= MDL_PAGES_LOCKED;
+	irp->MdlAddress = mdl;
+	irp->UserIosb = &bio->bi_io_vec[0].io_stat;
+
+	s = IoGetNextIrpStackLocation(irp);
+	s->MajorFunction = (UCHAR) io;
+	if (io == IRP_MJ_READ)
+		s->Parameters.Read.ByteOffset = bio->bi_io_vec[0].offset;
+	else
+		s->Parameters.Write.ByteOffset = bio->bi_io_vec[0].offset;
+
+	return irp;
+}
+
 static int windrbd_generic_make_request(struct bio *bio, bool single_request)
 {
 	NTSTATUS status;
@@ -2090,7 +2318,10 @@ bio->where_i_am = "in windrbd_generic_make_request big buffer";
 	}
 
 	bio->bi_io_vec[bio->bi_this_request].offset.QuadPart = bio->bi_iter.bi_sector << 9;
-	if (single_request) {
+	if (single_request && bio->bi_using_scatter_gather) {
+		buffer = NULL;
+		the_size = bio->bi_iter.bi_size;
+	} else if (single_request) {
 		buffer = bio->bi_big_buffer;
 		the_size = bio->bi_big_buffer_size;
 	} else {
@@ -2122,8 +2353,11 @@ bio->where_i_am = "in windrbd_generic_make_request big buffer";
 	int retries = 0;
 	while (1) {
 
+		if (bio->bi_using_scatter_gather)
+			bio->bi_irps[bio->bi_this_request] = build_scatter_gather_irp(bio, io, the_size);
+		else
 		/* TODO: io_stat not used at all? */
-		bio->bi_irps[bio->bi_this_request] = IoBuildAsynchronousFsdRequest(
+			bio->bi_irps[bio->bi_this_request] = IoBuildAsynchronousFsdRequest(
 				io,
 				bio->bi_bdev->windows_device,
 				buffer,
@@ -2184,6 +2418,7 @@ bio->where_i_am = "in windrbd_generic_make_request big buffer";
 	part_stat_add(bio->bi_bdev, sectors[io == IRP_MJ_READ ? STAT_READ : STAT_WRITE], the_size / 512);
 
 	bio->where_i_am = "calling backing dev driver";
+	bio->irp_submission_time = KeQueryInterruptTime();
 	status = IoCallDriver(bio->bi_bdev->windows_device, bio->bi_irps[bio->bi_this_request]);
 
 		/* either STATUS_SUCCESS or STATUS_PENDING */
@@ -2208,6 +2443,8 @@ static int generic_make_request2(struct bio *bio)
 	int orig_size;
 	int e;
 	int flush_request;
+	bool discard_request;
+	bool repeat_page_request;
 	atomic_inc(&bio->bi_bdev->num_bios_pending);
 
 	bio->where_i_am = "in generic_make_request2";
@@ -2216,6 +2453,25 @@ static int generic_make_request2(struct bio *bio)
 	flush_request = ((bio->bi_opf & REQ_PREFLUSH) != 0);
 	bio->bi_num_requests = bio->bi_vcnt + flush_request;
 
+		/* Discard bios have no data. If the backing device
+		 * does not support TRIM, they complete successfully
+		 * without doing anything (discard is only a hint).
+		 */
+	discard_request = bio_op(bio) == REQ_OP_DISCARD &&
+			  bio->bi_bdev->bd_disk != NULL &&
+			  bio->bi_bdev->bd_disk->queue != NULL &&
+			  blk_queue_discard(bio->bi_bdev->bd_disk->queue);
+	if (discard_request)
+		bio->bi_num_requests = 1;
+	else if (bio_op(bio) == REQ_OP_DISCARD && test_bit(BI_WINDRBD_FLAG_MUST_ZERO, &bio->bi_windrbd_flags)) {
+		bio->bi_status = BLK_STS_NOTSUPP;
+		bio_endio(bio);
+		bio_put(bio);
+		return -EOPNOTSUPP;
+	}
+
+	repeat_page_request = test_bit(BI_WINDRBD_FLAG_REPEAT_PAGE, &bio->bi_windrbd_flags);
+
 	if (bio->bi_num_requests == 0) {
 		bio->bi_status = 0;
 		bio_endio(bio);
@@ -2224,14 +2480,21 @@ static int generic_make_request2(struct bio *bio)
 	}
 
 		/* In case we fail early, bi_irps[n].MdlAddress must be
-		 * NULL.
+		 * NULL. Use the slots in the bio slab object if there
+		 * are enough of them.
 		 */
-	bio->bi_irps = kzalloc(sizeof(*bio->bi_irps)*bio->bi_num_requests, GFP_KERNEL, 'XXXX');
-	if (bio->bi_irps == NULL) {
-		bio->bi_status = BLK_STS_IOERR;
-		bio_endio(bio);
-		bio_put(bio);
-		return -ENOMEM;
+	if (bio->bi_num_requests <= bio->bi_num_inline_irps) {
+		bio->bi_irps = bio->bi_inline_irps;
+		RtlZeroMemory(bio->bi_irps, sizeof(*bio->bi_irps)*bio->bi_num_requests);
+	} else {
+		bio->bi_irps = kzalloc(sizeof(*bio->bi_irps)*bio->bi_num_requests, GFP_KERNEL, 'XXXX');
+		if (bio->bi_irps == NULL) {
+			bio->bi_status = BLK_STS_IOERR;
+			bio_endio(bio);
+			bio_put(bio);
+			return -ENOMEM;
+		}
+		atomic_inc64(&windrbd_bio_pool_allocations);
 	}
 	atomic_set(&bio->bi_requests_completed, 0);
 
@@ -2240,6 +2503,32 @@ static int generic_make_request2(struct bio *bio)
 
 	bio->where_i_am = "in generic_make_request2 2";
 	bio->bi_using_big_buffer = false;
+	bio->bi_using_scatter_gather = false;
+
+	if (discard_request) {
+		bio->bi_this_request = 0;
+		ret = make_discard_request(bio);
+
+		if (ret < 0) {
+			bio->bi_status = BLK_STS_IOERR;
+			bio_endio(bio);
+		}
+		goto out;
+	}
+	if (repeat_page_request) {
+		bio->bi_this_request = 0;
+		ret = make_repeat_page_request(bio);
+
+		if (ret < 0) {
+			bio->bi_status = BLK_STS_IOERR;
+			bio_endio(bio);
+			goto out;
+		}
+		if (ret > 0)
+			goto out;
+
+		goto submit_flush;
+	}
 	if (bio->bi_vcnt > 1) {
 		total_size = 0;
 		for (e = 0; e < bio->bi_vcnt; e++)
@@ -2248,6 +2537,24 @@ static int generic_make_request2(struct bio *bio)
 		if (total_size != bio->bi_iter.bi_size) {
 			printk("Warning: size mismatch in generic_make_request(): total_size is %d bi_size is %d\n", total_size, bio->bi_iter.bi_size);
 		}
+		if (bio_can_scatter_gather(bio)) {
+			bio->bi_this_request = 0;
+			bio->bi_using_scatter_gather = true;
+			atomic_inc64(&windrbd_scatter_gather_requests);
+
+bio->where_i_am = "in generic_make_request2 scatter gather";
+			ret = windrbd_generic_make_request(bio, true);
+
+			if (ret < 0) {
+				bio->bi_status = BLK_STS_IOERR;
+				bio_endio(bio);
+				goto out;
+			}
+			if (ret > 0)
+				goto out;
+
+			goto submit_flush;
+		}
 		bio->bi_big_buffer_size = total_size;
 		bio->bi_big_buffer = kmalloc(total_size, GFP_KERNEL, 'XXXX');
 
@@ -2269,7 +2576,9 @@ bio->where_i_am = "in generic_make_request2 big buffer";
 				if (offset != bio->bi_big_buffer_size) {
 					printk("Warning: size mismatch when copiing data to write to linear buffer: offset is %d bio->bi_big_buffer_size is %d\n", offset, bio->bi_big_buffer_size);
 				}
+				atomic_add64(offset, &windrbd_big_buffer_bytes_copied);
 			}
+			atomic_inc64(&windrbd_big_buffer_requests);
 			ret = windrbd_generic_make_request(bio, true);
 
 			if (ret < 0) {
@@ -2305,6 +2614,7 @@ bio->where_i_am = "in generic_make_request2 big buffer";
 		}
 	}
 
+submit_flush:
 	if (flush_request) {
 		ret = make_flush_request(bio);
 
@@ -2397,121 +2707,324 @@ if (bio_data_dir(bio3) == WRITE) {
 	if (joined_bios_bio->bi_vcnt != num_vector_elements) {
 		printk("Warning: joined_bios_bio->bi_vcnt(%d) != num_vector_elements(%d)\n", joined_bios_bio->bi_vcnt, num_vector_elements);
 	}
-// printk("first_bio is %p first_bio->bi_iter.bi_sector is %lld joined_bios_bio->bi_iter.bi_sector is %lld\n", first_bio, first_bio->bi_iter.bi_sector, joined_bios_bio->bi_iter.bi_sector);
-// printk("bio %p is joined bios: submitting (2)\n", joined_bios_bio);
-		/* child bios will be put is I/O request routine */
-	return generic_make_request2(joined_bios_bio);
+// printk("first_bio is %p first_bio->bi_iter.bi_sector is %lld joined_bios_bio->bi_iter.bi_sector is %lld\n", first_bio, first_bio->bi_iter.bi_sector, joined_bios_bio->bi_iter.bi_sector);
+// printk("bio %p is joined bios: submitting (2)\n", joined_bios_bio);
+		/* child bios will be put is I/O request routine */
+	return generic_make_request2(joined_bios_bio);
+}
+
+	/* Limits for joining bios into one request. */
+
+#define MAX_JOINED_VECTOR_ELEMENTS 1024
+#define MAX_JOINED_SIZE (4*1024*1024)
+
+	/* Corked bios are kept in a tree sorted by sector. Bios
+	 * starting at the same sector are inserted after the ones
+	 * already there, so they keep the order they were submitted
+	 * in.
+	 */
+
+void windrbd_insert_corked_bio(struct rb_root *tree, struct bio *bio)
+{
+	struct rb_node **p = &tree->rb_node;
+	struct rb_node *parent = NULL;
+	struct bio *b;
+
+	while (*p) {
+		parent = *p;
+		b = rb_entry(parent, struct bio, corked_node);
+		if (bio->bi_iter.bi_sector < b->bi_iter.bi_sector)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&bio->corked_node, parent, p);
+	rb_insert_color(&bio->corked_node, tree);
+}
+
+static bool can_join_bios(struct bio *last_bio, struct bio *bio, int num_vector_elements, unsigned long long size)
+{
+	if (last_bio->bi_iter.bi_sector + last_bio->bi_iter.bi_size/512 != bio->bi_iter.bi_sector)
+		return false;
+	if (last_bio->bi_opf != bio->bi_opf)
+		return false;
+		/* Created in windrbd_make_drbd_requests, never join them */
+	if (last_bio->is_user_request || bio->is_user_request)
+		return false;
+	if (num_vector_elements + bio->bi_vcnt > MAX_JOINED_VECTOR_ELEMENTS)
+		return false;
+	if (size + bio->bi_iter.bi_size > MAX_JOINED_SIZE)
+		return false;
+
+	return true;
+}
+
+	/* Takes all bios from tree (which is empty afterwards) in
+	 * ascending sector order and calls submit for each run of
+	 * contiguous bios that can be joined. This is independent
+	 * of the block device, so that it can be tested with
+	 * recorded bio streams (see cork_replay_test in
+	 * windrbd_test.c). Returns the first error returned by
+	 * submit, all bios are submitted nevertheless.
+	 */
+
+int windrbd_merge_corked_bios(struct rb_root *tree, struct cork_stats *stats, submit_corked_fn submit)
+{
+	struct bio *bio, *bio2, *last_bio;
+	struct list_head sorted_list, run;
+	struct rb_node *n;
+	int num_bios, num_vector_elements;
+	unsigned long long size;
+	int ret, err;
+
+	INIT_LIST_HEAD(&sorted_list);
+	INIT_LIST_HEAD(&run);
+
+		/* Submitting may free bios, so don't walk the tree
+		 * while submitting.
+		 */
+	for (n = rb_first(tree); n != NULL; n = rb_next(n)) {
+		bio = rb_entry(n, struct bio, corked_node);
+		list_add_tail(&bio->corked_bios, &sorted_list);
+	}
+	*tree = RB_ROOT;
+
+	err = 0;
+	num_bios = 0;
+	num_vector_elements = 0;
+	size = 0;
+	last_bio = NULL;
+
+	list_for_each_entry_safe(struct bio, bio, bio2, &sorted_list, corked_bios) {
+		bio->where_i_am = "in uncorking loop";
+		if (last_bio != NULL && !can_join_bios(last_bio, bio, num_vector_elements, size)) {
+			atomic_add64(num_bios, &stats->bios);
+			atomic_inc64(&stats->requests);
+			if (num_bios > 1)
+				atomic_add64(num_bios, &stats->merged_bios);
+
+			ret = submit(&run, num_vector_elements, size, num_bios);
+			if (ret < 0 && err == 0)
+				err = ret;
+
+			INIT_LIST_HEAD(&run);
+			num_bios = 0;
+			num_vector_elements = 0;
+			size = 0;
+		}
+		list_del(&bio->corked_bios);
+		list_add_tail(&bio->corked_bios, &run);
+
+		num_bios++;
+		num_vector_elements += bio->bi_vcnt;
+		size += bio->bi_iter.bi_size;
+		last_bio = bio;
+	}
+		/* bio variables are invalid here ... */
+	if (num_bios > 0) {
+		atomic_add64(num_bios, &stats->bios);
+		atomic_inc64(&stats->requests);
+		if (num_bios > 1)
+			atomic_add64(num_bios, &stats->merged_bios);
+
+		ret = submit(&run, num_vector_elements, size, num_bios);
+		if (ret < 0 && err == 0)
+			err = ret;
+	}
+	return err;
 }
 
-int windrbd_bdev_uncork(struct block_device *bdev)
+static int submit_corked_run(struct list_head *run, int num_vector_elements, unsigned long long size, int num_bios)
 {
-	struct bio *bio, *bio2, *last_bio;
-	struct list_head tmp_list;
-	KIRQL flags;
-	int i, ret;
-	int num_joinable_bios, num_vector_elements;
-	sector_t expected_sector;
-	unsigned long long joinable_size;
-	unsigned int opf;
+		/* This also handles the single bio case. Child bios
+		 * will be put in DrbdIoCompletion().
+		 */
+	return create_and_submit_joined_bio(num_vector_elements, (int) size, run, NULL);
+}
 
-	INIT_LIST_HEAD(&tmp_list);
-	bdev->corked = false;
+	/* Submits all corked and plugged bios. Corked and auto
+	 * plugged bios share corked_tree, so while the device is
+	 * corked nothing is submitted (the plug timer, an idle
+	 * backing device or a full plug must not submit corked
+	 * bios). windrbd_bdev_uncork() clears corked first and
+	 * then submits everything.
+	 */
+
+static int windrbd_flush_plug(struct block_device *bdev)
+{
+	struct rb_root tree;
+	KIRQL flags;
 
 		/* This is so we don't have to keep the spin lock
-		 * longer than needed.
+		 * longer than needed. Cancel the plug timer under the
+		 * lock, else we might cancel the timer plug_bio() set
+		 * for a bio plugged after we took the tree.
 		 */
 	spin_lock_irqsave(&bdev->cork_spinlock, flags);
-	list_for_each_entry_safe(struct bio, bio, bio2, &bdev->corked_list, corked_bios) {
-		list_del(&bio->corked_bios);
-		list_add(&bio->corked_bios, &tmp_list);
+	if (bdev->corked) {
+		bdev->plug_flush_queued = false;
+		spin_unlock_irqrestore(&bdev->cork_spinlock, flags);
+		return 0;
 	}
+	KeCancelTimer(&bdev->plug_ktimer);
+	tree = bdev->corked_tree;
+	bdev->corked_tree = RB_ROOT;
+	bdev->plugged_bios = 0;
+	bdev->plugged_bytes = 0;
+	bdev->plug_flush_queued = false;
 	spin_unlock_irqrestore(&bdev->cork_spinlock, flags);
 
-	if (list_empty(&tmp_list)) {
+	if (RB_EMPTY_ROOT(&tree))
 		return 0;
+
+	return windrbd_merge_corked_bios(&tree, &bdev->cork_stats, submit_corked_run);
+}
+
+int windrbd_bdev_uncork(struct block_device *bdev)
+{
+	bdev->corked = false;
+
+	return windrbd_flush_plug(bdev);
+}
+
+	/* Auto plugging. While the backing device is busy, bios
+	 * are held back (like corked bios) until either the plug
+	 * timer expires, auto_plug_max_bytes are collected or the
+	 * backing device completes a request. Then they are
+	 * sorted, merged and submitted. A bio with PREFLUSH or
+	 * FUA is never held back, it flushes the plug first.
+	 *
+	 * The plug timer is set to half of the average completion
+	 * latency of the backing device (but at most
+	 * auto_plug_max_usecs), so that fast devices are not
+	 * slowed down by waiting for bios that are not going to
+	 * come. Registry values auto_plug, auto_plug_max_usecs
+	 * and auto_plug_max_bytes.
+	 */
+
+int windrbd_auto_plug = 0;
+int windrbd_auto_plug_max_usecs = 200;
+int windrbd_auto_plug_max_bytes = 512*1024;
+
+	/* In 100ns units (as KeSetTimer wants it) */
+
+static LONGLONG plug_delay(struct block_device *bdev)
+{
+	LONGLONG max_delay = windrbd_auto_plug_max_usecs * 10LL;
+	LONGLONG delay = bdev->plug_latency / 2;
+
+	if (delay <= 0 || delay > max_delay)
+		delay = max_delay;
+
+	return delay;
+}
+
+	/* Timer and completion routine run at DISPATCH_LEVEL,
+	 * submitting bios must happen at PASSIVE_LEVEL, so
+	 * flush the plug in the system workqueue.
+	 */
+
+static void queue_plug_flush(struct block_device *bdev, atomic_t64 *reason)
+{
+	KIRQL flags;
+	bool do_queue = false;
+
+	spin_lock_irqsave(&bdev->cork_spinlock, flags);
+	if (bdev->plugged_bios > 0 && !bdev->plug_flush_queued && !bdev->corked) {
+		bdev->plug_flush_queued = true;
+		do_queue = true;
+	}
+	spin_unlock_irqrestore(&bdev->cork_spinlock, flags);
+
+	if (do_queue) {
+		atomic_inc64(reason);
+		queue_work(system_wq, &bdev->plug_work);
 	}
+}
 
-	num_joinable_bios = 0;
-	num_vector_elements = 0;
-	joinable_size = 0;
-	expected_sector = -1;
-	opf = -1;
-	last_bio = NULL;
+static void plug_work_fn(struct work_struct *w)
+{
+	struct block_device *bdev = container_of(w, struct block_device, plug_work);
 
-	list_for_each_entry_safe(struct bio, bio, bio2, &tmp_list, corked_bios) {
-//  printk("bio is %p expected_sector is %lld bio->bi_iter.bi_sector is %lld bio->bi_iter.bi_size is %lld num_vector_elements is %d joinable_size is %d opf is %d bio->bi_opf is %d\n", bio, expected_sector, bio->bi_iter.bi_sector, bio->bi_iter.bi_size, num_vector_elements, joinable_size, opf, bio->bi_opf);
-		bio->where_i_am = "in uncorking loop";
-		if ((expected_sector != -1 && expected_sector != bio->bi_iter.bi_sector) || num_vector_elements >= 1024 || joinable_size >= 4*1024*1024 || (opf != (unsigned int)-1 && bio->bi_opf != opf) || bio->is_user_request) {
-// printk("Found %d joinable bios (%lld bytes)\n", num_joinable_bios, joinable_size);
-			if (last_bio == NULL) {
-				printk("Warning: logic bug, last_bio should not be NULL here.\n");
-			} else {
-				if (num_joinable_bios == 1) {
-					list_del(&last_bio->corked_bios);
-					ret = generic_make_request2(last_bio);
-					for (i=0; i<last_bio->bi_vcnt; i++) {
-					/* corresponding get_page in generic_make_request() */
-						put_page(last_bio->bi_io_vec[i].bv_page);
-					}
-					bio_put(last_bio);	/* corresponding get in generic_request() */
-				} else {
-// if (bio_data_dir(bio) == WRITE) {
-// printk("1 bio is %p bio->bi_vcnt is %d num_vector_elements is %d num_joinable_bios is %d\n", bio, bio->bi_vcnt, num_vector_elements, num_joinable_bios);
-// }
-					ret = create_and_submit_joined_bio(num_vector_elements, joinable_size, &tmp_list, bio);
-				}
-				if (ret < 0)
-					return ret;
-			}
+	windrbd_flush_plug(bdev);
+}
 
-			/* Rejected: create a buffer and copy over the data (if writing).
-			 * instead create a bi_io_vec pointing to the data and
-			 * use big_buffer mechanism.
-			 *
-			 * Done: create a 'master' bio here.
-			 * Done: move bios from first bio to this bio to the master bio's list.
-			 * Done: submit the master bio
-			 * in master bio completion:
-			 *    rejected: copy over data when reading. already done
-                         *    bio_endfn() for all child functions
-			 *
-			 * Error handling?
-			 * must bio_endio bios on memory allocation error this
-			 * is done now in create_and_submit_joined_bio()
-			 */
-			num_joinable_bios = 0;
-			num_vector_elements = 0;
-			joinable_size = 0;
-			expected_sector = -1;
-			opf = bio->bi_opf;
-		}
-		num_joinable_bios++;
-		num_vector_elements += bio->bi_vcnt;
-		joinable_size += bio->bi_iter.bi_size;
-		expected_sector = bio->bi_iter.bi_sector + bio->bi_iter.bi_size/512;
-		last_bio = bio;
+static void plug_timer_fn(PKDPC dpc, struct block_device *bdev, PVOID arg1, PVOID arg2)
+{
+	queue_plug_flush(bdev, &bdev->plug_stats.timer_flushes);
+}
+
+	/* Called from DrbdIoCompletion() for every completed IRP. */
+
+static void plug_io_completed(struct block_device *bdev, ULONGLONG irp_submission_time)
+{
+	LONGLONG latency;
 
-if (bio_data_dir(bio) == WRITE) {
-// printk("2 bio is %p bio->bi_vcnt is %d num_vector_elements is %d num_joinable_bios is %d\n", bio, bio->bi_vcnt, num_vector_elements, num_joinable_bios);
+	if (irp_submission_time != 0) {
+		latency = KeQueryInterruptTime() - irp_submission_time;
+			/* Moving average, races here are harmless. */
+		bdev->plug_latency += (latency - bdev->plug_latency) / 8;
+	}
+	if (bdev->plugged_bios > 0)
+		queue_plug_flush(bdev, &bdev->plug_stats.idle_flushes);
 }
 
+	/* We want to put the bio on a list. */
+
+static void hold_bio(struct bio *bio)
+{
+	int i;
+
+	bio_get(bio);
+
+		/* TODO: also get pages? It works with this ...
+		   But why? Is there some get_page inside the
+		   generic_make_request2 / windrbd_make_request?
+		   I think this is because we copy the bi_vec
+		   elements to a new structure...
+		 */
+
+	for (i=0;i<bio->bi_vcnt;i++) {
+		get_page(bio->bi_io_vec[i].bv_page);
 	}
-// printk("At end of loop: Found %d joinable bios (%lld bytes)\n", num_joinable_bios, joinable_size);
-		/* bio variable is invalid here ... */
-	ret = create_and_submit_joined_bio(num_vector_elements, joinable_size, &tmp_list, NULL);
+}
 
-	return ret;
+	/* Returns true if the plug should be flushed now. */
+
+static bool plug_bio(struct block_device *bdev, struct bio *bio)
+{
+	KIRQL flags;
+	bool first, full;
+	LARGE_INTEGER delay;
+
+	hold_bio(bio);
+
+	spin_lock_irqsave(&bdev->cork_spinlock, flags);
+	windrbd_insert_corked_bio(&bdev->corked_tree, bio);
+	first = (bdev->plugged_bios == 0);
+	bdev->plugged_bios++;
+	bdev->plugged_bytes += bio->bi_iter.bi_size;
+	full = (bdev->plugged_bytes >= windrbd_auto_plug_max_bytes);
+	spin_unlock_irqrestore(&bdev->cork_spinlock, flags);
+
+	atomic_inc64(&bdev->plug_stats.plugged_bios);
+
+	if (first && !full) {
+		delay.QuadPart = RELATIVE(plug_delay(bdev));
+		KeSetTimer(&bdev->plug_ktimer, delay, &bdev->plug_dpc);
+	}
+	return full;
 }
 
-	/* Corking. Keep bios on a list and submit them
-	 * at once as a single request (if possible).
+	/* Corking (and auto plugging). Keep bios on a list and
+	 * submit them at once as a single request (if possible).
 	 */
 
 int generic_make_request(struct bio *bio)
 {
 	struct block_device *bdev = bio->bi_bdev;
 	KIRQL flags;
-	int i;
+	bool arm_timer;
 
 	bio->where_i_am = "in generic_make_request 1";
 
@@ -2521,37 +3034,61 @@ int generic_make_request(struct bio *bio)
 		 */
 
 	spin_lock_irqsave(&bdev->in_flight_bios_lock, flags);
-	list_add(&bio->locally_submitted_bios, &bdev->in_flight_bios);
 	bio->submission_timestamp = jiffies;
+	list_add_tail(&bio->locally_submitted_bios, &bdev->in_flight_bios);
+		/* If the timer is armed it expires for an older bio
+		 * anyway.
+		 */
+	arm_timer = bdev->disk_timeout != 0 && !bdev->disk_timeout_armed;
+	if (arm_timer)
+		bdev->disk_timeout_armed = true;
 	spin_unlock_irqrestore(&bdev->in_flight_bios_lock, flags);
 
-	rearm_disk_timeout_timer(bdev);
+	if (arm_timer)
+		mod_timer(&bdev->disk_timeout_timer, bio->submission_timestamp + bdev->disk_timeout);
+
+		/* Discards and zero out writes have no data to join,
+		 * send them directly.
+		 */
+	if (bio_op(bio) == REQ_OP_DISCARD || test_bit(BI_WINDRBD_FLAG_REPEAT_PAGE, &bio->bi_windrbd_flags))
+		return generic_make_request2(bio);
 
 	if (bdev->corked) {
 		bio->where_i_am = "in generic_make_request bdev corked";
-		bio_get(bio);	/* we want to put it on a list. */
-
-			/* TODO: also get pages? It works with this ...
-			   But why? Is there some get_page inside the
-			   generic_make_request2 / windrbd_make_request?
-			   I think this is because we copy the bi_vec
-			   elements to a new structure...
-			 */
-
-		for (i=0;i<bio->bi_vcnt;i++) {
-			get_page(bio->bi_io_vec[i].bv_page);
-		}
+		hold_bio(bio);
 
 		spin_lock_irqsave(&bdev->cork_spinlock, flags);
-	        list_add(&bio->corked_bios, &bdev->corked_list);
+		windrbd_insert_corked_bio(&bdev->corked_tree, bio);
 		spin_unlock_irqrestore(&bdev->cork_spinlock, flags);
 
 		return 0;
-	} else {
-// printk("bio %p corking is off: submitting (4)\n", bio);
-		bio->where_i_am = "in generic_make_request no corking";
-		return generic_make_request2(bio);
 	}
+	if (windrbd_auto_plug && bdev->is_backing_device && !bio->is_user_request) {
+		if (bio->bi_opf & (REQ_PREFLUSH | REQ_FUA)) {
+			if (bdev->plugged_bios > 0) {
+				atomic_inc64(&bdev->plug_stats.sync_flushes);
+				windrbd_flush_plug(bdev);
+			}
+		} else if (atomic_read(&bdev->num_irps_pending) > 0) {
+			bio->where_i_am = "in generic_make_request plugged";
+			if (plug_bio(bdev, bio)) {
+				atomic_inc64(&bdev->plug_stats.size_flushes);
+				return windrbd_flush_plug(bdev);
+			}
+			return 0;
+		} else if (bdev->plugged_bios > 0) {
+				/* Backing device is idle, submit together
+				 * with what we have.
+				 */
+			bio->where_i_am = "in generic_make_request plugged";
+			plug_bio(bdev, bio);
+			atomic_inc64(&bdev->plug_stats.idle_flushes);
+			return windrbd_flush_plug(bdev);
+		}
+	}
+// printk("bio %p corking is off: submitting (4)\n", bio);
+	bio->where_i_am = "in generic_make_request no corking";
+	return generic_make_request2(bio);
 }
 
 static void bio_endio_impl(struct bio *bio, bool was_accounted)
@@ -2584,12 +3121,14 @@ static void bio_endio_impl(struct bio *bio, bool was_accounted)
 		bio_get(bio);
 	spin_unlock_irqrestore(&bio->already_failed_lock, flags);
 
+		/* The disk timeout timer is not touched here, it
+		 * rearms itself for the then oldest bio when it
+		 * expires.
+		 */
 	if (!bio->disk_has_timed_out) {
 		spin_lock_irqsave(&bio->bi_bdev->in_flight_bios_lock, flags2);
 		list_del_init(&bio->locally_submitted_bios);
 		spin_unlock_irqrestore(&bio->bi_bdev->in_flight_bios_lock, flags2);
-
-		rearm_disk_timeout_timer(bio->bi_bdev);
 	}	/* Else we got called by fail_all_in_flight_bios */
 
 	bio_get(bio);
@@ -2619,55 +3158,6 @@ void bio_endio(struct bio *bio)
 	bio_endio_impl(bio, true);
 }
 
-void __list_del_entry(struct list_head *entry)
-{
-	__list_del(entry->prev, entry->next);
-}
-
-void list_del_init(struct list_head *entry)
-{
-	__list_del_entry(entry);
-	INIT_LIST_HEAD(entry);
-}
-
-int hlist_unhashed(const struct hlist_node *h)
-{
-	return !h->pprev;
-}
-
-void __hlist_del(struct hlist_node *n)
-{
-	struct hlist_node *next = n->next;
-	struct hlist_node **pprev = n->pprev;
-	*pprev = next;
-	if (next)
-		next->pprev = pprev;
-}
-
-void INIT_HLIST_NODE(struct hlist_node *h)
-{
-    h->next = NULL;
-    h->pprev = NULL;
-}
-
-void hlist_del_init(struct hlist_node *n)
-{
-	if (!hlist_unhashed(n)) {
-		__hlist_del(n);
-		INIT_HLIST_NODE(n);
-	}
-}
-
-void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
-{
-	struct hlist_node *first = h->first;
-	n->next = first;
-	if (first)
-		first->pprev = &n->next;
-	h->first = n;
-	n->pprev = &h->first;
-}
-
 
 /*----------------------------------------------------------------------*/
 /* This was shamelessly stolen from the Linux kernel.			*/
@@ -3115,6 +3605,13 @@ void delete_block_device(struct kref *kref)
 {
 	struct block_device *bdev = container_of(kref, struct block_device, kref);
 
+		/* The plug DPC might be running and queue plug_work,
+		 * which must not run on the freed bdev.
+		 */
+	KeCancelTimer(&bdev->plug_ktimer);
+	KeFlushQueuedDpcs();
+	cancel_work_sync(&bdev->plug_work);
+
 	if (bdev->bdflush_thread != NULL) {
 		bdev->bdflush_should_run = 0;
 		wake_up(&bdev->bdflush_event);
@@ -3374,6 +3871,7 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode, void *ho
 		err = -EINVAL;
 		goto out_get_volsize_error;
 	}
+	windrbd_set_discard_limits(block_device);
 	block_device->path_to_device = path_to_device;
 
 	init_waitqueue_head(&block_device->bios_event);
@@ -3387,7 +3885,10 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode, void *ho
 		/* Corking ... new with 1.1.8 */
 	block_device->corked = false;
 	spin_lock_init(&block_device->cork_spinlock);
-	INIT_LIST_HEAD(&block_device->corked_list);
+	block_device->corked_tree = RB_ROOT;
+	KeInitializeTimer(&block_device->plug_ktimer);
+	KeInitializeDpc(&block_device->plug_dpc, (PKDEFERRED_ROUTINE)plug_timer_fn, block_device);
+	INIT_WORK(&block_device->plug_work, plug_work_fn);
 
 		/* fail I/O on disk timeout, new in 1.1.9 */
 	spin_lock_init(&block_device->in_flight_bios_lock);
@@ -3395,6 +3896,7 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode, void *ho
 
 		/* we have our own timer now, new in 1.1.17 */
 	block_device->disk_timeout = 0;
+	block_device->disk_timeout_armed = false;
 	timer_setup(&block_device->disk_timeout_timer, disk_timeout_timer_fn, 0);
 
 	inject_faults(-1, &block_device->inject_on_completion);
@@ -3798,12 +4300,16 @@ block_device->my_auto_promote = 1;
 		/* Corking ... new with 1.1.8 */
 	block_device->corked = false;
 	spin_lock_init(&block_device->cork_spinlock);
-	INIT_LIST_HEAD(&block_device->corked_list);
+	block_device->corked_tree = RB_ROOT;
+	KeInitializeTimer(&block_device->plug_ktimer);
+	KeInitializeDpc(&block_device->plug_dpc, (PKDEFERRED_ROUTINE)plug_timer_fn, block_device);
+	INIT_WORK(&block_device->plug_work, plug_work_fn);
 		/* fail I/O on disk timeout, new in 1.1.9 */
 	spin_lock_init(&block_device->in_flight_bios_lock);
 	INIT_LIST_HEAD(&block_device->in_flight_bios);
 		/* we have our own timer now, new in 1.1.17 */
 	block_device->disk_timeout = 0;
+	block_device->disk_timeout_armed = false;
 	timer_setup(&block_device->disk_timeout_timer, disk_timeout_timer_fn, 0);
 	inject_faults(-1, &block_device->inject_on_completion);
 	inject_faults(-1, &block_device->inject_on_request);
@@ -4054,27 +4560,82 @@ int windrbd_set_mount_point_for_minor_utf16(int minor, const wchar_t *mount_poin
 	return ret;
 }
 
+	/* Number of I/O workqueues (each with its own thread) per
+	 * DRBD device. 1 is one ordered queue for all application
+	 * I/O of the device, 0 means one queue per processor.
+	 * Registry value io_queues_per_device.
+	 */
+
+int windrbd_io_queues_per_device = 1;
+
 static int windrbd_allocate_io_workqueue(struct block_device *bdev)
 {
-	bdev->io_workqueue = alloc_ordered_workqueue("windrbd_io", 0);
+	int n, i;
+
+	n = windrbd_io_queues_per_device;
+	if (n <= 0)
+		n = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	if (n <= 0)
+		n = 1;
+
+	bdev->io_workqueues = kzalloc(sizeof(*bdev->io_workqueues)*n, GFP_KERNEL, 'DRBD');
+	if (bdev->io_workqueues == NULL)
+		return -ENOMEM;
 
-	if (bdev->io_workqueue == NULL)
+	for (i=0;i<n;i++) {
+		bdev->io_workqueues[i] = alloc_ordered_workqueue("windrbd_io%d", 0, i);
+		if (bdev->io_workqueues[i] == NULL)
+			break;
+	}
+	if (i == 0) {
+		kfree(bdev->io_workqueues);
+		bdev->io_workqueues = NULL;
 		return -ENOMEM;
+	}
+	if (i < n)
+		printk("Warning: could only allocate %d of %d I/O workqueues.\n", i, n);
+
+	bdev->num_io_workqueues = i;
+	bdev->io_workqueue = bdev->io_workqueues[0];
 
 	return 0;
 }
 
 static void windrbd_destroy_io_workqueue(struct block_device *bdev)
 {
-	if (bdev->io_workqueue != NULL) {
-		flush_workqueue(bdev->io_workqueue);
-		destroy_workqueue(bdev->io_workqueue);
+	int i;
+
+	if (bdev->io_workqueues != NULL) {
+		for (i=0;i<bdev->num_io_workqueues;i++) {
+			flush_workqueue(bdev->io_workqueues[i]);
+			destroy_workqueue(bdev->io_workqueues[i]);
+		}
+		kfree(bdev->io_workqueues);
+		bdev->io_workqueues = NULL;
+		bdev->num_io_workqueues = 0;
 		bdev->io_workqueue = NULL;
 	} else {
 		printk("Warning windrbd_destroy_io_workqueue called without workqueue being allocated.\n");
 	}
 }
 
+	/* Requests are queued on the workqueue of the processor they
+	 * come from. There is no ordering between requests on
+	 * different queues, which is fine for application I/O: the
+	 * upper layers do not expect ordering of in-flight requests,
+	 * flushes are submitted directly (see windrbd_flush()) and
+	 * DRBD itself serializes conflicting writes. The bios of
+	 * one IRP all go to the same queue.
+	 */
+
+struct workqueue_struct *windrbd_select_io_workqueue(struct block_device *bdev)
+{
+	if (bdev->num_io_workqueues <= 1)
+		return bdev->io_workqueue;
+
+	return bdev->io_workqueues[KeGetCurrentProcessorNumberEx(NULL) % bdev->num_io_workqueues];
+}
+
 /* This is intended to be used by boot code where there are
  * no WinDRBD managed mount points and the device just needs
  * to be created early so that Windows has a boot device.
@@ -4327,9 +4888,43 @@ void bdput(struct block_device *this_bdev)
 }
 
 
+	/* Nanoseconds per performance counter tick in 32.32 fixed
+	 * point, set by init_ktime(). Rounding error is less than
+	 * frequency / 2^32 ns per second (2.4ns per second at the
+	 * usual 10 MHz).
+	 */
+static ULONGLONG ktime_mult;
+static LONGLONG ktime_frequency;
+
+static void init_ktime(void)
+{
+	LARGE_INTEGER freq;
+
+	KeQueryPerformanceCounter(&freq);
+	ktime_frequency = freq.QuadPart;
+	ktime_mult = (1000ULL*1000*1000 << 32) / freq.QuadPart;
+}
+
+	/* Monotonic, based on the performance counter (the TSC
+	 * on machines with an invariant TSC, else HPET or ACPI PM
+	 * timer). Resolution is 1/frequency, usually 100ns. This
+	 * used to be jiffies * 1000000 which has clock tick (15.6ms)
+	 * resolution. Cost is one KeQueryPerformanceCounter() plus
+	 * one multiplication, see windrbd run-test clock_benchmark.
+	 */
+
 ktime_t ktime_get(void)
 {
-	return (ktime_t) { .tv64 = jiffies * (1000*1000*1000/HZ) };
+	LARGE_INTEGER now = KeQueryPerformanceCounter(NULL);
+#ifdef _WIN64
+	ULONGLONG lo, hi;
+
+	lo = UnsignedMultiply128(now.QuadPart, ktime_mult, &hi);
+	return (ktime_t) { .tv64 = (hi << 32) | (lo >> 32) };
+#else
+	return (ktime_t) { .tv64 = now.QuadPart / ktime_frequency * NSEC_PER_SEC +
+		now.QuadPart % ktime_frequency * NSEC_PER_SEC / ktime_frequency };
+#endif
 }
 
 ktime_t ktime_get_real(void)
@@ -4353,53 +4948,257 @@ void unregister_blkdev(int major, const char *name)
 	/* does nothing */
 }
 
-/* To be implemented. See also
- *   https://msdn.microsoft.com/de-de/library/ff552562(v=vs.85).aspx
- *   https://msdn.microsoft.com/de-de/library/hh439649(v=vs.85).aspx
-*/
+	/* blkdev_issue_discard() and blkdev_issue_zeroout() submit
+	 * all bios of a range at once and wait for the last one.
+	 */
+
+struct issue_batch {
+	atomic_t pending;
+	int error;
+	struct completion done;
+};
+
+static void issue_batch_init(struct issue_batch *batch)
+{
+	atomic_set(&batch->pending, 1);
+	batch->error = 0;
+	init_completion(&batch->done);
+}
+
+static void issue_batch_endio(struct bio *bio)
+{
+	struct issue_batch *batch = bio->bi_private;
+
+	if (bio->bi_status != BLK_STS_OK)
+		batch->error = blk_status_to_errno(bio->bi_status);
+	if (atomic_dec_and_test(&batch->pending))
+		complete(&batch->done);
+
+	bio_put(bio);
+}
+
+	/* Repeat page bios send an MDL, which a driver that wants
+	 * buffered I/O cannot handle (like bio_can_scatter_gather()).
+	 */
+
+static bool bdev_can_repeat_page(struct block_device *bdev)
+{
+	return bdev->windows_device != NULL && (bdev->windows_device->Flags & DO_DIRECT_IO) != 0;
+}
+
+	/* Splits the range into bios of at most max_sects sectors.
+	 * For REQ_OP_WRITE the bios write zeroes from the shared
+	 * zero page, one page per bio if the backing device cannot
+	 * do repeat page requests.
+	 */
+
+static void issue_batch_submit(struct issue_batch *batch, struct block_device *bdev, sector_t sector, sector_t nr_sects, sector_t max_sects, unsigned int op, int windrbd_flag, gfp_t gfp_mask)
+{
+	struct bio *bio;
+	sector_t this_sects;
+	bool repeat_page = false;
+
+	if (op != REQ_OP_DISCARD) {
+		repeat_page = bdev_can_repeat_page(bdev);
+		if (!repeat_page)
+			max_sects = PAGE_SIZE >> 9;
+	}
+
+	while (nr_sects > 0 && batch->error == 0) {
+		this_sects = min_t(sector_t, nr_sects, max_sects);
+
+		bio = bio_alloc(gfp_mask, op == REQ_OP_DISCARD ? 0 : 1, 'DSMB');
+		if (bio == NULL) {
+			batch->error = -ENOMEM;
+			break;
+		}
+		bio_set_dev(bio, bdev);
+		bio_set_op_attrs(bio, op, 0);
+		bio->bi_iter.bi_sector = sector;
+		bio->bi_iter.bi_size = this_sects << 9;
+		bio->bi_end_io = issue_batch_endio;
+		bio->bi_private = batch;
+		if (windrbd_flag >= 0)
+			__set_bit(windrbd_flag, &bio->bi_windrbd_flags);
+
+		if (op != REQ_OP_DISCARD) {
+				/* put_page by the free bios thread */
+			get_page(windrbd_zero_page);
+			bio->bi_io_vec[0].bv_page = windrbd_zero_page;
+			bio->bi_io_vec[0].bv_len = this_sects << 9;
+			bio->bi_io_vec[0].bv_offset = 0;
+			bio->bi_vcnt = 1;
+			if (repeat_page) {
+				bio->bi_io_vec[0].bv_len = PAGE_SIZE;
+				__set_bit(BI_WINDRBD_FLAG_REPEAT_PAGE, &bio->bi_windrbd_flags);
+			}
+		}
+
+		atomic_inc(&batch->pending);
+		submit_bio(bio);
+
+		sector += this_sects;
+		nr_sects -= this_sects;
+	}
+}
+
+static int issue_batch_wait(struct issue_batch *batch)
+{
+	if (!atomic_dec_and_test(&batch->pending))
+		wait_for_completion(&batch->done);
+
+	return batch->error;
+}
+
+	/* Splits the range into discard bios of at most
+	 * max_discard_sectors (a multiple of the discard
+	 * granularity), submits them all and waits for them.
+	 */
+
 int blkdev_issue_discard(struct block_device *bdev, sector_t sector,
         sector_t nr_sects, gfp_t gfp_mask, ULONG_PTR flags)
 {
-	printk("Warning: blkdev_issue_discard not implemented.\n");
-	return -EIO;
+	struct request_queue *q = bdev_get_queue(bdev);
+	struct issue_batch batch;
+
+	if (q == NULL || !blk_queue_discard(q) || q->limits.max_discard_sectors == 0)
+		return -EOPNOTSUPP;
+
+	issue_batch_init(&batch);
+	issue_batch_submit(&batch, bdev, sector, nr_sects, q->limits.max_discard_sectors, REQ_OP_DISCARD, -1, gfp_mask);
+
+	return issue_batch_wait(&batch);
 }
 
-int blkdev_issue_write_same(struct block_device *bdev, sector_t sector,
-				sector_t nr_sects, gfp_t gfp_mask,
-				struct page *page)
+	/* Zero out using the backing device's TRIM if it reads
+	 * back zeroes afterwards: only the part aligned to the
+	 * discard granularity (offset by the discard alignment)
+	 * is trimmed. Returns the first and last sector
+	 * (exclusive) that were trimmed.
+	 */
+
+static int zeroout_offload(struct block_device *bdev, sector_t sector, sector_t nr_sects, gfp_t gfp_mask, sector_t *start, sector_t *end)
+{
+	struct request_queue *q = bdev_get_queue(bdev);
+	struct issue_batch batch;
+	sector_t granularity, offset, first, last;
+	int err;
+
+	granularity = q->limits.discard_granularity / 512;
+	if (granularity == 0)
+		granularity = 1;
+		/* Granules start at discard_alignment + n * granularity.
+		 * Shift by offset so they start at multiples of
+		 * granularity (first is at least 1, so nothing
+		 * underflows when shifting back).
+		 */
+	offset = granularity - (q->limits.discard_alignment / 512) % granularity;
+
+	first = (sector + offset + granularity - 1) / granularity;
+	last = (sector + nr_sects + offset) / granularity;
+	if (last <= first)
+		return -EOPNOTSUPP;
+
+	*start = first * granularity - offset;
+	*end = last * granularity - offset;
+
+	issue_batch_init(&batch);
+	issue_batch_submit(&batch, bdev, *start, *end - *start, q->limits.max_write_zeroes_sectors, REQ_OP_DISCARD, BI_WINDRBD_FLAG_MUST_ZERO, gfp_mask);
+	err = issue_batch_wait(&batch);
+
+	if (err == 0)
+		atomic_add64((*end - *start) << 9, &windrbd_zeroout_offload_bytes);
+	return err;
+}
+
+static int zeroout_zero_page(struct block_device *bdev, sector_t sector, sector_t nr_sects, gfp_t gfp_mask)
 {
-	printk("Warning: blkdev_issue_write_same not implemented.\n");
-	return -EIO;
+	struct issue_batch batch;
+	int err;
+
+	issue_batch_init(&batch);
+	issue_batch_submit(&batch, bdev, sector, nr_sects, MAX_REPEAT_PAGE_SECTORS, REQ_OP_WRITE, -1, gfp_mask);
+	err = issue_batch_wait(&batch);
+
+	if (err == 0)
+		atomic_add64(nr_sects << 9, &windrbd_zeroout_zero_page_bytes);
+	return err;
 }
 
-int kobject_uevent(struct kobject *kobj, enum kobject_action action)
+	/* Zero out a range of the backing device (DRBD uses this
+	 * for resync of deallocated (thin) areas and for zero out
+	 * requests from the peer). If discard is true and
+	 * offloading is enabled and possible (see
+	 * windrbd_zeroout_offload), the bulk is trimmed, else (and
+	 * for unaligned head and tail) zeroes are written from the
+	 * shared zero page.
+	 */
+
+int blkdev_issue_zeroout(struct block_device *bdev, sector_t sector,
+	sector_t nr_sects, gfp_t gfp_mask, bool discard)
 {
-	printk("Warning: kobject_uevent not implemented\n");
+	struct request_queue *q = bdev_get_queue(bdev);
+	sector_t start, end;
+	int err;
 
-	return 0;
+	if (nr_sects == 0)
+		return 0;
+	if (windrbd_zero_page == NULL)
+		return -ENOMEM;
+
+	atomic_inc64(&windrbd_zeroout_requests);
+
+	if (windrbd_zeroout_offload && discard && q != NULL &&
+	    blk_queue_discard(q) && q->limits.discard_zeroes_data &&
+	    q->limits.max_write_zeroes_sectors > 0) {
+		err = zeroout_offload(bdev, sector, nr_sects, gfp_mask, &start, &end);
+		if (err == 0) {
+			err = zeroout_zero_page(bdev, sector, start - sector, gfp_mask);
+			if (err == 0)
+				err = zeroout_zero_page(bdev, end, sector + nr_sects - end, gfp_mask);
+			return err;
+		}
+		if (err != -EOPNOTSUPP)
+			printk(KERN_WARNING "Zero out offload failed with error %d, writing zeroes instead.\n", err);
+	}
+	return zeroout_zero_page(bdev, sector, nr_sects, gfp_mask);
 }
 
-static spinlock_t cpu_cache_spinlock;
+	/* Windows has no WRITE SAME for arbitrary block devices.
+	 * DRBD does not use it (max_write_same_sectors is always 0),
+	 * but a page of zeroes is handled like a zero out.
+	 */
 
-/* This takes a spinlock and releases it right after, this should
- * make sure that CPU caches are in sync on SMP machines.
- */
+int blkdev_issue_write_same(struct block_device *bdev, sector_t sector,
+				sector_t nr_sects, gfp_t gfp_mask,
+				struct page *page)
+{
+	int i;
+
+	for (i=0;i<512;i++)
+		if (((char*)page->addr)[i] != 0)
+			break;
+
+	if (i == 512)
+		return blkdev_issue_zeroout(bdev, sector, nr_sects, gfp_mask, false);
+
+	printk("Warning: blkdev_issue_write_same with non-zero data not supported.\n");
+	return -EOPNOTSUPP;
+}
 
-void flush_all_cpu_caches(void)
+int kobject_uevent(struct kobject *kobj, enum kobject_action action)
 {
-	KIRQL flags;
+	printk("Warning: kobject_uevent not implemented\n");
 
-        spin_lock_irqsave(&cpu_cache_spinlock, flags);
-        spin_unlock_irqrestore(&cpu_cache_spinlock, flags);
+	return 0;
 }
 
 	/* NO printk's in here. */
 void init_windrbd(void)
 {
 	mutex_init(&read_bootsector_mutex);
-	spin_lock_init(&g_test_and_change_bit_lock);
-	spin_lock_init(&cpu_cache_spinlock);
 	spin_lock_init(&global_queue_lock);
+	init_ktime();
 
 #ifdef SPIN_LOCK_DEBUG
 	KeInitializeSpinLock(&spinlock_lock);
@@ -0,0 +1,221 @@
+/*
+	Copyright(C) 2017-2018, Johannes Thoma <johannes@johannesthoma.com>
+	Copyright(C) 2017-2018, LINBIT HA-Solutions GmbH  <office@linbit.com>
+
+	Windows DRBD is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2, or (at your option)
+	any later version.
+
+	Windows DRBD is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Windows DRBD; see the file COPYING. If not, write to
+	the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/* Slab backed bio allocation. A bio slab object contains the
+ * bio itself, its bio_vec array, the IRP pointer array used by
+ * generic_make_request2() and a private area (used by the
+ * windrbd device for the io_request of user requests). So a
+ * typical I/O needs two allocations (bio and struct page)
+ * instead of five.
+ *
+ * Objects come from one kmem_cache (lookaside list) per size
+ * class. Freed objects are kept on small per-CPU lists first,
+ * so the common case (allocate and free on the same CPU) does
+ * not touch the lookaside list at all.
+ */
+
+#include <linux/slab.h>
+#include "drbd_windows.h"
+
+	/* Registry value bio_slab. If 0, bios are kzalloc'ed
+	 * as before.
+	 */
+
+int windrbd_bio_slab = 1;
+
+atomic_t64 windrbd_bio_slab_allocations;
+atomic_t64 windrbd_bio_slab_cpu_cache_hits;
+
+	/* Counts pool (kmalloc) allocations done on the I/O path,
+	 * see bio_alloc_ll() and windrbd_make_drbd_requests().
+	 */
+
+atomic_t64 windrbd_bio_pool_allocations;
+
+	/* Max number of free objects kept per CPU and size class. */
+#define BIO_SLAB_CPU_CACHE_DEPTH 64
+
+static int bio_slab_vecs[] = { 1, 16, 64, BIO_MAX_VECS };
+
+#define NUM_BIO_SLAB_CLASSES ARRAY_SIZE(bio_slab_vecs)
+
+struct bio_slab_class {
+	struct kmem_cache *cache;
+	size_t bio_size;	/* bio including bio_vecs, zeroed on alloc */
+	size_t irps_offset;
+	int num_irps;
+	size_t private_offset;
+	SLIST_HEADER *cpu_free;	/* one per CPU */
+};
+
+static struct bio_slab_class bio_slab_classes[NUM_BIO_SLAB_CLASSES];
+static ULONG bio_slab_num_cpus;
+static bool bio_slab_initialized;
+
+static int init_bio_slab_class(struct bio_slab_class *c, int nr_vecs)
+{
+	size_t size;
+	ULONG cpu;
+
+	c->bio_size = sizeof(struct bio) + (nr_vecs-1) * sizeof(struct bio_vec);
+	c->irps_offset = ALIGN(c->bio_size, MEMORY_ALLOCATION_ALIGNMENT);
+		/* One for each vector element plus the flush request */
+	c->num_irps = nr_vecs+1;
+	c->private_offset = ALIGN(c->irps_offset + c->num_irps * sizeof(struct _IRP*), MEMORY_ALLOCATION_ALIGNMENT);
+	size = c->private_offset + BIO_SLAB_PRIVATE_SIZE;
+
+		/* SLIST_HEADERs must be 16 byte aligned, which
+		 * pool memory is.
+		 */
+	c->cpu_free = ExAllocatePoolWithTag(NonPagedPool, bio_slab_num_cpus * sizeof(*c->cpu_free), 'BSDW');
+	if (c->cpu_free == NULL)
+		return -ENOMEM;
+
+	for (cpu=0;cpu<bio_slab_num_cpus;cpu++)
+		InitializeSListHead(&c->cpu_free[cpu]);
+
+	c->cache = kmem_cache_create("windrbd_bio", size, 0, 0, NULL, 'BSDW');
+	if (c->cache == NULL) {
+		ExFreePool(c->cpu_free);
+		c->cpu_free = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void shutdown_bio_slab_class(struct bio_slab_class *c)
+{
+	PSLIST_ENTRY e;
+	ULONG cpu;
+
+	if (c->cache == NULL)
+		return;
+
+	for (cpu=0;cpu<bio_slab_num_cpus;cpu++)
+		while ((e = InterlockedPopEntrySList(&c->cpu_free[cpu])) != NULL)
+			kmem_cache_free(c->cache, e);
+
+	kmem_cache_destroy(c->cache);
+	ExFreePool(c->cpu_free);
+	c->cache = NULL;
+	c->cpu_free = NULL;
+}
+
+void init_bio_slab(void)
+{
+	int i;
+
+	bio_slab_num_cpus = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	for (i=0;i<NUM_BIO_SLAB_CLASSES;i++) {
+		if (init_bio_slab_class(&bio_slab_classes[i], bio_slab_vecs[i]) < 0) {
+			printk("Warning: could not create bio slab for %d vectors, bios will be kzalloc'ed.\n", bio_slab_vecs[i]);
+			while (--i >= 0)
+				shutdown_bio_slab_class(&bio_slab_classes[i]);
+			return;
+		}
+	}
+	bio_slab_initialized = true;
+}
+
+	/* Call this only when driver should be unloaded and the
+	 * free bios threads are stopped (all bios are freed).
+	 */
+
+void shutdown_bio_slab(void)
+{
+	int i;
+
+	if (!bio_slab_initialized)
+		return;
+
+	bio_slab_initialized = false;
+	for (i=0;i<NUM_BIO_SLAB_CLASSES;i++)
+		shutdown_bio_slab_class(&bio_slab_classes[i]);
+}
+
+	/* Returns a bio with bi_io_vec and the inline IRP slots zeroed
+	 * and the slab members set up, or NULL if there is no slab
+	 * for that many vectors (or no memory). Caller falls back to
+	 * kzalloc then.
+	 */
+
+struct bio *windrbd_bio_slab_alloc(int nr_iovecs)
+{
+	struct bio_slab_class *c;
+	struct bio *bio;
+	char *obj;
+	ULONG cpu;
+	int i;
+
+	if (!windrbd_bio_slab || !bio_slab_initialized)
+		return NULL;
+
+	for (i=0;i<NUM_BIO_SLAB_CLASSES;i++)
+		if (nr_iovecs <= bio_slab_vecs[i])
+			break;
+	if (i == NUM_BIO_SLAB_CLASSES)
+		return NULL;
+
+	c = &bio_slab_classes[i];
+	cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+	obj = NULL;
+	if (cpu < bio_slab_num_cpus)
+		obj = (char*) InterlockedPopEntrySList(&c->cpu_free[cpu]);
+
+	if (obj != NULL) {
+		atomic_inc64(&windrbd_bio_slab_cpu_cache_hits);
+			/* The private area is initialized by its user. */
+		RtlZeroMemory(obj, c->private_offset);
+	} else {
+		obj = kmem_cache_alloc(c->cache, GFP_NOIO);
+		if (obj == NULL)
+			return NULL;
+	}
+	atomic_inc64(&windrbd_bio_slab_allocations);
+
+	bio = (struct bio*) obj;
+	bio->bi_slab_class = i+1;
+	bio->bi_inline_irps = (struct _IRP**) (obj + c->irps_offset);
+	bio->bi_num_inline_irps = c->num_irps;
+	bio->bi_slab_private = obj + c->private_offset;
+
+	return bio;
+}
+
+	/* Called by free_bio_now() instead of kfree(). */
+
+void windrbd_bio_slab_free(struct bio *bio)
+{
+	struct bio_slab_class *c = &bio_slab_classes[bio->bi_slab_class-1];
+	ULONG cpu;
+
+	cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+		/* kmem_cache_alloc() might be a kmalloc with debug
+		 * header, which need not be aligned for SLIST_ENTRY.
+		 */
+	if (cpu < bio_slab_num_cpus &&
+	    ((ULONG_PTR) bio & (MEMORY_ALLOCATION_ALIGNMENT-1)) == 0 &&
+	    ExQueryDepthSList(&c->cpu_free[cpu]) < BIO_SLAB_CPU_CACHE_DEPTH) {
+		InterlockedPushEntrySList(&c->cpu_free[cpu], (PSLIST_ENTRY) bio);
+		return;
+	}
+	kmem_cache_free(c->cache, bio);
+}
@@ -661,6 +661,8 @@ dbg("root ioctl is %x object is %p\n", s->Parameters.DeviceIoControl.IoControlCo
 	return status;
 }
 
+static NTSTATUS windrbd_discard(struct block_device *dev, struct _DEVICE_DATA_SET_RANGE *ranges, int num_ranges);
+
 static NTSTATUS windrbd_device_control(struct _DEVICE_OBJECT *device, struct _IRP *irp)
 {
 	if (device == drbd_bus_device) {
@@ -931,6 +933,7 @@ dbg("IOCTL_MOUNTDEV_QUERY_SUGGESTED_LINK_NAME mount_point is %S\n", dev->mount_p
 			case StorageAccessAlignmentProperty:
 			case StorageDeviceSeekPenaltyProperty:
 			case StorageDeviceTrimProperty:
+			case StorageDeviceLBProvisioningProperty:
 //			case StorageDeviceResiliencyProperty:
 				status = STATUS_SUCCESS;
 				break;
@@ -1043,11 +1046,10 @@ dbg("IOCTL_MOUNTDEV_QUERY_SUGGESTED_LINK_NAME mount_point is %S\n", dev->mount_p
 // printk("StorageDeviceTrimProperty ...\n");
 				trim.Version = sizeof(trim);
 				trim.Size = sizeof(trim);
-					/* TRIM not implemented till now. TODO: 
-					 * Change this value once TRIM is
-					 * supported.
+					/* DRBD sets this on its queue if
+					 * all backing devices support TRIM.
 					 */
-				trim.TrimEnabled = FALSE;
+				trim.TrimEnabled = bdev_get_queue(dev) != NULL && blk_queue_discard(bdev_get_queue(dev));
 
 				RtlCopyMemory(irp->AssociatedIrp.SystemBuffer, &trim, CopySize);
 				irp->IoStatus.Information = (ULONG_PTR)CopySize;
@@ -1055,6 +1057,29 @@ dbg("IOCTL_MOUNTDEV_QUERY_SUGGESTED_LINK_NAME mount_point is %S\n", dev->mount_p
 				break;
 			}
 
+			case StorageDeviceLBProvisioningProperty:
+			{
+				struct _DEVICE_LB_PROVISIONING_DESCRIPTOR lbp;
+				struct request_queue *q = bdev_get_queue(dev);
+
+				CopySize = (s->Parameters.DeviceIoControl.OutputBufferLength < sizeof(lbp)?s->Parameters.DeviceIoControl.OutputBufferLength:sizeof(lbp));
+				memset(&lbp, 0, sizeof(lbp));
+				lbp.Version = sizeof(lbp);
+				lbp.Size = sizeof(lbp);
+					/* Tells Windows to send UNMAP
+					 * (and how to align it).
+					 */
+				lbp.ThinProvisioningEnabled = q != NULL && blk_queue_discard(q);
+				lbp.OptimalUnmapGranularity = (q != NULL && q->limits.discard_granularity > 0) ? q->limits.discard_granularity : 512;
+				lbp.UnmapGranularityAlignmentValid = TRUE;
+				lbp.UnmapGranularityAlignment = q != NULL ? q->limits.discard_alignment : 0;
+
+				RtlCopyMemory(irp->AssociatedIrp.SystemBuffer, &lbp, CopySize);
+				irp->IoStatus.Information = (ULONG_PTR)CopySize;
+				status = STATUS_SUCCESS;
+				break;
+			}
+
 #if 0
 	/* This is "reserved for system use". ReFS calls this
          * to check if there is redundancy at device level.
@@ -1172,10 +1197,31 @@ dbg("IOCTL_MOUNTDEV_QUERY_SUGGESTED_LINK_NAME mount_point is %S\n", dev->mount_p
 
 // printk("%d items\n", items);
 
-		// status = STATUS_SUCCESS;
-		status = STATUS_NOT_SUPPORTED;
 		irp->IoStatus.Information = 0;
-		/* TODO: trim */
+
+			/* Only when DRBD accepts discards (which it does
+			 * if all backing devices support TRIM). We have
+			 * to wait for the discards, so not at raised IRQL.
+			 */
+		if (bdev_get_queue(dev) == NULL || !blk_queue_discard(bdev_get_queue(dev)) ||
+		    KeGetCurrentIrql() != PASSIVE_LEVEL) {
+			status = STATUS_NOT_SUPPORTED;
+			break;
+		}
+		if ((attrs->Flags & DEVICE_DSM_FLAG_ENTIRE_DATA_SET_RANGE) != 0) {
+				/* No ranges given, whole device */
+			struct _DEVICE_DATA_SET_RANGE whole_device;
+
+			whole_device.StartingOffset = 0;
+			whole_device.LengthInBytes = dev->d_size;
+			status = windrbd_discard(dev, &whole_device, 1);
+			break;
+		}
+		if (items == 0) {
+			status = STATUS_SUCCESS;
+			break;
+		}
+		status = windrbd_discard(dev, (struct _DEVICE_DATA_SET_RANGE*) (((char*)attrs)+attrs->DataSetRangesOffset), items);
 
 		break;
 	}
@@ -1664,6 +1710,48 @@ static int io_complete_thread(void *irp_p)
 
 #define MAX_BIO_SIZE (1024*1024)
 
+	/* If set, READ requests from the upper layers are done
+	 * directly into the caller's buffer (the system address of
+	 * the locked MDL) without an intermediate buffer and without
+	 * an extra copy on completion. Set registry value
+	 * zero_copy_reads to 0 to get the old behaviour (bounce
+	 * buffer plus RtlCopyMemory), for example for comparing
+	 * the two.
+	 */
+
+int windrbd_zero_copy_reads = 1;
+
+	/* Statistics for READ requests from upper layers. Print
+	 * them with windrbd run-test read_copy_stats
+	 */
+
+atomic_t64 windrbd_read_requests;
+atomic_t64 windrbd_read_bytes;
+atomic_t64 windrbd_read_bytes_copied;
+
+void windrbd_init_io_tunables(void)
+{
+	get_registry_int(L"zero_copy_reads", &windrbd_zero_copy_reads, 1);
+	printk("Zero copy reads are %s\n", windrbd_zero_copy_reads ? "enabled" : "disabled");
+	get_registry_int(L"scatter_gather_io", &windrbd_scatter_gather_io, 1);
+	printk("Scatter/gather I/O to backing devices is %s\n", windrbd_scatter_gather_io ? "enabled" : "disabled");
+	get_registry_int(L"io_queues_per_device", &windrbd_io_queues_per_device, 1);
+	printk("I/O queues per device: %d (0 is one per processor)\n", windrbd_io_queues_per_device);
+	get_registry_int(L"inline_submission", &windrbd_inline_submission, 0);
+	get_registry_int(L"inline_submission_min_stack", &windrbd_inline_submission_min_stack, 12*1024);
+	printk("Inline submission of requests is %s (minimum stack is %d bytes)\n", windrbd_inline_submission ? "enabled" : "disabled", windrbd_inline_submission_min_stack);
+	get_registry_int(L"auto_plug", &windrbd_auto_plug, 0);
+	get_registry_int(L"auto_plug_max_usecs", &windrbd_auto_plug_max_usecs, 200);
+	get_registry_int(L"auto_plug_max_bytes", &windrbd_auto_plug_max_bytes, 512*1024);
+	printk("Auto plugging is %s (holding bios for at most %d microseconds or %d bytes)\n", windrbd_auto_plug ? "enabled" : "disabled", windrbd_auto_plug_max_usecs, windrbd_auto_plug_max_bytes);
+	get_registry_int(L"zeroout_offload", &windrbd_zeroout_offload, 0);
+	printk("Zero out offload (TRIM on backing devices that read back zeroes) is %s\n", windrbd_zeroout_offload ? "enabled (TRIM must really zero the blocks, else data may diverge)" : "disabled");
+	get_registry_int(L"bio_slab", &windrbd_bio_slab, 1);
+	printk("Slab allocation of bios is %s\n", windrbd_bio_slab ? "enabled" : "disabled");
+	get_registry_int(L"immediate_bio_free", &windrbd_immediate_bio_free, 1);
+	printk("Immediate freeing of bios is %s\n", windrbd_immediate_bio_free ? "enabled" : "disabled");
+}
+
 static void windrbd_bio_finished(struct bio * bio)
 {
 	PIRP irp = bio->bi_upper_irp;
@@ -1681,7 +1769,12 @@ static void windrbd_bio_finished(struct bio * bio)
 
 	if (error == 0) {
 		if (bio_data_dir(bio) == READ) {
-			if (!bio->bi_common_data->bc_device_failed && bio->bi_upper_irp && bio->bi_upper_irp->MdlAddress) {
+			atomic_add64(bio->bi_iter.bi_size, &windrbd_read_bytes);
+
+				/* On zero copy reads data is already in the
+				 * caller's buffer.
+				 */
+			if (!test_bit(BI_WINDRBD_FLAG_ZERO_COPY_READ, &bio->bi_windrbd_flags) && !bio->bi_common_data->bc_device_failed && bio->bi_upper_irp && bio->bi_upper_irp->MdlAddress) {
 				char *user_buffer = bio->bi_upper_irp_buffer;
 				if (user_buffer != NULL) {
 					int offset;
@@ -1690,6 +1783,7 @@ static void windrbd_bio_finished(struct bio * bio)
 					for (i=0;i<bio->bi_vcnt;i++) {
 						RtlCopyMemory(user_buffer+offset, ((char*)bio->bi_io_vec[i].bv_page->addr)+bio->bi_io_vec[i].bv_offset, bio->bi_io_vec[i].bv_len);
 						offset += bio->bi_io_vec[i].bv_len;
+						atomic_add64(bio->bi_io_vec[i].bv_len, &windrbd_read_bytes_copied);
 					}
 				} else {
 					printk(KERN_WARNING "MmGetSystemAddressForMdlSafe returned NULL\n");
@@ -1772,9 +1866,12 @@ static void windrbd_bio_finished(struct bio * bio)
 #endif
 //		kthread_run(io_complete_thread, irp, "complete-irp");
 
-		if (bio_data_dir(bio) == WRITE)
+		if (bio_data_dir(bio) == WRITE || test_bit(BI_WINDRBD_FLAG_ZERO_COPY_READ, &bio->bi_windrbd_flags))
 				/* Signal free_mdl thread that it should
-				 * complete the IRP.
+				 * complete the IRP. For zero copy reads
+				 * the backing device's MDLs still reference
+				 * the caller's buffer, so the IRP must not
+				 * be completed before they are gone.
 				 */
 			bio->delayed_io_completion = true;
 		else
@@ -1813,17 +1910,119 @@ struct io_request {
 	struct work_struct w;
 	struct drbd_device *drbd_device;
 	struct bio *bio;
+	bool in_bio_slab;	/* part of the bio, do not kfree */
+};
+
+	/* What we keep in the private area of a slab allocated bio
+	 * (see windrbd_bioset.c): saves the kzalloc for the
+	 * io_request of a user request. The struct page is not kept
+	 * there: wsk_sendpage() holds a reference to it until the
+	 * send completes, which may be after the bio is freed.
+	 */
+
+struct windrbd_bio_private {
+	struct io_request ioreq;
 };
 
+C_ASSERT(sizeof(struct windrbd_bio_private) <= BIO_SLAB_PRIVATE_SIZE);
+
+	/* If set, submit requests directly to DRBD (without the
+	 * hop through the I/O workqueue) when we are allowed to
+	 * sleep and there is enough stack left for DRBD and the
+	 * backing device's drivers. Registry values
+	 * inline_submission and inline_submission_min_stack
+	 * (in bytes).
+	 */
+
+int windrbd_inline_submission = 0;
+int windrbd_inline_submission_min_stack = 12*1024;
+
+atomic_t64 windrbd_inline_submissions;
+atomic_t64 windrbd_queued_submissions;
+
+static bool can_submit_inline(void)
+{
+	if (!windrbd_inline_submission)
+		return false;
+
+	if (KeGetCurrentIrql() != PASSIVE_LEVEL)
+		return false;
+
+		/* wait_event() needs a WinDRBD thread (see
+		 * windrbd_dispatch()).
+		 */
+	if (!is_windrbd_thread(current))
+		return false;
+
+	if (IoGetRemainingStackSize() < (ULONG_PTR) windrbd_inline_submission_min_stack)
+		return false;
+
+	return true;
+}
+
 static void drbd_make_request_work(struct work_struct *w)
 {
 	struct io_request *ioreq = container_of(w, struct io_request, w);
+	bool in_bio_slab = ioreq->in_bio_slab;
 
 // printk("1\n");
 	atomic_inc(&ioreq->bio->bi_bdev->num_bios_pending);
+		/* If the io_request is part of the bio it might be
+		 * gone once drbd_submit_bio() returns.
+		 */
 	drbd_submit_bio(ioreq->bio);
 // printk("2\n");
-	kfree(ioreq);
+	if (!in_bio_slab)
+		kfree(ioreq);
+}
+
+	/* Hand a bio to the DRBD engine, either directly or via
+	 * the device's I/O workqueue. Returns 0 or a negative
+	 * error code (bio is not submitted then).
+	 */
+
+static int windrbd_submit_to_drbd(struct block_device *dev, struct bio *bio)
+{
+	struct workqueue_struct *io_workqueue;
+
+	io_workqueue = windrbd_select_io_workqueue(dev);
+	if (io_workqueue == NULL) {
+		printk("Warning: dev->io_workqueue is NULL on I/O handler.\n");
+		return -EINVAL;
+	}
+
+	if (can_submit_inline()) {
+		atomic_inc64(&windrbd_inline_submissions);
+		atomic_inc(&bio->bi_bdev->num_bios_pending);
+		drbd_submit_bio(bio);
+	} else {
+		/* drbd_make_request(dev->drbd_device->rq_queue, bio); */
+		struct io_request *ioreq;
+
+		if (bio->bi_slab_private != NULL) {
+			ioreq = &((struct windrbd_bio_private*) bio->bi_slab_private)->ioreq;
+			RtlZeroMemory(ioreq, sizeof(*ioreq));
+			ioreq->in_bio_slab = true;
+		} else {
+			ioreq = kzalloc(sizeof(*ioreq), GFP_KERNEL, 'DRBD');
+			if (ioreq == NULL) {
+				return -ENOMEM;
+			}
+			atomic_inc64(&windrbd_bio_pool_allocations);
+		}
+		INIT_WORK(&ioreq->w, drbd_make_request_work);
+
+			/* No need for refcount. workqueue is flushed
+			 * and destroyed when becoming secondary, so
+			 * no in-flight requests on drbdadm down.
+			 */
+		ioreq->drbd_device = dev->drbd_device;
+		ioreq->bio = bio;
+
+		atomic_inc64(&windrbd_queued_submissions);
+		queue_work(io_workqueue, &ioreq->w);
+	}
+	return 0;
 }
 
 	/* Create a bio from the parameters and submit I/O request to
@@ -1839,6 +2038,7 @@ static NTSTATUS windrbd_make_drbd_requests(struct _IRP *irp, struct block_device
 	struct bio_collection *common_data;
 	struct _KEVENT event;
 	NTSTATUS status;
+	int ret;
 
 	if (rw == WRITE && dev->drbd_device->resource->role[NOW] != R_PRIMARY) {
 		printk("Attempt to write when not Primary\n");
@@ -1881,6 +2081,7 @@ static NTSTATUS windrbd_make_drbd_requests(struct _IRP *irp, struct block_device
 		printk("Cannot allocate common data.\n");
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
+	atomic_inc64(&windrbd_bio_pool_allocations);
 	atomic_set(&common_data->bc_num_completed, 0);
 	common_data->bc_total_size = total_size;
 	common_data->bc_num_requests = bio_count;
@@ -1893,6 +2094,8 @@ static NTSTATUS windrbd_make_drbd_requests(struct _IRP *irp, struct block_device
 
 	if (irp != NULL) {
 	        IoMarkIrpPending(irp);
+		if (rw == READ)
+			atomic_inc64(&windrbd_read_requests);
 	}
 
 	for (b=0; b<bio_count; b++) {
@@ -1918,11 +2121,13 @@ static NTSTATUS windrbd_make_drbd_requests(struct _IRP *irp, struct block_device
 
 cond_printk("%s sector: %d total_size: %d\n", rw == WRITE ? "WRITE" : "READ", sector, total_size);
 
+			/* The page is freed by the last put_page */
 		bio->bi_io_vec[0].bv_page = kzalloc(sizeof(struct page), GFP_KERNEL, 'DRBD');
 		if (bio->bi_io_vec[0].bv_page == NULL) {
 			printk("Couldn't allocate page.\n");
 			return STATUS_INSUFFICIENT_RESOURCES; /* TODO: cleanup */
 		}
+		atomic_inc64(&windrbd_bio_pool_allocations);
 
 		bio->bi_io_vec[0].bv_len = this_bio_size;
 		bio->bi_io_vec[0].bv_page->size = this_bio_size;
@@ -1933,16 +2138,23 @@ cond_printk("%s sector: %d total_size: %d\n", rw == WRITE ? "WRITE" : "READ", se
 			 */
 		get_page(bio->bi_io_vec[0].bv_page);
 
+			/* With zero_copy_reads the READ goes directly into
+			 * the caller's buffer, else use an intermediate
+			 * buffer that is copied on completion.
+			 */
 
-/*
- * TODO: eventually we want to make READ requests work without the
- *	 intermediate buffer and the extra copy.
- */
-
-
-		if (irp != NULL && bio_data_dir(bio) == READ) {
+		if (irp != NULL && bio_data_dir(bio) == READ && !windrbd_zero_copy_reads) {
 			bio->bi_io_vec[0].bv_page->addr = kmalloc(this_bio_size, GFP_KERNEL, 'DRBD');
+			atomic_inc64(&windrbd_bio_pool_allocations);
 		} else {
+				/* Caller's buffer: MDLs must be unlocked at
+				 * PASSIVE_LEVEL (see can_free_bio_now()).
+				 */
+			if (irp != NULL && bio_data_dir(bio) == READ) {
+				__set_bit(BI_WINDRBD_FLAG_ZERO_COPY_READ, &bio->bi_windrbd_flags);
+				bio->bi_paged_memory = true;
+			}
+
 			bio->bi_io_vec[0].bv_page->addr = buffer+bio->bi_mdl_offset;
 			bio->bi_io_vec[0].bv_page->is_system_buffer = 1;
 		}
@@ -1975,28 +2187,11 @@ dbg("bio->bi_iter.bi_size: %d bio->bi_iter.bi_sector: %d bio->bi_mdl_offset: %d\
 		}
 #endif
 
-		if (dev->io_workqueue == NULL) {
-			printk("Warning: dev->io_workqueue is NULL on I/O handler.\n");
-			return -EINVAL;	/* TODO: cleanup */
-		}
 		part_stat_add(dev, sectors[bio_data_dir(bio) == READ ? STAT_READ : STAT_WRITE], this_bio_size / 512);
-		/* drbd_make_request(dev->drbd_device->rq_queue, bio); */
-		struct io_request *ioreq;
 
-		ioreq = kzalloc(sizeof(*ioreq), GFP_KERNEL, 'DRBD');
-		if (ioreq == NULL) {
-			return -ENOMEM;	/* TODO: cleanup */
-		}
-		INIT_WORK(&ioreq->w, drbd_make_request_work);
-
-			/* No need for refcount. workqueue is flushed
-			 * and destroyed when becoming secondary, so
-			 * no in-flight requests on drbdadm down.
-			 */
-		ioreq->drbd_device = dev->drbd_device;
-		ioreq->bio = bio;
-
-		queue_work(dev->io_workqueue, &ioreq->w);
+		ret = windrbd_submit_to_drbd(dev, bio);
+		if (ret < 0)
+			return ret;	/* TODO: cleanup */
 
 		if (irp == NULL) {
 			NTSTATUS status;
@@ -2019,6 +2214,171 @@ dbg("bio->bi_iter.bi_size: %d bio->bi_iter.bi_sector: %d bio->bi_mdl_offset: %d\
 	return STATUS_SUCCESS;
 }
 
+	/* TRIM (DSM ioctl) and SCSI UNMAP requests. Registry
+	 * independent: they are passed to DRBD as discard bios if
+	 * the DRBD device supports discards, else they are
+	 * rejected (DSM) or ignored (UNMAP).
+	 */
+
+atomic_t64 windrbd_discard_requests;
+atomic_t64 windrbd_discard_ranges;
+atomic_t64 windrbd_discard_bios;
+
+	/* Sorts the ranges by offset, merges overlapping and
+	 * adjacent ranges and shrinks the result to whole sectors
+	 * (discarding a partial sector would destroy data).
+	 * Returns the new number of ranges. NTFS usually sends
+	 * sorted ranges, so insertion sort is good enough here.
+	 */
+
+int windrbd_merge_discard_ranges(struct _DEVICE_DATA_SET_RANGE *ranges, int num_ranges)
+{
+	struct _DEVICE_DATA_SET_RANGE r;
+	ULONGLONG start, end, r_end;
+	int i, j, n;
+
+	for (i=1;i<num_ranges;i++) {
+		r = ranges[i];
+		for (j=i;j>0 && ranges[j-1].StartingOffset > r.StartingOffset;j--)
+			ranges[j] = ranges[j-1];
+		ranges[j] = r;
+	}
+
+	n = 0;
+	for (i=0;i<num_ranges;i++) {
+		if (ranges[i].LengthInBytes == 0)
+			continue;
+
+		if (n > 0) {
+			end = ranges[n-1].StartingOffset + ranges[n-1].LengthInBytes;
+			if (ranges[i].StartingOffset <= (LONGLONG) end) {
+				r_end = ranges[i].StartingOffset + ranges[i].LengthInBytes;
+				if (r_end > end)
+					ranges[n-1].LengthInBytes = r_end - ranges[n-1].StartingOffset;
+				continue;
+			}
+		}
+		ranges[n++] = ranges[i];
+	}
+
+	j = 0;
+	for (i=0;i<n;i++) {
+		start = ALIGN((ULONGLONG) ranges[i].StartingOffset, 512);
+		end = (ranges[i].StartingOffset + ranges[i].LengthInBytes) & ~511ULL;
+		if (end <= start)
+			continue;
+
+		ranges[j].StartingOffset = start;
+		ranges[j].LengthInBytes = end - start;
+		j++;
+	}
+	return j;
+}
+
+struct discard_request {
+	atomic_t pending;
+	int error;
+	struct _KEVENT done;
+};
+
+static void windrbd_discard_finished(struct bio *bio)
+{
+	struct discard_request *req = bio->bi_private;
+
+	if (bio->bi_status != BLK_STS_OK)
+		req->error = blk_status_to_errno(bio->bi_status);
+
+	if (atomic_dec_and_test(&req->pending))
+		KeSetEvent(&req->done, 0, FALSE);
+
+	bio_put(bio);
+}
+
+	/* Discards the (byte) ranges on the DRBD device. Must be
+	 * called at PASSIVE_LEVEL, waits for completion. Ranges
+	 * are modified (sorted and merged).
+	 */
+
+static NTSTATUS windrbd_discard(struct block_device *dev, struct _DEVICE_DATA_SET_RANGE *ranges, int num_ranges)
+{
+	struct request_queue *q = bdev_get_queue(dev);
+	struct discard_request req;
+	struct bio *bio;
+	ULONGLONG start, end;
+	unsigned int max_size;
+	unsigned int this_size;
+	int i, ret;
+	NTSTATUS status;
+
+	if (dev->drbd_device == NULL || dev->drbd_device->resource->role[NOW] != R_PRIMARY) {
+		printk("Attempt to discard when not Primary\n");
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+	if (q == NULL || !blk_queue_discard(q))
+		return STATUS_NOT_SUPPORTED;
+
+	status = KeWaitForSingleObject(&dev->io_not_suspended, Executive, KernelMode, FALSE, NULL);
+	if (status != STATUS_SUCCESS) {
+		printk("Error waiting for io_not_suspended event (%08x)\n", status);
+		return status;
+	}
+
+		/* bi_size is 32 bit, so keep discard bios below 2GB */
+	max_size = MAX_BIO_SIZE;
+	if (q->limits.max_discard_sectors > 0)
+		max_size = min_t(unsigned int, q->limits.max_discard_sectors, 1 << 22) << 9;
+
+	atomic_inc64(&windrbd_discard_requests);
+	atomic_add64(num_ranges, &windrbd_discard_ranges);
+	num_ranges = windrbd_merge_discard_ranges(ranges, num_ranges);
+
+	atomic_set(&req.pending, 1);
+	req.error = 0;
+	KeInitializeEvent(&req.done, NotificationEvent, FALSE);
+
+	for (i=0;i<num_ranges && req.error == 0;i++) {
+		start = ranges[i].StartingOffset;
+		end = start + ranges[i].LengthInBytes;
+		if (end > (ULONGLONG) dev->d_size)
+			end = dev->d_size & ~511ULL;
+
+		while (start < end) {
+			this_size = (end - start > max_size) ? max_size : (unsigned int) (end - start);
+
+			bio = bio_alloc(GFP_NOIO, 0, 'DSCD');
+			if (bio == NULL) {
+				req.error = -ENOMEM;
+				break;
+			}
+			bio->bi_opf = REQ_OP_DISCARD;
+			bio->bi_bdev = dev;
+			bio->bi_iter.bi_sector = start >> 9;
+			bio->bi_iter.bi_size = this_size;
+			bio->bi_end_io = windrbd_discard_finished;
+			bio->bi_private = &req;
+
+			atomic_inc(&req.pending);
+			ret = windrbd_submit_to_drbd(dev, bio);
+			if (ret < 0) {
+				atomic_dec(&req.pending);
+				bio_put(bio);
+				req.error = ret;
+				break;
+			}
+			atomic_inc64(&windrbd_discard_bios);
+			start += this_size;
+		}
+	}
+	if (!atomic_dec_and_test(&req.pending))
+		KeWaitForSingleObject(&req.done, Executive, KernelMode, FALSE, NULL);
+
+	if (req.error != 0) {
+		printk("Discard failed with error %d\n", req.error);
+		return STATUS_IO_DEVICE_ERROR;
+	}
+	return STATUS_SUCCESS;
+}
+
 static NTSTATUS make_drbd_requests_from_irp(struct _IRP *irp, struct block_device *dev)
 {
 	struct _IO_STACK_LOCATION *s = IoGetCurrentIrpStackLocation(irp);
@@ -3553,6 +3913,16 @@ static int read_boot_sector_from_drbd(struct block_device *bdev, char *bootsect)
 	return windrbd_make_drbd_requests(NULL, bdev, bootsect, 512, 0, READ);
 }
 
+	/* Synchronous I/O to a DRBD device through the same path
+	 * as application I/O (used by the I/O benchmarks in
+	 * windrbd_test.c).
+	 */
+
+NTSTATUS windrbd_io_sync(struct block_device *bdev, char *buffer, unsigned int size, sector_t sector, unsigned long rw)
+{
+	return windrbd_make_drbd_requests(NULL, bdev, buffer, size, sector, rw);
+}
+
 extern int is_filesystem(char *buf);
 
 int windrbd_check_for_filesystem_and_maybe_start_faking_partition_table(struct block_device *bdev)
@@ -3992,6 +4362,89 @@ static NTSTATUS windrbd_scsi(struct _DEVICE_OBJECT *device, struct _IRP *irp)
 			}
 			break;
 
+			/* UNMAP is a hint, so if we cannot discard now
+			 * (not Primary, no TRIM on the backing devices,
+			 * raised IRQL) just report success.
+			 */
+
+		case SCSIOP_UNMAP:
+		{
+			struct _UNMAP_LIST_HEADER *header;
+			struct _UNMAP_BLOCK_DESCRIPTOR *descr;
+			struct _DEVICE_DATA_SET_RANGE *ranges;
+			ULONGLONG lba, first_data_sector, last_data_sector;
+			ULONG lba_count;
+			USHORT descr_length;
+			int i, num_descr, num_ranges;
+
+			srb->SrbStatus = SRB_STATUS_SUCCESS;
+			irp->IoStatus.Information = 0;
+
+			if (bdev == NULL || KeGetCurrentIrql() != PASSIVE_LEVEL ||
+			    bdev_get_queue(bdev) == NULL || !blk_queue_discard(bdev_get_queue(bdev)))
+				break;
+
+			if (srb->DataTransferLength < sizeof(*header) || irp->MdlAddress == NULL)
+				break;
+
+			buffer = ((char*)srb->DataBuffer - (char*)MmGetMdlVirtualAddress(irp->MdlAddress)) + (char*)MmGetSystemAddressForMdlSafe(irp->MdlAddress, HighPagePriority);
+			if (buffer == NULL)
+				break;
+
+			header = (struct _UNMAP_LIST_HEADER*) buffer;
+			descr_length = 0;
+			REVERSE_BYTES_SHORT(&descr_length, &header->BlockDescrDataLength[0]);
+			if (descr_length > srb->DataTransferLength - sizeof(*header))
+				descr_length = srb->DataTransferLength - sizeof(*header);
+
+			num_descr = descr_length / sizeof(*descr);
+			if (num_descr == 0)
+				break;
+
+			ranges = kmalloc(num_descr * sizeof(*ranges), GFP_KERNEL, 'DSCD');
+			if (ranges == NULL) {
+				srb->SrbStatus = SRB_STATUS_ERROR;
+				break;
+			}
+			first_data_sector = bdev->data_shift;
+			last_data_sector = bdev->data_shift + bdev->d_size/512;
+
+			descr = (struct _UNMAP_BLOCK_DESCRIPTOR*) (buffer + sizeof(*header));
+			num_ranges = 0;
+			for (i=0;i<num_descr;i++) {
+				REVERSE_BYTES_QUAD(&lba, &descr[i].StartingLba[0]);
+				lba_count = 0;
+				REVERSE_BYTES(&lba_count, &descr[i].LbaCount[0]);
+
+					/* Clip to the DRBD data area (not
+					 * the virtual partition table).
+					 */
+				if (lba < first_data_sector) {
+					if (lba + lba_count <= first_data_sector)
+						continue;
+					lba_count -= (ULONG) (first_data_sector - lba);
+					lba = first_data_sector;
+				}
+				if (lba >= last_data_sector)
+					continue;
+				if (lba + lba_count > last_data_sector)
+					lba_count = (ULONG) (last_data_sector - lba);
+
+				ranges[num_ranges].StartingOffset = (lba - first_data_sector) * 512;
+				ranges[num_ranges].LengthInBytes = (ULONGLONG) lba_count * 512;
+				num_ranges++;
+			}
+			if (num_ranges > 0) {
+				status = windrbd_discard(bdev, ranges, num_ranges);
+				if (status == STATUS_IO_DEVICE_ERROR)
+					srb->SrbStatus = SRB_STATUS_ERROR;
+				else
+					status = STATUS_SUCCESS;
+			}
+			kfree(ranges);
+			break;
+		}
+
 		case SCSIOP_MODE_SENSE:
 		{
 			PMODE_PARAMETER_HEADER ModeParameterHeader;
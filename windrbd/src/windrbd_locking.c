@@ -29,14 +29,139 @@
 #include "windrbd_threads.h"
 #include <wdm.h>
 
+	/* Mutexes used to be KMUTEX objects, so every lock and
+	 * unlock went through the dispatcher. Now uncontended
+	 * mutex_lock() and mutex_unlock() are one interlocked
+	 * operation each. m->state is 0 (unlocked), 1 (locked) or
+	 * 2 (locked, there may be waiters). A contended locker
+	 * first spins for a while (adaptive: about twice as long
+	 * as it took on average before), then sets state to 2 and
+	 * sleeps on m->event. Unlock wakes one waiter only if state
+	 * was 2.
+	 *
+	 * Like with KMUTEX the owner may lock the mutex again and
+	 * normal kernel APCs are disabled while it is held.
+	 */
+
+#define MUTEX_SPIN_MAX 1000
+
+	/* Set with windrbd run-test 'mutex_stats enable'. Hold times
+	 * need a performance counter read on lock and unlock.
+	 */
+int windrbd_mutex_stats;
+
+	/* Print them with windrbd run-test mutex_stats */
+
+atomic_t64 windrbd_mutex_acquisitions;	/* only if windrbd_mutex_stats */
+atomic_t64 windrbd_mutex_contended;
+atomic_t64 windrbd_mutex_spin_acquired;
+atomic_t64 windrbd_mutex_sleeps;
+atomic_t64 windrbd_mutex_hold_time_total;	/* performance counter ticks */
+atomic_t64 windrbd_mutex_hold_time_max;
+
 void mutex_init(struct mutex *m)
 {
-	KeInitializeMutex(&m->mtx, 0);
+	m->state = 0;
+	m->owner = NULL;
+	m->recursion = 0;
+	m->spins = 0;
+	m->locked_at = 0;
+	KeInitializeEvent(&m->event, SynchronizationEvent, FALSE);
+}
+
+static void mutex_acquired(struct mutex *m)
+{
+	m->owner = KeGetCurrentThread();
+	if (windrbd_mutex_stats) {
+		m->locked_at = KeQueryPerformanceCounter(NULL).QuadPart;
+		atomic_inc64(&windrbd_mutex_acquisitions);
+	}
+}
+
+static bool mutex_spin(struct mutex *m)
+{
+	int n, limit;
+	bool got_it;
+
+	if (KeQueryActiveProcessorCount(NULL) < 2)
+		return false;
+
+	limit = min_t(int, m->spins * 2 + 10, MUTEX_SPIN_MAX);
+	got_it = false;
+	for (n=0;n<limit;n++) {
+		YieldProcessor();
+		if (m->state == 0 && InterlockedCompareExchange(&m->state, 1, 0) == 0) {
+			got_it = true;
+			break;
+		}
+	}
+	m->spins += (n - m->spins) / 8;
+
+	return got_it;
+}
+
+	/* Returns STATUS_SUCCESS, STATUS_TIMEOUT (if timeout is
+	 * not NULL) or STATUS_WAIT_1 if sig_event (if not NULL) was
+	 * signalled.
+	 */
+
+static NTSTATUS mutex_lock_slowpath(struct mutex *m, PLARGE_INTEGER timeout, PKEVENT sig_event)
+{
+	PVOID wait_objects[2];
+	NTSTATUS status;
+	LONG c;
+
+	atomic_inc64(&windrbd_mutex_contended);
+	if (mutex_spin(m)) {
+		atomic_inc64(&windrbd_mutex_spin_acquired);
+		return STATUS_SUCCESS;
+	}
+	wait_objects[0] = &m->event;
+	wait_objects[1] = sig_event;
+
+	c = InterlockedExchange(&m->state, 2);
+	while (c != 0) {
+		atomic_inc64(&windrbd_mutex_sleeps);
+		if (sig_event != NULL)
+			status = KeWaitForMultipleObjects(2, wait_objects, WaitAny, Executive, KernelMode, FALSE, timeout, NULL);
+		else
+			status = KeWaitForSingleObject(&m->event, Executive, KernelMode, FALSE, timeout);
+
+		if (status != STATUS_WAIT_0)
+			return status;
+
+			/* Someone unlocked, but someone else might have
+			 * been faster.
+			 */
+		c = InterlockedExchange(&m->state, 2);
+	}
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS __mutex_lock(struct mutex *m, PLARGE_INTEGER timeout, PKEVENT sig_event)
+{
+	NTSTATUS status;
+
+	if (m->owner == KeGetCurrentThread()) {
+		m->recursion++;
+		return STATUS_SUCCESS;
+	}
+	KeEnterCriticalRegion();
+
+	status = STATUS_SUCCESS;
+	if (InterlockedCompareExchange(&m->state, 1, 0) != 0)
+		status = mutex_lock_slowpath(m, timeout, sig_event);
+
+	if (status == STATUS_SUCCESS)
+		mutex_acquired(m);
+	else
+		KeLeaveCriticalRegion();
+
+	return status;
 }
 
 NTSTATUS mutex_lock_timeout(struct mutex *m, ULONG msTimeout)
 {
-	NTSTATUS status = STATUS_UNSUCCESSFUL;
 	LARGE_INTEGER nWaitTime = { 0, };
 
 	if (NULL == m)
@@ -46,14 +171,13 @@ NTSTATUS mutex_lock_timeout(struct mutex *m, ULONG msTimeout)
 
 	nWaitTime.QuadPart = (-1 * 10000);
 	nWaitTime.QuadPart *= msTimeout;		// multiply timeout value separately to avoid overflow.
-	status = KeWaitForMutexObject(&m->mtx, Executive, KernelMode, FALSE, &nWaitTime);
 
-	return status;
+	return __mutex_lock(m, &nWaitTime, NULL);
 }
 
 NTSTATUS mutex_lock(struct mutex *m)
 {
-    return KeWaitForMutexObject(&m->mtx, Executive, KernelMode, FALSE, NULL);
+	return __mutex_lock(m, NULL, NULL);
 }
 
 int mutex_lock_interruptible(struct mutex *m)
@@ -61,22 +185,14 @@ int mutex_lock_interruptible(struct mutex *m)
 	NTSTATUS status = STATUS_UNSUCCESSFUL;
 	int err = -EIO;
 	struct task_struct *thread = current;
-	PVOID waitObjects[2];
-	int wObjCount = 1;
 
-	waitObjects[0] = (PVOID)&m->mtx;
-	if (thread->has_sig_event)
-	{
-		waitObjects[1] = (PVOID)&thread->sig_event;
-		wObjCount++;
-	}
 enter_interruptible();	
-	status = KeWaitForMultipleObjects(wObjCount, &waitObjects[0], WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
+	status = __mutex_lock(m, NULL, thread->has_sig_event ? &thread->sig_event : NULL);
 exit_interruptible();	
 
 	switch (status)
 	{
-	case STATUS_WAIT_0:		// mutex acquired.
+	case STATUS_SUCCESS:		// mutex acquired.
 		err = 0;
 		break;
 	case STATUS_WAIT_1:		// thread got signal by the func 'force_sig'
@@ -94,29 +210,46 @@ exit_interruptible();
 // Returns 1 if the mutex is locked, 0 if unlocked.
 int mutex_is_locked(struct mutex *m)
 {
-	return (KeReadStateMutex(&m->mtx) == 1) ? 0 : 1;
+	return m->state != 0;
 }
 
 // Try to acquire the mutex atomically. 
 // Returns 1 if the mutex has been acquired successfully, and 0 on contention.
 int mutex_trylock(struct mutex *m)
 {
-	LARGE_INTEGER Timeout;
-	Timeout.QuadPart = 0; 
-
-	if (KeWaitForMutexObject(&m->mtx, Executive, KernelMode, FALSE, &Timeout) == STATUS_SUCCESS)
-	{
+	if (m->owner == KeGetCurrentThread()) {
+		m->recursion++;
 		return 1;
 	}
-	else
-	{
-		return 0;
+	KeEnterCriticalRegion();
+	if (InterlockedCompareExchange(&m->state, 1, 0) == 0) {
+		mutex_acquired(m);
+		return 1;
 	}
+	KeLeaveCriticalRegion();
+	return 0;
 }
 
 void mutex_unlock(struct mutex *m)
 {
-	KeReleaseMutex(&m->mtx, FALSE);
+	LONGLONG held;
+
+	if (m->recursion > 0) {
+		m->recursion--;
+		return;
+	}
+	if (m->locked_at != 0) {
+		held = KeQueryPerformanceCounter(NULL).QuadPart - m->locked_at;
+		m->locked_at = 0;
+		atomic_add64(held, &windrbd_mutex_hold_time_total);
+		update_max64(&windrbd_mutex_hold_time_max, held);
+	}
+	m->owner = NULL;
+
+	if (InterlockedExchange(&m->state, 0) == 2)
+		KeSetEvent(&m->event, IO_NO_INCREMENT, FALSE);
+
+	KeLeaveCriticalRegion();
 }
 
 void sema_init(struct semaphore *s, int val)
@@ -156,51 +289,190 @@ void up(struct semaphore *s)
 		printk("BUG: Semaphore limit reached: %d\n", s->sem.Limit);
 }
 
-	/* TODO: Implement rw_semaphores using list of waiters
-	 * and a real semaphore.
+	/* rw_semaphore: sem->state holds the number of readers
+	 * holding the semaphore, a bit for a writer holding it and
+	 * a bit telling that there are waiters. Uncontended down_*
+	 * and up_* are one interlocked operation.
+	 *
+	 * Waiters queue in FIFO order (they sleep on an event on
+	 * their stack). As long as someone is waiting, down_read()
+	 * and down_write() do not overtake them, so writers are not
+	 * starved by a stream of readers. Whoever releases the
+	 * semaphore last hands it over to the waiter at the head of
+	 * the queue (and to all readers directly following it).
+	 *
+	 * Since there is no owner, the _non_owner variants are the
+	 * same as the normal ones.
 	 */
 
+#define RWSEM_WRITER		0x40000000
+#define RWSEM_WAITERS		0x20000000
+#define RWSEM_READERS_MASK	0x1fffffff
+
+struct rwsem_waiter {
+	struct list_head list;
+	KEVENT event;
+	bool writer;
+};
+
 void init_rwsem(struct rw_semaphore *sem)
 {
-	sema_init(&sem->the_semaphore, 1);
+	sem->state = 0;
+	spin_lock_init(&sem->wait_lock);
+	INIT_LIST_HEAD(&sem->waiters);
+}
+
+static bool rwsem_try_read(struct rw_semaphore *sem, LONG busy)
+{
+	LONG old;
+
+	do {
+		old = sem->state;
+		if (old & busy)
+			return false;
+	} while (InterlockedCompareExchange(&sem->state, old+1, old) != old);
+
+	return true;
+}
+
+static bool rwsem_try_write(struct rw_semaphore *sem, LONG busy)
+{
+	LONG old;
+
+	do {
+		old = sem->state;
+		if (old & busy)
+			return false;
+	} while (InterlockedCompareExchange(&sem->state, old | RWSEM_WRITER, old) != old);
+
+	return true;
+}
+
+	/* Grants the semaphore to waiters at the head of the queue
+	 * as far as possible. Call with wait_lock held.
+	 */
+
+static void rwsem_wake(struct rw_semaphore *sem)
+{
+	struct rwsem_waiter *w;
+	bool writer;
+
+	while (!list_empty(&sem->waiters)) {
+		w = list_first_entry(&sem->waiters, struct rwsem_waiter, list);
+		writer = w->writer;
+
+		if (writer) {
+			if (!rwsem_try_write(sem, RWSEM_WRITER | RWSEM_READERS_MASK))
+				break;
+		} else {
+			if (!rwsem_try_read(sem, RWSEM_WRITER))
+				break;
+		}
+		list_del(&w->list);
+			/* w is invalid after this */
+		KeSetEvent(&w->event, IO_NO_INCREMENT, FALSE);
+
+		if (writer)
+			break;
+	}
+	if (list_empty(&sem->waiters))
+		InterlockedAnd(&sem->state, ~RWSEM_WAITERS);
+}
+
+static void rwsem_down_slowpath(struct rw_semaphore *sem, bool writer)
+{
+	struct rwsem_waiter w;
+	KIRQL flags;
+
+	KeInitializeEvent(&w.event, NotificationEvent, FALSE);
+	w.writer = writer;
+
+	spin_lock_irqsave(&sem->wait_lock, flags);
+	list_add_tail(&w.list, &sem->waiters);
+	InterlockedOr(&sem->state, RWSEM_WAITERS);
+
+		/* Holder might have released the semaphore before
+		 * it could see the waiters bit. Then no one else
+		 * would wake us.
+		 */
+	rwsem_wake(sem);
+	spin_unlock_irqrestore(&sem->wait_lock, flags);
+
+	KeWaitForSingleObject(&w.event, Executive, KernelMode, FALSE, NULL);
+}
+
+static void rwsem_wake_waiters(struct rw_semaphore *sem)
+{
+	KIRQL flags;
+
+	spin_lock_irqsave(&sem->wait_lock, flags);
+	rwsem_wake(sem);
+	spin_unlock_irqrestore(&sem->wait_lock, flags);
 }
 
 void down_write(struct rw_semaphore *sem)
 {
-	down(&sem->the_semaphore);
+	if (InterlockedCompareExchange(&sem->state, RWSEM_WRITER, 0) != 0)
+		rwsem_down_slowpath(sem, true);
+}
+
+	/* Returns 1 if the semaphore was taken, 0 if not (as on Linux) */
+
+int down_write_trylock(struct rw_semaphore *sem)
+{
+	return InterlockedCompareExchange(&sem->state, RWSEM_WRITER, 0) == 0;
 }
 
 void up_write(struct rw_semaphore *sem)
 {
-	up(&sem->the_semaphore);
+	LONG old;
+
+	old = InterlockedAnd(&sem->state, ~RWSEM_WRITER);
+	if (old & RWSEM_WAITERS)
+		rwsem_wake_waiters(sem);
 }
 
 void down_read(struct rw_semaphore *sem)
 {
-	down(&sem->the_semaphore);
+	if (!rwsem_try_read(sem, RWSEM_WRITER | RWSEM_WAITERS))
+		rwsem_down_slowpath(sem, false);
+}
+
+int down_read_trylock(struct rw_semaphore *sem)
+{
+	return rwsem_try_read(sem, RWSEM_WRITER | RWSEM_WAITERS);
 }
 
 void down_read_non_owner(struct rw_semaphore *sem)
 {
-	down(&sem->the_semaphore);
+	down_read(sem);
 }
 
 void up_read(struct rw_semaphore *sem)
 {
-	up(&sem->the_semaphore);
+	LONG new;
+
+	new = InterlockedDecrement(&sem->state);
+	if ((new & RWSEM_READERS_MASK) == 0 && (new & RWSEM_WAITERS))
+		rwsem_wake_waiters(sem);
 }
 
 void up_read_non_owner(struct rw_semaphore *sem)
 {
-	up(&sem->the_semaphore);
+	up_read(sem);
 }
 
-	/* noop because there is no difference between read and write
-	 * locks for now.
+	/* Turns the write lock into a read lock, waiting readers
+	 * at the head of the queue get the semaphore as well.
 	 */
 
 void downgrade_write(struct rw_semaphore *sem)
 {
+	LONG old;
+
+	old = InterlockedExchangeAdd(&sem->state, 1 - RWSEM_WRITER);
+	if (old & RWSEM_WAITERS)
+		rwsem_wake_waiters(sem);
 }
 
 void spin_lock_init(spinlock_t *lock)
@@ -215,7 +487,236 @@ void spin_lock_init(spinlock_t *lock)
 #endif
 }
 
-static EX_SPIN_LOCK rcu_rw_lock;
+	/* RCU. Readers run at DISPATCH_LEVEL (as they did with the
+	 * shared spinlock this used to be), so they are neither
+	 * preempted nor moved to another CPU. Each CPU has a reader
+	 * state on its own cache line: the number of readers inside
+	 * a read side critical section (low 32 bits) and how often
+	 * that number dropped to zero (high 32 bits). Readers only
+	 * touch the state of their CPU.
+	 *
+	 * A grace period is over when each CPU either had no readers
+	 * or its exit count changed since the grace period started.
+	 * synchronize_rcu() spins until then (read side sections
+	 * are short). call_rcu() queues the callback on a lock free
+	 * list. The rcu_gp thread takes all queued callbacks at once,
+	 * waits for one grace period and then runs the whole batch.
+	 */
+
+#define RCU_CACHE_LINE 64
+#define RCU_READERS_MASK 0xffffffffLL
+#define RCU_EXIT (1LL << 32)
+
+struct rcu_cpu_state {
+	volatile LONG64 state;
+	char pad[RCU_CACHE_LINE - sizeof(LONG64)];
+};
+
+	/* Until init_rcu() (or if it fails) all CPUs share one
+	 * state. This works since the state is only changed with
+	 * interlocked operations.
+	 */
+static struct rcu_cpu_state rcu_cpu_fallback;
+static struct rcu_cpu_state *rcu_cpus = &rcu_cpu_fallback;
+static ULONG num_rcu_cpus = 1;
+static void *rcu_cpus_mem;
+
+static struct rcu_head *volatile rcu_callbacks;
+static struct wait_queue_head rcu_gp_wait;
+static struct task_struct *rcu_gp_thread;
+static bool rcu_gp_thread_should_run;
+static struct completion rcu_gp_thread_done;
+
+	/* Print them with windrbd run-test rcu_stats */
+
+atomic_t64 windrbd_rcu_grace_periods;
+atomic_t64 windrbd_rcu_callbacks;
+atomic_t64 windrbd_rcu_callback_batches;
+
+static struct rcu_cpu_state *rcu_this_cpu(void)
+{
+	ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+		/* CPUs added later share the state of CPU 0 */
+	return &rcu_cpus[cpu < num_rcu_cpus ? cpu : 0];
+}
+
+static KIRQL rcu_enter(void)
+{
+	KIRQL old_irql;
+
+	KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+		/* Full barrier, see rcu_wait_for_readers() */
+	InterlockedIncrement64(&rcu_this_cpu()->state);
+
+	return old_irql;
+}
+
+static void rcu_exit(KIRQL old_irql)
+{
+	struct rcu_cpu_state *c = rcu_this_cpu();
+	LONG64 old, new;
+
+	do {
+		old = c->state;
+		if ((old & RCU_READERS_MASK) == 1)
+			new = old - 1 + RCU_EXIT;
+		else
+			new = old - 1;
+	} while (InterlockedCompareExchange64(&c->state, new, old) != old);
+
+	KeLowerIrql(old_irql);
+}
+
+	/* Waits until all readers that were inside a read side
+	 * critical section when this was called have left it.
+	 */
+
+static void rcu_wait_for_readers(void)
+{
+	struct rcu_cpu_state *c, *me;
+	LONG64 start, now;
+	ULONG cpu;
+
+		/* Pairs with the interlocked increment in rcu_enter():
+		 * either a reader sees what the caller published
+		 * before calling us or we see the reader.
+		 */
+	MemoryBarrier();
+
+		/* At DISPATCH_LEVEL readers on this CPU can only be
+		 * the caller itself. Waiting for them would never
+		 * return.
+		 */
+	me = KeGetCurrentIrql() >= DISPATCH_LEVEL ? rcu_this_cpu() : NULL;
+
+	for (cpu=0;cpu<num_rcu_cpus;cpu++) {
+		c = &rcu_cpus[cpu];
+		if (c == me)
+			continue;
+
+		start = c->state;
+		if ((start & RCU_READERS_MASK) == 0)
+			continue;
+
+		do {
+			YieldProcessor();
+			now = c->state;
+		} while ((now & RCU_READERS_MASK) != 0 &&
+			 (now & ~RCU_READERS_MASK) == (start & ~RCU_READERS_MASK));
+	}
+	MemoryBarrier();
+
+	atomic_inc64(&windrbd_rcu_grace_periods);
+}
+
+static void rcu_queue_callback(struct rcu_head *head, rcu_callback_t func)
+{
+	struct rcu_head *old;
+
+		/* No thread yet (or any more): do it the old way */
+	if (!rcu_gp_thread_should_run) {
+		rcu_wait_for_readers();
+		func(head);
+		return;
+	}
+
+	head->func = func;
+	do {
+		old = rcu_callbacks;
+		head->next = old;
+	} while (InterlockedCompareExchangePointer((PVOID*) &rcu_callbacks, head, old) != old);
+
+	if (old == NULL)
+		wake_up(&rcu_gp_wait);
+}
+
+static int rcu_gp_thread_fn(void *unused)
+{
+	struct rcu_head *list, *fifo, *next;
+	int n;
+
+	while (1) {
+		wait_event(rcu_gp_wait, rcu_callbacks != NULL || !rcu_gp_thread_should_run);
+
+		list = InterlockedExchangePointer((PVOID*) &rcu_callbacks, NULL);
+		if (list == NULL) {
+			if (!rcu_gp_thread_should_run)
+				break;
+			continue;
+		}
+		rcu_wait_for_readers();
+
+			/* List is LIFO, run callbacks in call_rcu() order */
+		fifo = NULL;
+		for (; list != NULL; list = next) {
+			next = list->next;
+			list->next = fifo;
+			fifo = list;
+		}
+		n = 0;
+		for (; fifo != NULL; fifo = next) {
+			next = fifo->next;
+			fifo->func(fifo);
+			n++;
+		}
+		atomic_add64(n, &windrbd_rcu_callbacks);
+		atomic_inc64(&windrbd_rcu_callback_batches);
+	}
+	complete(&rcu_gp_thread_done);
+	return 0;
+}
+
+	/* Needs the threads subsystem and kmalloc. Until this is
+	 * called, call_rcu() runs the callback synchronously.
+	 */
+
+void init_rcu(void)
+{
+	ULONG n;
+	struct rcu_cpu_state *cpus;
+
+	n = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	rcu_cpus_mem = ExAllocatePoolWithTag(NonPagedPool, (n+1) * sizeof(struct rcu_cpu_state), 'UCDW');
+	if (rcu_cpus_mem == NULL)
+		printk("Warning: could not allocate per CPU RCU state, all CPUs will share one.\n");
+	else if (rcu_cpu_fallback.state == 0) {
+			/* No readers yet, safe to switch */
+		cpus = (struct rcu_cpu_state*) ALIGN((ULONG_PTR) rcu_cpus_mem, RCU_CACHE_LINE);
+		RtlZeroMemory(cpus, n * sizeof(*cpus));
+		rcu_cpus = cpus;
+		num_rcu_cpus = n;
+	}
+
+	init_waitqueue_head(&rcu_gp_wait);
+	init_completion(&rcu_gp_thread_done);
+	rcu_gp_thread_should_run = true;
+	rcu_gp_thread = kthread_run(rcu_gp_thread_fn, NULL, "rcu_gp");
+	if (IS_ERR_OR_NULL(rcu_gp_thread)) {
+		printk("Warning: could not start rcu_gp thread, call_rcu will run callbacks synchronously.\n");
+		rcu_gp_thread_should_run = false;
+	}
+}
+
+	/* Call this only when driver should be unloaded (DRBD
+	 * is gone, so there are no readers any more). Runs all
+	 * queued callbacks.
+	 */
+
+void shutdown_rcu(void)
+{
+	if (rcu_gp_thread_should_run) {
+		rcu_gp_thread_should_run = false;
+		wake_up(&rcu_gp_wait);
+		wait_for_completion(&rcu_gp_thread_done);
+	}
+	rcu_cpus = &rcu_cpu_fallback;
+	num_rcu_cpus = 1;
+	if (rcu_cpus_mem != NULL) {
+		ExFreePool(rcu_cpus_mem);
+		rcu_cpus_mem = NULL;
+	}
+}
 
 	/* TODO: this whole spin_lock_debug thing is broken, remove that
 	 * code. We haven't had any system lockup ever since we fixed
@@ -465,7 +966,7 @@ KIRQL rcu_read_lock_debug(const char *file, int line, const char *func)
 	struct spin_lock_currently_held *s;
 
 	s = add_spinlock(NULL, file, line, func);
-	flags = ExAcquireSpinLockShared(&rcu_rw_lock);
+	flags = rcu_enter();
 	if (s)
 		strcpy(s->taken, "TAKEN");
 	return flags;
@@ -473,35 +974,29 @@ KIRQL rcu_read_lock_debug(const char *file, int line, const char *func)
 
 void rcu_read_unlock_debug(KIRQL rcu_flags, const char *file, int line, const char *func)
 {
-	ExReleaseSpinLockShared(&rcu_rw_lock, rcu_flags);
+	rcu_exit(rcu_flags);
 	remove_spinlock(NULL);
 }
 
 void synchronize_rcu_debug(const char *file, int line, const char *func)
 {
-	KIRQL rcu_flags;
 	struct spin_lock_currently_held *s;
 
 	s = add_spinlock(NULL, file, line, func);
-	rcu_flags = ExAcquireSpinLockExclusive(&rcu_rw_lock);
+	rcu_wait_for_readers();
 	if (s)
 		strcpy(s->taken, "TAKEN");
-	/* compiler barrier */
-	ExReleaseSpinLockExclusive(&rcu_rw_lock, rcu_flags);
 	remove_spinlock(NULL);
 }
 
 void call_rcu_debug(struct rcu_head *head, rcu_callback_t f, const char *file, int line, const char *func)
 {
-	KIRQL rcu_flags;
 	struct spin_lock_currently_held *s;
 
 	s = add_spinlock(NULL, file, line, func);
-	rcu_flags = ExAcquireSpinLockExclusive(&rcu_rw_lock);
+	rcu_queue_callback(head, f);
 	if (s)
 		strcpy(s->taken, "TAKEN");
-	f(head);
-	ExReleaseSpinLockExclusive(&rcu_rw_lock, rcu_flags);
 	remove_spinlock(NULL);
 }
 
@@ -674,7 +1169,7 @@ KIRQL rcu_read_lock_debug(const char *file, int line, const char *func)
 	}
 
 	printk("called from %s:%d (%s())\n", file, line, func);
-	flags = ExAcquireSpinLockShared(&rcu_rw_lock);
+	flags = rcu_enter();
 	return flags;
 }
 
@@ -691,7 +1186,7 @@ void rcu_read_unlock_debug(KIRQL rcu_flags, const char *file, int line, const ch
 	} else {
 		printk("RCU read lock called from non-WinDRBD thread (from %s:%d %s())\n", file, line, func);
 	}
-	ExReleaseSpinLockShared(&rcu_rw_lock, rcu_flags);
+	rcu_exit(rcu_flags);
 
 	printk("called from %s:%d (%s())\n", file, line, func);
 	if (is_windrbd_thread(current))
@@ -702,7 +1197,6 @@ extern void print_threads_in_rcu(void);
 
 void synchronize_rcu_debug(const char *file, int line, const char *func)
 {
-	KIRQL rcu_flags;
 	struct task_struct *c;
 
 	print_threads_in_rcu();
@@ -715,34 +1209,19 @@ void synchronize_rcu_debug(const char *file, int line, const char *func)
 		}
 	}	
 	printk("called from %s:%d (%s())\n", file, line, func);
-	rcu_flags = ExAcquireSpinLockExclusive(&rcu_rw_lock);
-	/* compiler barrier */
-	ExReleaseSpinLockExclusive(&rcu_rw_lock, rcu_flags);
-	printk("after locks from %s:%d (%s())\n", file, line, func);
+	rcu_wait_for_readers();
+	printk("after grace period from %s:%d (%s())\n", file, line, func);
 }
 
 void call_rcu_debug(struct rcu_head *head, rcu_callback_t callback_func, const char *file, int line, const char *func)
 {
-	KIRQL rcu_flags = PASSIVE_LEVEL;
-	int can_lock = 1;
-	struct task_struct *c = current;
-
-	if (is_windrbd_thread(c)) {
-		if (c->in_rcu) {
-			printk("Warning: RCU call_rcu called (from %s:%d %s()) while thread is holding rcu_readlock (called from %s:%d %s())\n", file, line, func, c->rcu_file, c->rcu_line, c->rcu_func);
-			can_lock = 0;
-		}
-	}
 	printk("called from %s:%d (%s())\n", file, line, func);
-	if (can_lock)
-		rcu_flags = ExAcquireSpinLockExclusive(&rcu_rw_lock);
-
-	callback_func(head);
 
-	if (can_lock)
-		ExReleaseSpinLockExclusive(&rcu_rw_lock, rcu_flags);
-
-	printk("after locks from %s:%d (%s())\n", file, line, func);
+		/* Fine to call this inside a read side critical
+		 * section now: callback runs later in the rcu_gp
+		 * thread.
+		 */
+	rcu_queue_callback(head, callback_func);
 }
 
 #else
@@ -764,7 +1243,7 @@ KIRQL rcu_read_lock(void)
 		c->in_rcu = 1;
 	}
 
-	flags = ExAcquireSpinLockShared(&rcu_rw_lock);
+	flags = rcu_enter();
 	return flags;
 }
 
@@ -778,7 +1257,7 @@ void rcu_read_unlock(KIRQL rcu_flags)
 			return;
 	}
 
-	ExReleaseSpinLockShared(&rcu_rw_lock, rcu_flags);
+	rcu_exit(rcu_flags);
 
 	if (is_windrbd_thread(current))
 		current->in_rcu = 0;
@@ -786,33 +1265,20 @@ void rcu_read_unlock(KIRQL rcu_flags)
 
 void synchronize_rcu(void)
 {
-	KIRQL rcu_flags;
-
 	if (is_windrbd_thread(current)) {
 		if (current->in_rcu)
 			return;	/* avoid deadlock */
 	}	
-	rcu_flags = ExAcquireSpinLockExclusive(&rcu_rw_lock);
-	/* compiler barrier */
-	ExReleaseSpinLockExclusive(&rcu_rw_lock, rcu_flags);
+	rcu_wait_for_readers();
 }
 
+	/* Callback runs in the rcu_gp thread after the next grace
+	 * period (it used to run synchronously in here).
+	 */
+
 void call_rcu(struct rcu_head *head, rcu_callback_t func)
 {
-	KIRQL rcu_flags = PASSIVE_LEVEL;
-	int can_lock = 1;
-
-	if (is_windrbd_thread(current)) {
-		if (current->in_rcu)
-			can_lock = 0;
-	}
-	if (can_lock)
-		rcu_flags = ExAcquireSpinLockExclusive(&rcu_rw_lock);
-
-	func(head);
-
-	if (can_lock)
-		ExReleaseSpinLockExclusive(&rcu_rw_lock, rcu_flags);
+	rcu_queue_callback(head, func);
 }
 
 #endif	/* RCU_DEBUG */
@@ -848,6 +1314,5 @@ int spin_trylock(spinlock_t *lock)
 
 void init_locking(void)
 {
-        rcu_rw_lock = 0;
 	spin_lock_init(&irq_lock);
 }
@@ -35,15 +35,145 @@ static struct task_struct *__find_thread(PKTHREAD id)
 	return NULL;
 }
 
+	/* current is looked up in an open addressing (linear probing)
+	 * hash table keyed by PKTHREAD, without taking a lock. This
+	 * works because the slot holding thread K is only written
+	 * by thread K itself (make_me_a_windrbd_thread(),
+	 * return_to_windows()) or while thread K does not run
+	 * (kthread_create() before the thread is started,
+	 * windrbd_reap_threads() after it exited). Writers hold
+	 * thread_list_lock.
+	 *
+	 * Deleted slots become tombstones (so probe sequences of
+	 * other threads are not broken) and are reused by later
+	 * inserts. Tombstones followed by an empty slot are emptied
+	 * again. Threads that do not fit into the table are only
+	 * on the thread_list and looked up there (with the lock).
+	 */
 
-	/* NO printk's here, used internally by printk (via current). */
-struct task_struct* windrbd_find_thread(PKTHREAD id)
+#define THREAD_HASH_BITS 10
+#define THREAD_HASH_SIZE (1 << THREAD_HASH_BITS)
+#define THREAD_HASH_MASK (THREAD_HASH_SIZE-1)
+#define THREAD_HASH_TOMBSTONE ((PKTHREAD) 1)
+
+struct thread_hash_slot {
+	PKTHREAD volatile key;
+	struct task_struct *task;
+};
+
+static struct thread_hash_slot thread_hash[THREAD_HASH_SIZE];
+
+	/* Number of threads not in thread_hash (table was full) */
+static int thread_hash_overflows;
+
+static unsigned int thread_hash_fn(PKTHREAD id)
+{
+	return (unsigned int) (((ULONGLONG) (ULONG_PTR) id * 0x9E3779B97F4A7C15ULL) >> (64 - THREAD_HASH_BITS));
+}
+
+	/* Call this with thread_list_lock held. */
+
+static void thread_hash_add(struct task_struct *t)
+{
+	unsigned int i, n;
+	PKTHREAD key;
+
+	i = thread_hash_fn(t->windows_thread);
+	for (n=0;n<THREAD_HASH_SIZE;n++,i=(i+1) & THREAD_HASH_MASK) {
+		key = thread_hash[i].key;
+		if (key == NULL || key == THREAD_HASH_TOMBSTONE) {
+			thread_hash[i].task = t;
+				/* Publish task before key */
+			InterlockedExchangePointer((PVOID*) &thread_hash[i].key, t->windows_thread);
+			t->in_thread_hash = 1;
+			return;
+		}
+	}
+	thread_hash_overflows++;
+}
+
+	/* Call this with thread_list_lock held. */
+
+static void thread_hash_del(struct task_struct *t)
+{
+	unsigned int i, n;
+
+	if (!t->in_thread_hash) {
+		thread_hash_overflows--;
+		return;
+	}
+	i = thread_hash_fn(t->windows_thread);
+	for (n=0;n<THREAD_HASH_SIZE;n++,i=(i+1) & THREAD_HASH_MASK) {
+		if (thread_hash[i].key == t->windows_thread && thread_hash[i].task == t)
+			break;
+	}
+	if (n == THREAD_HASH_SIZE)	/* should not happen */
+		return;
+
+	thread_hash[i].key = THREAD_HASH_TOMBSTONE;
+	t->in_thread_hash = 0;
+
+		/* No probe sequence continues after an empty slot, so
+		 * tombstones directly before an empty slot are not
+		 * needed any more.
+		 */
+	for (n=0;n<THREAD_HASH_SIZE;n++,i=(i-1) & THREAD_HASH_MASK) {
+		if (thread_hash[i].key != THREAD_HASH_TOMBSTONE ||
+		    thread_hash[(i+1) & THREAD_HASH_MASK].key != NULL)
+			break;
+		thread_hash[i].key = NULL;
+	}
+}
+
+static void add_thread(struct task_struct *t)
+{
+	KIRQL flags;
+
+	spin_lock_irqsave(&thread_list_lock, flags);
+	list_add(&t->list, &thread_list);
+	thread_hash_add(t);
+	spin_unlock_irqrestore(&thread_list_lock, flags);
+}
+
+	/* The old way of looking up current: takes thread_list_lock
+	 * and walks the thread_list. Used as fallback when the
+	 * hash table is full and for comparison by the
+	 * current_benchmark run-test.
+	 */
+
+struct task_struct *windrbd_find_thread_in_list(PKTHREAD id)
 {
 	struct task_struct *t;
 	KIRQL flags;
 
 	spin_lock_irqsave(&thread_list_lock, flags);
 	t = __find_thread(id);
+	spin_unlock_irqrestore(&thread_list_lock, flags);
+
+	return t;
+}
+
+	/* NO printk's here, used internally by printk (via current). */
+struct task_struct* windrbd_find_thread(PKTHREAD id)
+{
+	struct task_struct *t;
+	unsigned int i, n;
+	PKTHREAD key;
+
+	t = NULL;
+	i = thread_hash_fn(id);
+	for (n=0;n<THREAD_HASH_SIZE;n++,i=(i+1) & THREAD_HASH_MASK) {
+		key = thread_hash[i].key;
+		if (key == id) {
+			t = thread_hash[i].task;
+			break;
+		}
+		if (key == NULL)
+			break;
+	}
+	if (t == NULL && thread_hash_overflows > 0)
+		t = windrbd_find_thread_in_list(id);
+
 	if (!t) {	/* TODO: ... */
 		static struct task_struct g_dummy_current;
 		t = &g_dummy_current;
@@ -52,9 +182,34 @@ struct task_struct* windrbd_find_thread(PKTHREAD id)
 		t->is_root = 0;
 		strcpy(t->comm, "not_drbd_thread");
 	}
+	return t;
+}
+
+void windrbd_print_thread_hash_stats(void)
+{
+	unsigned int i, n, home, used, tombstones, max_probe;
+	PKTHREAD key;
+	KIRQL flags;
+
+	used = tombstones = max_probe = 0;
+
+	spin_lock_irqsave(&thread_list_lock, flags);
+	for (i=0;i<THREAD_HASH_SIZE;i++) {
+		key = thread_hash[i].key;
+		if (key == THREAD_HASH_TOMBSTONE)
+			tombstones++;
+		else if (key != NULL) {
+			used++;
+			home = thread_hash_fn(key);
+			n = ((i - home) & THREAD_HASH_MASK) + 1;
+			if (n > max_probe)
+				max_probe = n;
+		}
+	}
+	n = thread_hash_overflows;
 	spin_unlock_irqrestore(&thread_list_lock, flags);
 
-	return t;
+	printk("thread hash: %u of %u slots used, %u tombstones, longest probe %u slots, %u threads not in hash\n", used, THREAD_HASH_SIZE, tombstones, max_probe, n);
 }
 
 void print_threads_in_rcu(void)
@@ -156,6 +311,7 @@ void windrbd_reap_threads(void)
 	list_for_each_entry_safe(struct task_struct, t, tn, &thread_list, list) {
 		if (t->is_zombie) {
 // printk("about to bury %p\n", t);
+			thread_hash_del(t);
 			list_del(&t->list);
 			list_add(&t->list, &dead_list);
 		}
@@ -340,10 +496,7 @@ struct task_struct *kthread_create(int (*threadfn)(void *), void *data, const ch
 		kfree(t);
 		return ERR_PTR(-ENOMEM);	/* or whatever */
 	}
-
-	spin_lock_irqsave(&thread_list_lock, flags);
-	list_add(&t->list, &thread_list);
-	spin_unlock_irqrestore(&thread_list_lock, flags);
+	add_thread(t);
 
 	return t;
 }
@@ -401,10 +554,7 @@ struct task_struct *make_me_a_windrbd_thread(const char *name, ...)
 	spin_unlock_irqrestore(&next_pid_lock, flags);
 
 	KeSetKernelStackSwapEnable(FALSE);
-
-	spin_lock_irqsave(&thread_list_lock, flags);
-	list_add(&t->list, &thread_list);
-	spin_unlock_irqrestore(&thread_list_lock, flags);
+	add_thread(t);
 
 	return t;
 }
@@ -421,6 +571,7 @@ void return_to_windows(struct task_struct *t)
 	KeSetKernelStackSwapEnable(TRUE);
 
 	spin_lock_irqsave(&thread_list_lock, flags);
+	thread_hash_del(t);
 	list_del(&t->list);
 	spin_unlock_irqrestore(&thread_list_lock, flags);
 	kfree(t);
@@ -0,0 +1,487 @@
+/*
+	Copyright(C) 2017-2018, Johannes Thoma <johannes@johannesthoma.com>
+	Copyright(C) 2017-2018, LINBIT HA-Solutions GmbH  <office@linbit.com>
+
+	Windows DRBD is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2, or (at your option)
+	any later version.
+
+	Windows DRBD is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Windows DRBD; see the file COPYING. If not, write to
+	the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/* Linux timer_list implemented as a hierarchical timer wheel (this
+ * used to be one KTIMER and one KDPC per timer in drbd_windows.c).
+ *
+ * There is one wheel (timer_base) per CPU, driven by a one shot
+ * KTIMER whose DPC runs on that CPU. Like NO_HZ on Linux, the KTIMER
+ * is set to the first non-empty bucket, not to every tick, so idle
+ * wheels (and wheels whose timers are far away) do not wake the
+ * CPU. A timer stays on the wheel of the CPU it was first armed on.
+ *
+ * Each wheel has TIMER_WHEEL_LEVELS levels of 64 buckets. Level n
+ * has a granularity of 8^n jiffies, so adding, modifying and
+ * deleting a timer is O(1) (a list operation under the wheel's
+ * lock). Like on Linux there is no cascading: timers on higher
+ * levels fire when their bucket is due, that is up to 1/8 of the
+ * timeout late (never early). Timers further away than the last
+ * level (about 37 hours) fire after 37 hours.
+ *
+ * Precision is also limited by the system clock tick (usually
+ * 15.6 ms) since the KTIMER cannot fire more often than that, same
+ * as before with one KTIMER per timer.
+ */
+
+#include "drbd_windows.h"
+
+#define TIMER_WHEEL_CLK_SHIFT	3
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS	8
+
+#define LVL_SHIFT(n)	((n) * TIMER_WHEEL_CLK_SHIFT)
+#define LVL_GRAN(n)	(1ULL << LVL_SHIFT(n))
+
+	/* Milliseconds per jiffy */
+#define TIMER_WHEEL_TICK 1
+
+struct timer_base {
+	spinlock_t lock;
+	ULONG_PTR clk;		/* next jiffy to process */
+	ULONG_PTR next_expiry;	/* no bucket is due before that */
+	int num_timers;
+	bool armed;		/* ktimer is set (to next_expiry) */
+	struct timer_list *volatile running_timer;
+	KTIMER ktimer;
+	KDPC dpc;
+		/* Bit k of level n set: bucket k might be non-empty.
+		 * Cleared when a lookup finds the bucket empty.
+		 */
+	u64 pending_map[TIMER_WHEEL_LEVELS];
+	struct list_head buckets[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SIZE];
+		/* Statistics, protected by lock. Per base so that
+		 * counting does not bounce a shared cache line
+		 * between CPUs. Summed by windrbd_timer_stats().
+		 */
+	LONGLONG ticks;
+	LONGLONG fired;
+	LONGLONG mods;
+};
+
+static struct timer_base *timer_bases;
+static ULONG num_timer_bases;
+
+	/* Returns the bucket for expires and in *due the jiffy it
+	 * is processed. Bucket k of level n is processed when clk
+	 * reaches k << LVL_SHIFT(n), so we use the lowest level
+	 * where that is less than 64 buckets away.
+	 */
+
+static int calc_wheel_index(ULONG_PTR expires, ULONG_PTR clk, ULONG_PTR *due)
+{
+	ULONG_PTR k, c;
+	int lvl;
+
+	for (lvl=0;lvl<TIMER_WHEEL_LEVELS;lvl++) {
+		c = (clk + LVL_GRAN(lvl) - 1) >> LVL_SHIFT(lvl);
+		k = (expires + LVL_GRAN(lvl) - 1) >> LVL_SHIFT(lvl);
+		if (time_before(k, c))
+			k = c;	/* already expired */
+
+		if (k - c < TIMER_WHEEL_SIZE) {
+			*due = k << LVL_SHIFT(lvl);
+			return lvl * TIMER_WHEEL_SIZE + (k & TIMER_WHEEL_MASK);
+		}
+	}
+	lvl = TIMER_WHEEL_LEVELS-1;
+	c = (clk + LVL_GRAN(lvl) - 1) >> LVL_SHIFT(lvl);
+	k = c + TIMER_WHEEL_SIZE-1;
+	*due = k << LVL_SHIFT(lvl);
+
+	return lvl * TIMER_WHEEL_SIZE + (k & TIMER_WHEEL_MASK);
+}
+
+	/* Returns the jiffy the first non-empty bucket is due.
+	 * Buckets of level n hold k from c to c+63 (c is clk at
+	 * that level's granularity), so we search from c on.
+	 * Caller holds the lock and has num_timers > 0.
+	 */
+
+static ULONG_PTR next_bucket_due(struct timer_base *base)
+{
+	ULONG_PTR c, k, due = 0;
+	bool found = false;
+	u64 map;
+	int lvl, start, i;
+
+	for (lvl=0;lvl<TIMER_WHEEL_LEVELS;lvl++) {
+		c = (base->clk + LVL_GRAN(lvl) - 1) >> LVL_SHIFT(lvl);
+		start = (int) (c & TIMER_WHEEL_MASK);
+		while ((map = base->pending_map[lvl]) != 0) {
+				/* rotate so that bit 0 is bucket c */
+			if (start != 0)
+				map = (map >> start) | (map << (TIMER_WHEEL_SIZE - start));
+			i = __ffs64(map);
+			if (list_empty(&base->buckets[lvl * TIMER_WHEEL_SIZE + ((start + i) & TIMER_WHEEL_MASK)])) {
+				base->pending_map[lvl] &= ~(1ULL << ((start + i) & TIMER_WHEEL_MASK));
+				continue;
+			}
+			k = c + i;
+			if (!found || time_before(k << LVL_SHIFT(lvl), due))
+				due = k << LVL_SHIFT(lvl);
+			found = true;
+			break;
+		}
+	}
+		/* Should not happen, try again next jiffy */
+	if (!found)
+		due = base->clk;
+
+	return due;
+}
+
+	/* Caller holds the lock. */
+
+static void arm_wheel_timer(struct timer_base *base, ULONG_PTR due)
+{
+	LARGE_INTEGER delay;
+	ULONG_PTR now = jiffies;
+
+	base->next_expiry = due;
+	base->armed = true;
+	delay.QuadPart = RELATIVE(MILLISECONDS(time_after(due, now) ? (due - now) * TIMER_WHEEL_TICK : 0));
+	KeSetTimer(&base->ktimer, delay, &base->dpc);
+}
+
+static void detach_timer(struct timer_base *base, struct timer_list *timer)
+{
+	list_del_init(&timer->entry);
+	base->num_timers--;
+}
+
+static void timer_wheel_tick(PKDPC dpc, struct timer_base *base, PVOID arg1, PVOID arg2)
+{
+	struct list_head expired;
+	struct timer_list *timer;
+	ULONG_PTR clk, now;
+	KIRQL flags;
+	int lvl;
+
+	INIT_LIST_HEAD(&expired);
+	now = jiffies;
+
+	spin_lock_irqsave(&base->lock, flags);
+	base->ticks++;
+	base->armed = false;
+	while (base->num_timers > 0) {
+			/* Skip the jiffies with empty buckets */
+		clk = next_bucket_due(base);
+		if (time_after(clk, now))
+			break;
+		base->clk = clk;
+		for (lvl=0;lvl<TIMER_WHEEL_LEVELS;lvl++) {
+			list_splice_tail_init(&base->buckets[lvl * TIMER_WHEEL_SIZE + ((clk >> LVL_SHIFT(lvl)) & TIMER_WHEEL_MASK)], &expired);
+				/* Next level only every 8th time */
+			if (clk & (LVL_GRAN(lvl+1) - 1))
+				break;
+		}
+		base->clk++;
+
+		while (!list_empty(&expired)) {
+			timer = list_first_entry(&expired, struct timer_list, entry);
+			detach_timer(base, timer);
+			base->running_timer = timer;
+			base->fired++;
+			spin_unlock_irqrestore(&base->lock, flags);
+
+			timer->function(timer);
+
+			spin_lock_irqsave(&base->lock, flags);
+			base->running_timer = NULL;
+		}
+	}
+		/* Timer functions might have armed the ktimer, but
+		 * not necessarily for the first bucket.
+		 */
+	if (base->num_timers > 0)
+		arm_wheel_timer(base, next_bucket_due(base));
+	else if (base->armed) {
+		KeCancelTimer(&base->ktimer);
+		base->armed = false;
+	}
+	spin_unlock_irqrestore(&base->lock, flags);
+}
+
+static struct timer_base *get_timer_base(struct timer_list *timer)
+{
+	struct timer_base *base = timer->base;
+	ULONG cpu;
+
+	if (base != NULL)
+		return base;
+
+		/* init_timers() failed */
+	if (timer_bases == NULL)
+		return NULL;
+
+	cpu = KeGetCurrentProcessorNumberEx(NULL) % num_timer_bases;
+	base = InterlockedCompareExchangePointer((PVOID*)&timer->base, &timer_bases[cpu], NULL);
+
+	return base != NULL ? base : &timer_bases[cpu];
+}
+
+void timer_setup(struct timer_list *timer, void(*callback)(struct timer_list *timer), ULONG_PTR flags_unused)
+{
+	INIT_LIST_HEAD(&timer->entry);
+	timer->function = callback;
+	timer->expires = 0;
+	timer->base = NULL;
+}
+
+void add_timer(struct timer_list *t)
+{
+	mod_timer(t, t->expires);
+}
+
+	/* Returns 1 if the timer was pending. */
+
+static int detach_if_pending(struct timer_list *t)
+{
+	struct timer_base *base = t->base;
+	KIRQL flags;
+	int pending;
+
+	if (base == NULL)
+		return 0;
+
+	spin_lock_irqsave(&base->lock, flags);
+	pending = !list_empty(&t->entry);
+	if (pending)
+		detach_timer(base, t);
+	spin_unlock_irqrestore(&base->lock, flags);
+
+	return pending;
+}
+
+void del_timer(struct timer_list *t)
+{
+	detach_if_pending(t);
+	t->expires = 0;
+}
+
+/**
+ * timer_pending - is a timer pending?
+ * @timer: the timer in question
+ *
+ * timer_pending will tell whether a given timer is currently pending,
+ * or not. Callers must ensure serialization wrt. other operations done
+ * to this timer, eg. interrupt contexts, or other CPUs on SMP.
+ *
+ * return value: 1 if the timer is pending, 0 if not.
+ */
+int timer_pending(const struct timer_list * timer)
+{
+		/* Zeroed, timer_setup() not called yet */
+	if (timer->entry.next == NULL)
+		return 0;
+
+	return !list_empty(&timer->entry);
+}
+
+	/* Deactivates the timer and waits until its function has
+	 * finished if it is running on another CPU. Must not be
+	 * called with locks held the timer function takes. If the
+	 * timer function itself calls this for its own timer we
+	 * do not wait (that would never return).
+	 */
+
+int del_timer_sync(struct timer_list *t)
+{
+	struct timer_base *base = t->base;
+	int pending;
+
+	pending = detach_if_pending(t);
+	t->expires = 0;
+
+	if (base == NULL)
+		return pending;
+
+	while (base->running_timer == t) {
+		if (KeGetCurrentIrql() >= DISPATCH_LEVEL &&
+		    base == &timer_bases[KeGetCurrentProcessorNumberEx(NULL) % num_timer_bases])
+			break;
+
+		YieldProcessor();
+	}
+		/* Function might have rearmed the timer */
+	if (detach_if_pending(t))
+		pending = 1;
+
+	return pending;
+}
+
+static int __mod_timer(struct timer_list *timer, ULONG_PTR expires, bool pending_only)
+{
+	struct timer_base *base;
+	ULONG_PTR due, now;
+	KIRQL flags;
+	int pending, idx;
+
+	base = get_timer_base(timer);
+	if (base == NULL)
+		return 0;
+
+	spin_lock_irqsave(&base->lock, flags);
+	base->mods++;
+	pending = !list_empty(&timer->entry);
+	if (!pending && pending_only) {
+		spin_unlock_irqrestore(&base->lock, flags);
+		return 0;
+	}
+	now = jiffies;
+	if (pending)
+		list_del(&timer->entry);
+	else {
+		if (base->num_timers == 0 && base->running_timer == NULL)
+			base->clk = now;
+		base->num_timers++;
+	}
+		/* clk is not advanced while the wheel sleeps. Move it
+		 * forward (but not past a due bucket), else far away
+		 * timers go to coarser levels than needed. Not while
+		 * timer_wheel_tick() runs timers: next_expiry is not
+		 * the first bucket then.
+		 */
+	if (base->num_timers > 1 && base->running_timer == NULL &&
+	    time_after(now, base->clk) && time_after(base->next_expiry, base->clk))
+		base->clk = time_before(now, base->next_expiry) ? now : base->next_expiry;
+
+	timer->expires = expires;
+	idx = calc_wheel_index(expires, base->clk, &due);
+	list_add_tail(&timer->entry, &base->buckets[idx]);
+	base->pending_map[idx / TIMER_WHEEL_SIZE] |= 1ULL << (idx & TIMER_WHEEL_MASK);
+
+	if (!base->armed || base->num_timers == 1 || time_before(due, base->next_expiry))
+		arm_wheel_timer(base, due);
+
+	spin_unlock_irqrestore(&base->lock, flags);
+
+	return pending;
+}
+
+/**
+ * mod_timer_pending - modify a pending timer's timeout
+ * @timer: the pending timer to be modified
+ * @expires: new timeout in jiffies
+ *
+ * mod_timer_pending() is the same for pending timers as mod_timer(),
+ * but will not re-activate and modify already deleted timers.
+ *
+ * It is useful for unserialized use of timers.
+ */
+int mod_timer_pending(struct timer_list *timer, ULONG_PTR expires)
+{
+	return __mod_timer(timer, expires, true);
+}
+
+int mod_timer(struct timer_list *timer, ULONG_PTR expires)
+{
+	return __mod_timer(timer, expires, false);
+}
+
+void init_timers(void)
+{
+	PROCESSOR_NUMBER proc;
+	struct timer_base *base;
+	ULONG cpu;
+	int i;
+
+	num_timer_bases = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	timer_bases = ExAllocatePoolWithTag(NonPagedPool, num_timer_bases * sizeof(*timer_bases), 'TWDW');
+	if (timer_bases == NULL) {
+		printk("Cannot allocate timer wheels, timers will not work.\n");
+		num_timer_bases = 0;
+		return;
+	}
+	for (cpu=0;cpu<num_timer_bases;cpu++) {
+		base = &timer_bases[cpu];
+
+		spin_lock_init(&base->lock);
+		base->clk = jiffies;
+		base->next_expiry = base->clk;
+		base->num_timers = 0;
+		base->armed = false;
+		base->running_timer = NULL;
+		base->ticks = 0;
+		base->fired = 0;
+		base->mods = 0;
+		for (i=0;i<TIMER_WHEEL_LEVELS;i++)
+			base->pending_map[i] = 0;
+		for (i=0;i<ARRAY_SIZE(base->buckets);i++)
+			INIT_LIST_HEAD(&base->buckets[i]);
+
+		KeInitializeTimer(&base->ktimer);
+		KeInitializeDpc(&base->dpc, (PKDEFERRED_ROUTINE)timer_wheel_tick, base);
+		if (NT_SUCCESS(KeGetProcessorNumberFromIndex(cpu, &proc)))
+			KeSetTargetProcessorDpcEx(&base->dpc, &proc);
+	}
+}
+
+	/* Sums the statistics of all timer wheels (for windrbd
+	 * run-test timer_stats). If reset is true, they are
+	 * cleared afterwards.
+	 */
+
+void windrbd_timer_stats(LONGLONG *ticks, LONGLONG *fired, LONGLONG *mods, bool reset)
+{
+	struct timer_base *base;
+	KIRQL flags;
+	ULONG cpu;
+
+	*ticks = 0;
+	*fired = 0;
+	*mods = 0;
+
+	if (timer_bases == NULL)
+		return;
+
+	for (cpu=0;cpu<num_timer_bases;cpu++) {
+		base = &timer_bases[cpu];
+
+		spin_lock_irqsave(&base->lock, flags);
+		*ticks += base->ticks;
+		*fired += base->fired;
+		*mods += base->mods;
+		if (reset) {
+			base->ticks = 0;
+			base->fired = 0;
+			base->mods = 0;
+		}
+		spin_unlock_irqrestore(&base->lock, flags);
+	}
+}
+
+	/* Call this only when driver should be unloaded. */
+
+void shutdown_timers(void)
+{
+	ULONG cpu;
+
+	if (timer_bases == NULL)
+		return;
+
+	for (cpu=0;cpu<num_timer_bases;cpu++)
+		KeCancelTimer(&timer_bases[cpu].ktimer);
+
+	KeFlushQueuedDpcs();
+	ExFreePool(timer_bases);
+	timer_bases = NULL;
+}
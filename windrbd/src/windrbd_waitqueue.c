@@ -21,6 +21,15 @@
 
 int raised_irql_waits;
 
+	/* Number of wake_up*() calls, number of tasks woken by
+	 * them and number of times a woken waiter found its
+	 * condition still false (see ll_wait_event_macro()).
+	 */
+
+atomic_t64 windrbd_wake_up_calls;
+atomic_t64 windrbd_wake_up_tasks;
+atomic_t64 windrbd_spurious_wakeups;
+
 static int ll_wait(struct wait_queue_entry *e, LONG_PTR timeout, int interruptible, const char *file, int line, const char *func)
 {
 	LARGE_INTEGER wait_time;
@@ -139,6 +148,31 @@ LONG_PTR schedule_timeout_uninterruptible_debug(LONG_PTR timeout, const char *fi
 	return ll_schedule_debug(timeout, 0, TASK_UNINTERRUPTIBLE, file, line, func);
 }
 
+	/* Wakes all non-exclusive waiters and up to nr_exclusive
+	 * exclusive waiters (all if nr_exclusive is 0). Woken
+	 * entries are removed from the queue (prepare_to_wait()
+	 * adds them again), so the next wake up goes to the next
+	 * exclusive waiter. Called with q->lock held, which also
+	 * keeps the entries (on the waiters' stacks) valid.
+	 */
+
+static void __wake_up_common(wait_queue_head_t *q, int nr_exclusive)
+{
+	struct wait_queue_entry *e, *e2;
+	int exclusive;
+
+	list_for_each_entry_safe(struct wait_queue_entry, e, e2, &q->head, entry) {
+		exclusive = e->flags & WQ_FLAG_EXCLUSIVE;
+
+		list_del_init(&e->entry);
+		KeSetEvent(&e->windows_event, 0, FALSE);
+		atomic_inc64(&windrbd_wake_up_tasks);
+
+		if (exclusive && --nr_exclusive == 0)
+			break;
+	}
+}
+
 	/* TODO: no locks? Assumes that current is always (1) valid and
 	 * (2) unique.
 	 */
@@ -156,12 +190,24 @@ void prepare_to_wait_debug(struct wait_queue_head *w, struct wait_queue_entry *e
 // printk("1 w is %p entry is %p called from %s:%d(%s)\n", w, e, file, line, func);
 	if (list_empty(&e->entry)) {
 // printk("2\n");
-		list_add(&e->entry, &w->head);
+			/* Exclusive waiters go to the tail, so
+			 * non-exclusive ones are woken first.
+			 */
+		if (e->flags & WQ_FLAG_EXCLUSIVE)
+			list_add_tail(&e->entry, &w->head);
+		else
+			list_add(&e->entry, &w->head);
 	}
 // printk("3\n");
 	spin_unlock_irqrestore(&w->lock, flags);
 }
 
+void prepare_to_wait_exclusive_debug(struct wait_queue_head *w, struct wait_queue_entry *e, int interruptible, const char *file, int line, const char *func)
+{
+	e->flags |= WQ_FLAG_EXCLUSIVE;
+	prepare_to_wait_debug(w, e, interruptible, file, line, func);
+}
+
 void finish_wait_debug(struct wait_queue_head *w, struct wait_queue_entry *e, const char *file, int line, const char *func)
 {
 	KIRQL flags, flags2;
@@ -177,48 +223,47 @@ void finish_wait_debug(struct wait_queue_head *w, struct wait_queue_entry *e, co
 // printk("2\n");
 		list_del(&e->entry);
 		INIT_LIST_HEAD(&e->entry);
+	} else if (e->flags & WQ_FLAG_EXCLUSIVE) {
+			/* We were woken but leave without having
+			 * waited for it (condition became true before,
+			 * timeout or signal). Pass the wakeup on, else
+			 * it is lost for the other exclusive waiters.
+			 */
+		__wake_up_common(w, 1);
 	}
 // printk("3\n");
 	spin_unlock_irqrestore(&w->lock, flags);
 }
 
-void wake_up_all_debug(wait_queue_head_t *q, const char *file, int line, const char *func)
+	/* Wakes up all non-exclusive tasks and nr exclusive tasks
+	 * (all tasks if nr is 0).
+	 */
+
+void wake_up_nr_debug(wait_queue_head_t *q, int nr, const char *file, int line, const char *func)
 {
 	KIRQL flags, flags2;
-	struct wait_queue_entry *e, *e2;
 
-	spin_lock_irqsave(&q->lock, flags);
-// printk("wake_up_all %p %s:%d (%s())\n", q, file, line, func);
-	if (list_empty(&q->head)) {
-// printk("Warning: attempt to wake up all with no one waiting (%s:%d %s()) queue is %p.\n", file, line, func, q);
-		goto unlock_and_out;
-	}
-		/* Use safe version: entries might get deleted soon by
-		 * woken up waiters.
-		 */
+	atomic_inc64(&windrbd_wake_up_calls);
 
-// printk("1\n");
-	list_for_each_entry_safe(struct wait_queue_entry, e, e2, &q->head, entry) {
-// printk("2 entry is at %p\n", e);
-		KeSetEvent(&e->windows_event, 0, FALSE);
-// printk("2a\n");
-	}
-// printk("3\n");
-
-unlock_and_out:
-// printk("4\n");
-// printk("5\n");
+	spin_lock_irqsave(&q->lock, flags);
+// printk("wake_up_nr %p %d %s:%d (%s())\n", q, nr, file, line, func);
+	if (!list_empty(&q->head))
+		__wake_up_common(q, nr);
 	spin_unlock_irqrestore(&q->lock, flags);
-// printk("6\n");
 }
 
-	/* This wakes up all non-exclusive tasks. Since we only have
-	 * non-exclusive tasks, this does the same as wake_up_all().
+void wake_up_all_debug(wait_queue_head_t *q, const char *file, int line, const char *func)
+{
+	wake_up_nr_debug(q, 0, file, line, func);
+}
+
+	/* This wakes up all non-exclusive tasks and one exclusive
+	 * task.
 	 */
 
 void wake_up_debug(wait_queue_head_t *q, const char *file, int line, const char *func)
 {
-	wake_up_all_debug(q, file, line, func);
+	wake_up_nr_debug(q, 1, file, line, func);
 }
 
 void init_waitqueue(void)
@@ -7,11 +7,13 @@
 #endif
 #endif
 
+#include <linux/slab.h>
 #include "drbd_windows.h"
 #include "windrbd_threads.h"
 #include <linux/socket.h>
 #include <linux/net.h>
 #include <linux/tcp.h>
+#include <linux/sched/signal.h>
 
 /* Protects from API functions being called before the WSK provider is
  * initialized (see SocketsInit).
@@ -102,7 +104,8 @@ static void sock_really_free(struct kref *kref)
 {
 	struct socket *socket = container_of(kref, struct socket, kref);
 
-	kfree(socket->receive_buffer);
+	rx_ring_free(&socket->rx_ring);
+	kfree(socket->rx_irps);
 	kfree(socket->sk);
 	kfree(socket);
 }
@@ -263,6 +266,88 @@ int may_printk
 	IoFreeMdl(WskBuffer->Mdl);
 }
 
+	/* Frees the MDLs of a WskBuffer built by InitWskBufferChain() */
+
+static VOID FreeWskBufferChain(
+__in PWSK_BUF WskBuffer,
+int may_printk
+)
+{
+	WSK_BUF b;
+	PMDL mdl, next;
+
+	for (mdl = WskBuffer->Mdl; mdl != NULL; mdl = next) {
+		next = mdl->Next;
+		b.Mdl = mdl;
+		FreeWskBuffer(&b, may_printk);
+	}
+	WskBuffer->Mdl = NULL;
+}
+
+	/* Like InitWskBuffer(), but for several buffers: their MDLs are
+	 * chained (via Mdl->Next), so that one WskSend or WskReceive
+	 * handles all of them. Empty kvecs are skipped.
+	 */
+
+static NTSTATUS InitWskBufferChain(
+	__in  struct kvec	*vec,
+	__in  size_t		num,
+	__out PWSK_BUF	WskBuffer,
+	__in  BOOLEAN	bWriteAccess
+)
+{
+	WSK_BUF b;
+	PMDL *next;
+	NTSTATUS status;
+	size_t i;
+
+	WskBuffer->Offset = 0;
+	WskBuffer->Length = 0;
+	WskBuffer->Mdl = NULL;
+	next = &WskBuffer->Mdl;
+
+	for (i=0;i<num;i++) {
+		if (vec[i].iov_len == 0)
+			continue;
+
+		status = InitWskBuffer(vec[i].iov_base, (ULONG) vec[i].iov_len, &b, bWriteAccess, TRUE);
+		if (!NT_SUCCESS(status)) {
+			FreeWskBufferChain(WskBuffer, 1);
+			return status;
+		}
+		*next = b.Mdl;
+		next = &b.Mdl->Next;
+		WskBuffer->Length += vec[i].iov_len;
+	}
+	return STATUS_SUCCESS;
+}
+
+	/* Returns the number of bytes in vec or 0 if there is a
+	 * non-empty kvec with a NULL buffer.
+	 */
+
+static size_t kvec_length(struct kvec *vec, size_t num)
+{
+	size_t i, len;
+
+	len = 0;
+	for (i=0;i<num;i++) {
+		if (vec[i].iov_len > 0 && vec[i].iov_base == NULL)
+			return 0;
+		len += vec[i].iov_len;
+	}
+	return len;
+}
+
+	/* Number of WskSend calls (all sockets) and number of packets
+	 * (sends without MSG_MORE) of kernel_sendmsg() and
+	 * wsk_sendpage(). Print with windrbd run-test send_stats
+	 */
+
+atomic_t64 windrbd_wsk_sends;
+atomic_t64 windrbd_sent_packets;
+atomic_t64 windrbd_sendmsg_kvecs;
+
 struct send_page_completion_info {
 	struct page *page;
 	char *data_buffer;
@@ -274,18 +359,19 @@ struct send_page_completion_info {
 	/* We track active completions to see if there is the completion
 	 * routine called twice on the same completion. This is most likely
 	 * due to a Windows bug which occurs after 2-3 days of running
-	 * an I/O test.
+	 * an I/O test. Used for SendPage completions and async sends
+	 * (struct async_send), hence the void pointer.
 	 */
 
 struct allocated_completions {
-	struct send_page_completion_info *completion;
+	void *completion;
 	struct list_head list;
 };
 
 static LIST_HEAD(completions);
 static spinlock_t completions_lock;
 
-static int remove_completion_locked(struct send_page_completion_info *c)
+static int remove_completion_locked(void *c)
 {
 	struct list_head *lh, *lhn;
 	struct allocated_completions *alloc_completion;
@@ -307,7 +393,7 @@ static int remove_completion_locked(struct send_page_completion_info *c)
 	return -EINVAL;
 }
 
-static int remove_completion(struct send_page_completion_info *c)
+static int remove_completion(void *c)
 {
 	int rv;
 	KIRQL flags;
@@ -319,7 +405,7 @@ static int remove_completion(struct send_page_completion_info *c)
 	return rv;
 }
 
-static int add_completion(struct send_page_completion_info *c)
+static int add_completion(void *c)
 {
 	int rv;
 	KIRQL flags;
@@ -922,6 +1008,264 @@ int kernel_sock_shutdown(struct socket *sock, enum sock_shutdown_cmd how)
 
 	/* TODO: implement MSG_MORE? */
 
+	/* Small kernel_sendmsg() buffers are copied into a send buffer
+	 * and sent asynchronously, like wsk_sendpage() does: the caller
+	 * does not wait for the WskSend to complete, errors are
+	 * reported by the next send and wait_for_sendbuf() limits the
+	 * bytes in flight to sk_sndbuf. Larger buffers are still sent
+	 * synchronously: the caller may reuse its buffer once we
+	 * return, so we would have to copy them.
+	 *
+	 * Send buffers come from a kmem_cache, freed ones are kept on
+	 * small per-CPU lists first (like bios, see windrbd_bioset.c)
+	 * so they need not be zeroed again.
+	 */
+
+#define ASYNC_SEND_BUFFER_SIZE 8192
+#define ASYNC_SEND_CPU_CACHE_DEPTH 32
+
+struct async_send {
+	SLIST_ENTRY free_list;	/* must be first */
+	struct socket *socket;
+	WSK_BUF wsk_buffer;
+	char data[ASYNC_SEND_BUFFER_SIZE];
+};
+
+	/* Registry value async_send_max_size, 0 makes all
+	 * kernel_sendmsg() calls synchronous.
+	 */
+
+int windrbd_async_send_max_size = ASYNC_SEND_BUFFER_SIZE;
+
+	/* Print them with windrbd run-test send_stats */
+
+atomic_t64 windrbd_async_sends;
+atomic_t64 windrbd_sync_sends;
+
+static struct kmem_cache *async_send_cache;
+static SLIST_HEADER *async_send_cpu_free;	/* one per CPU */
+static ULONG async_send_num_cpus;
+
+static void init_async_send_pool(void)
+{
+	ULONG cpu;
+
+	async_send_num_cpus = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+		/* Pool memory is 16 byte aligned as SLIST_HEADER
+		 * needs it.
+		 */
+	async_send_cpu_free = ExAllocatePoolWithTag(NonPagedPool, async_send_num_cpus * sizeof(*async_send_cpu_free), 'SADW');
+	if (async_send_cpu_free == NULL)
+		goto fail;
+
+	for (cpu=0;cpu<async_send_num_cpus;cpu++)
+		InitializeSListHead(&async_send_cpu_free[cpu]);
+
+	async_send_cache = kmem_cache_create("windrbd_send", sizeof(struct async_send), 0, 0, NULL, 'SADW');
+	if (async_send_cache == NULL) {
+		ExFreePool(async_send_cpu_free);
+		async_send_cpu_free = NULL;
+		goto fail;
+	}
+	return;
+
+fail:
+	printk("Warning: could not create send buffer pool, kernel_sendmsg() will be synchronous.\n");
+}
+
+	/* Call this only when all sockets are closed. */
+
+static void shutdown_async_send_pool(void)
+{
+	PSLIST_ENTRY e;
+	struct kmem_cache *cache = async_send_cache;
+	ULONG cpu;
+
+	if (cache == NULL)
+		return;
+
+	async_send_cache = NULL;
+	for (cpu=0;cpu<async_send_num_cpus;cpu++)
+		while ((e = InterlockedPopEntrySList(&async_send_cpu_free[cpu])) != NULL)
+			kmem_cache_free(cache, e);
+
+	kmem_cache_destroy(cache);
+	ExFreePool(async_send_cpu_free);
+	async_send_cpu_free = NULL;
+}
+
+static struct async_send *alloc_async_send(void)
+{
+	struct async_send *a = NULL;
+	ULONG cpu;
+
+	cpu = KeGetCurrentProcessorNumberEx(NULL);
+	if (cpu < async_send_num_cpus)
+		a = (struct async_send*) InterlockedPopEntrySList(&async_send_cpu_free[cpu]);
+
+	if (a == NULL)
+		a = kmem_cache_alloc(async_send_cache, GFP_NOIO);
+
+	return a;
+}
+
+	/* Called from the completion routine */
+
+static void free_async_send(struct async_send *a)
+{
+	ULONG cpu;
+
+	cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+		/* kmem_cache_alloc() might be a kmalloc with debug
+		 * header, which need not be aligned for SLIST_ENTRY.
+		 */
+	if (cpu < async_send_num_cpus &&
+	    ((ULONG_PTR) a & (MEMORY_ALLOCATION_ALIGNMENT-1)) == 0 &&
+	    ExQueryDepthSList(&async_send_cpu_free[cpu]) < ASYNC_SEND_CPU_CACHE_DEPTH) {
+		InterlockedPushEntrySList(&async_send_cpu_free[cpu], &a->free_list);
+		return;
+	}
+	kmem_cache_free(async_send_cache, a);
+}
+
+static NTSTATUS NTAPI async_send_completion(
+	__in PDEVICE_OBJECT	DeviceObject,
+	__in PIRP		Irp,
+	__in struct async_send	*a
+)
+{
+	struct socket *socket = a->socket;
+	int err;
+
+	/* Must not printk in here, will loop forever. Hence also no
+	 * ASSERT.
+	 */
+
+		/* Same Windows bug as with SendPage: ignore the second
+		 * completion of the same IRP, a is already freed (or
+		 * reused) then.
+		 */
+	if (remove_completion(a) != 0) {
+		duplicate_completions++;
+		return STATUS_MORE_PROCESSING_REQUIRED;
+	}
+
+	if (!NT_SUCCESS(Irp->IoStatus.Status)) {
+		err = winsock_to_linux_error(Irp->IoStatus.Status);
+		if (err != -EAGAIN && err != -EINTR)
+			socket->error_status = err;
+	}
+	have_sent(socket, a->wsk_buffer.Length);
+
+	IoFreeMdl(a->wsk_buffer.Mdl);
+	free_async_send(a);
+	IoFreeIrp(Irp);
+
+	kref_put_no_printk(&socket->kref, sock_really_free);
+
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+	/* Returns -ENOBUFS if there was no send buffer, caller should
+	 * send synchronously then.
+	 */
+
+static int kernel_sendmsg_async(struct socket *socket, struct msghdr *msg, struct kvec *vec, size_t num, size_t len)
+{
+	struct async_send *a;
+	struct _IRP *irp;
+	NTSTATUS status;
+	ULONG flags;
+	size_t i, pos;
+	int err;
+
+	if (socket->error_status != 0)
+		return socket->error_status;
+
+	err = wait_for_sendbuf(socket, len);
+	if (err < 0)
+		return err;
+
+	a = alloc_async_send();
+	if (a == NULL) {
+		err = -ENOBUFS;
+		goto out_have_sent;
+	}
+	for (i=0,pos=0;i<num;i++) {
+		memcpy(&a->data[pos], vec[i].iov_base, vec[i].iov_len);
+		pos += vec[i].iov_len;
+	}
+
+	a->wsk_buffer.Offset = 0;
+	a->wsk_buffer.Length = len;
+	a->wsk_buffer.Mdl = IoAllocateMdl(a->data, (ULONG) len, FALSE, FALSE, NULL);
+	if (a->wsk_buffer.Mdl == NULL) {
+		err = -ENOBUFS;
+		goto out_free_async_send;
+	}
+	MmBuildMdlForNonPagedPool(a->wsk_buffer.Mdl);
+
+	irp = IoAllocateIrp(1, FALSE);
+	if (irp == NULL) {
+		err = -ENOBUFS;
+		goto out_free_mdl;
+	}
+	if (add_completion(a) != 0) {
+		IoFreeIrp(irp);
+		err = -ENOBUFS;
+		goto out_free_mdl;
+	}
+	IoSetCompletionRoutine(irp, async_send_completion, a, TRUE, TRUE, TRUE);
+
+	flags = socket->no_delay ? WSK_FLAG_NODELAY : 0;
+	a->socket = socket;
+	kref_get(&socket->kref);
+
+	mutex_lock(&socket->wsk_mutex);
+
+	if (socket->wsk_socket == NULL) {
+		mutex_unlock(&socket->wsk_mutex);
+		kref_put(&socket->kref, sock_really_free);
+		remove_completion(a);
+		IoFreeIrp(irp);
+		err = -ENOTCONN;
+		goto out_free_mdl;
+	}
+	status = ((PWSK_PROVIDER_CONNECTION_DISPATCH) socket->wsk_socket->Dispatch)->WskSend(
+		socket->wsk_socket,
+		&a->wsk_buffer,
+		flags,
+		irp);
+
+	mutex_unlock(&socket->wsk_mutex);
+
+	atomic_inc64(&windrbd_async_sends);
+	atomic_inc64(&windrbd_wsk_sends);
+	atomic_add64(num, &windrbd_sendmsg_kvecs);
+	if (msg == NULL || !(msg->msg_flags & MSG_MORE))
+		atomic_inc64(&windrbd_sent_packets);
+
+		/* Resources are freed by completion routine. */
+	if (status == STATUS_PENDING || status == STATUS_SUCCESS)
+		return len;
+
+	err = winsock_to_linux_error(status);
+	if (err != 0 && err != -ENOMEM && err != -EAGAIN && err != -EINTR)
+		socket->error_status = err;
+	return err;
+
+out_free_mdl:
+	IoFreeMdl(a->wsk_buffer.Mdl);
+out_free_async_send:
+	free_async_send(a);
+out_have_sent:
+	have_sent(socket, len);
+
+	if (err != -ENOBUFS && err != -ENOTCONN)
+		socket->error_status = err;
+	return err;
+}
 
 int kernel_sendmsg(struct socket *socket, struct msghdr *msg, struct kvec *vec,
                    size_t num, size_t len)
@@ -932,23 +1276,30 @@ int kernel_sendmsg(struct socket *socket, struct msghdr *msg, struct kvec *vec,
 	LONG		BytesSent;
 	NTSTATUS	Status;
 	ULONG Flags = 0;
+	int err;
 
 // dbg("socket is %p\n", socket);
 
-	if (wsk_state != WSK_INITIALIZED || !socket || !socket->wsk_socket || !vec || vec[0].iov_base == NULL || ((int) vec[0].iov_len == 0))
+	if (wsk_state != WSK_INITIALIZED || !socket || !socket->wsk_socket || !vec || num == 0 || kvec_length(vec, num) == 0)
 		return -EINVAL;
 
-	if (num != 1)
-		return -EOPNOTSUPP;
+	len = kvec_length(vec, num);
+	if (len <= (size_t) windrbd_async_send_max_size && len <= ASYNC_SEND_BUFFER_SIZE && async_send_cache != NULL) {
+		err = kernel_sendmsg_async(socket, msg, vec, num, len);
+		if (err != -ENOBUFS)
+			return err;
+	}
+	atomic_inc64(&windrbd_sync_sends);
 
-	Status = InitWskBuffer(vec[0].iov_base, vec[0].iov_len, &WskBuffer, FALSE, TRUE);
+		/* Header and payload go out with one WskSend */
+	Status = InitWskBufferChain(vec, num, &WskBuffer, FALSE);
 	if (!NT_SUCCESS(Status)) {
 		return winsock_to_linux_error(Status);
 	}
 
 	Irp = wsk_new_irp(&CompletionEvent, NULL);
 	if (Irp == NULL) {
-		FreeWskBuffer(&WskBuffer, 1);
+		FreeWskBufferChain(&WskBuffer, 1);
 		return -ENOMEM;
 	}
 
@@ -961,8 +1312,9 @@ int kernel_sendmsg(struct socket *socket, struct msghdr *msg, struct kvec *vec,
 
 	if (socket->wsk_socket == NULL) {
 		mutex_unlock(&socket->wsk_mutex);
-		FreeWskBuffer(&WskBuffer, 1);
-		return winsock_to_linux_error(Status);
+		IoFreeIrp(Irp);
+		FreeWskBufferChain(&WskBuffer, 1);
+		return -ENOTCONN;
 	}
 
 	Status = ((PWSK_PROVIDER_CONNECTION_DISPATCH) socket->wsk_socket->Dispatch)->WskSend(
@@ -973,6 +1325,11 @@ int kernel_sendmsg(struct socket *socket, struct msghdr *msg, struct kvec *vec,
 
 	mutex_unlock(&socket->wsk_mutex);
 
+	atomic_inc64(&windrbd_wsk_sends);
+	atomic_add64(num, &windrbd_sendmsg_kvecs);
+	if (msg == NULL || !(msg->msg_flags & MSG_MORE))
+		atomic_inc64(&windrbd_sent_packets);
+
 	if (Status == STATUS_PENDING)
 	{
 		LARGE_INTEGER	nWaitTime;
@@ -1054,7 +1411,7 @@ int kernel_sendmsg(struct socket *socket, struct msghdr *msg, struct kvec *vec,
 
 
 	IoFreeIrp(Irp);
-	FreeWskBuffer(&WskBuffer, 1);
+	FreeWskBufferChain(&WskBuffer, 1);
 
 dbg("returning %d\n", BytesSent);
 	return BytesSent;
@@ -1139,6 +1496,10 @@ ssize_t wsk_sendpage(struct socket *socket, struct page *page, int offset, size_
 
 	mutex_unlock(&socket->wsk_mutex);
 
+	atomic_inc64(&windrbd_wsk_sends);
+	if (!(flags & MSG_MORE))
+		atomic_inc64(&windrbd_sent_packets);
+
 	switch (status) {
 	case STATUS_PENDING:
 			/* This now behaves just like Linux kernel socket
@@ -1297,26 +1658,23 @@ static int wsk_recvmsg(struct socket *socket, struct msghdr *msg, struct kvec *v
 
 // printk("in recvmsg: size is %d\n", len);
 // dbg("socket is %p\n", socket);
-	if (wsk_state != WSK_INITIALIZED || !socket || !socket->wsk_socket || !vec || vec[0].iov_base == NULL || ((int) vec[0].iov_len == 0))
+	if (wsk_state != WSK_INITIALIZED || !socket || !socket->wsk_socket || !vec || num == 0 || kvec_length(vec, num) == 0)
 		return -EINVAL;
 
-	if (num != 1)
-		return -EOPNOTSUPP;
-
 	if (socket->error_status != 0)
 {
 // printk("Socket in error state %d\n", socket->error_status);
 		return socket->error_status;
 }
 
-	Status = InitWskBuffer(vec[0].iov_base, vec[0].iov_len, &WskBuffer, TRUE, TRUE);
+	Status = InitWskBufferChain(vec, num, &WskBuffer, TRUE);
 	if (!NT_SUCCESS(Status)) {
 		return winsock_to_linux_error(Status);
 	}
 
 	Irp = wsk_new_irp(&CompletionEvent, NULL);
 	if (Irp == NULL) {
-		FreeWskBuffer(&WskBuffer, 1);
+		FreeWskBufferChain(&WskBuffer, 1);
 		return -ENOMEM;
 	}
 
@@ -1328,7 +1686,8 @@ static int wsk_recvmsg(struct socket *socket, struct msghdr *msg, struct kvec *v
 
 	if (socket->wsk_socket == NULL) {
 		mutex_unlock(&socket->wsk_mutex);
-		FreeWskBuffer(&WskBuffer, 1);
+		IoFreeIrp(Irp);
+		FreeWskBufferChain(&WskBuffer, 1);
 		return -ENOTCONN;
 	}
 
@@ -1448,7 +1807,7 @@ dbg("receive timeout is %lld (in 100ns units) %d in ms units\n", nWaitTime.QuadP
 	}
 
 	IoFreeIrp(Irp);
-	FreeWskBuffer(&WskBuffer, 1);
+	FreeWskBufferChain(&WskBuffer, 1);
 
 	if (BytesReceived < 0 && BytesReceived != -EINTR && BytesReceived != -EAGAIN) {
 		socket->error_status = BytesReceived;
@@ -1499,12 +1858,368 @@ void dump_packet(unsigned char *buf, size_t buflen)
 		printk("%s\n", s);
 }
 
+	/* Number of wake_up()s done by the receiver cache, print
+	 * with windrbd run-test rx_ring_benchmark
+	 */
+
+atomic_t64 windrbd_rx_ring_wakeups;
+
+	/* Allocates the ring buffer. size is rounded down to a power
+	 * of 2, num_segments rounded up to a power of 2 (but segments
+	 * are at least 4K).
+	 */
+
+int rx_ring_init(struct rx_ring *r, ULONG size, ULONG num_segments, struct wait_queue_head *data_available, struct wait_queue_head *buffer_available)
+{
+	ULONG pow2, n;
+
+	for (pow2 = 1; pow2 <= size / 2; pow2 *= 2)
+		;
+	for (n = 1; n < num_segments; n *= 2)
+		;
+	while (n > 1 && pow2 / n < 4096)
+		n /= 2;
+
+	r->buffer = kmalloc(pow2, GFP_KERNEL, 'XYZR');
+	r->segment_len = kzalloc(n * sizeof(*r->segment_len), GFP_KERNEL, 'XYZR');
+	r->segment_done = kzalloc(n * sizeof(*r->segment_done), GFP_KERNEL, 'XYZR');
+	if (r->buffer == NULL || r->segment_len == NULL || r->segment_done == NULL) {
+		rx_ring_free(r);
+		return -ENOMEM;
+	}
+
+	r->size = pow2;
+	r->num_segments = n;
+	r->segment_size = pow2 / n;
+	r->data_available = data_available;
+	r->buffer_available = buffer_available;
+	r->head = 0;
+	r->posted = 0;
+	r->tail = 0;
+	r->read_offset = 0;
+	r->consumer_waiting = 0;
+	r->producer_waiting = 0;
+
+	return 0;
+}
+
+void rx_ring_free(struct rx_ring *r)
+{
+	kfree(r->buffer);
+	kfree(r->segment_len);
+	kfree((void*) r->segment_done);
+	r->buffer = NULL;
+	r->segment_len = NULL;
+	r->segment_done = NULL;
+}
+
+	/* Consumer side, called when tail moved (a segment is free
+	 * again). The full barrier between publishing the new index
+	 * and looking at the other side's waiting flag pairs with the
+	 * one the other side does between setting the flag and
+	 * checking the index (in the wait_event condition) before it
+	 * sleeps.
+	 */
+
+static void rx_ring_wake_producer(struct rx_ring *r)
+{
+	MemoryBarrier();
+	if (r->producer_waiting) {
+		atomic_inc64(&windrbd_rx_ring_wakeups);
+		wake_up(r->buffer_available);
+	}
+}
+
+	/* Consumer side: returns the number of bytes that can be read
+	 * in one piece starting at *p. The head is read before the
+	 * data (volatile read has acquire semantics on x86 and x64).
+	 * Empty (cancelled) segments are skipped.
+	 */
+
+ULONG rx_ring_readable(struct rx_ring *r, char **p)
+{
+	ULONG seg;
+	int skipped = 0;
+
+	while (r->tail != r->head) {
+		seg = r->tail & (r->num_segments-1);
+		if (r->read_offset < r->segment_len[seg]) {
+			if (skipped)
+				rx_ring_wake_producer(r);
+
+			*p = &r->buffer[seg * r->segment_size + r->read_offset];
+			return r->segment_len[seg] - r->read_offset;
+		}
+		r->read_offset = 0;
+		r->tail++;
+		skipped = 1;
+	}
+	if (skipped)
+		rx_ring_wake_producer(r);
+
+	*p = r->buffer;
+	return 0;
+}
+
+void rx_ring_consumed(struct rx_ring *r, ULONG n)
+{
+	r->read_offset += n;
+	if (r->read_offset < r->segment_len[r->tail & (r->num_segments-1)])
+		return;
+
+	r->read_offset = 0;
+	r->tail++;
+
+	rx_ring_wake_producer(r);
+}
+
+	/* Number of bytes published but not yet consumed. Only exact
+	 * while the consumer is not running.
+	 */
+
+ULONG rx_ring_bytes(struct rx_ring *r)
+{
+	ULONG seg, bytes;
+
+	bytes = 0;
+	for (seg = r->tail; seg != r->head; seg++)
+		bytes += r->segment_len[seg & (r->num_segments-1)];
+
+	return bytes - r->read_offset;
+}
+
+	/* Producer side: returns the size of the next free segment
+	 * (and its address in *p) or 0 if there is none. Use
+	 * rx_ring_post() to take it.
+	 */
+
+ULONG rx_ring_writable(struct rx_ring *r, char **p)
+{
+	*p = &r->buffer[(r->posted & (r->num_segments-1)) * r->segment_size];
+	if (r->posted - r->tail >= r->num_segments)
+		return 0;
+
+	return r->segment_size;
+}
+
+	/* Returns the segment number to pass to rx_ring_completed() */
+
+ULONG rx_ring_post(struct rx_ring *r)
+{
+	ULONG seg = r->posted;
+
+	r->segment_done[seg & (r->num_segments-1)] = 0;
+	r->posted++;
+
+	return seg;
+}
+
+	/* May be called in any order for the posted segments and
+	 * from any context (IRP completion routines).
+	 */
+
+void rx_ring_completed(struct rx_ring *r, ULONG segment, ULONG n)
+{
+	segment &= r->num_segments-1;
+
+	r->segment_len[segment] = n;
+	InterlockedExchange(&r->segment_done[segment], 1);
+}
+
+	/* True if the oldest posted segment is completed. */
+
+int rx_ring_can_publish(struct rx_ring *r)
+{
+	return r->head != r->posted && r->segment_done[r->head & (r->num_segments-1)];
+}
+
+	/* Makes completed segments visible to the consumer, but only
+	 * up to the first one still outstanding. Returns the number of
+	 * segments published.
+	 */
+
+int rx_ring_publish(struct rx_ring *r)
+{
+	ULONG head = r->head;
+	int n = 0;
+
+	while (head != r->posted && r->segment_done[head & (r->num_segments-1)]) {
+		head++;
+		n++;
+	}
+	if (n == 0)
+		return 0;
+
+		/* Volatile write has release semantics */
+	r->head = head;
+
+	MemoryBarrier();
+	if (r->consumer_waiting) {
+		atomic_inc64(&windrbd_rx_ring_wakeups);
+		wake_up(r->data_available);
+	}
+	return n;
+}
+
+static int rx_ring_empty(struct rx_ring *r)
+{
+	char *p;
+
+	return rx_ring_readable(r, &p) == 0;
+}
+
+	/* Minimum size of a MSG_WAITALL read to be received directly
+	 * into the caller's buffer. DRBD headers are much smaller,
+	 * so they still go through the receiver cache.
+	 */
+
+int windrbd_zero_copy_receive_threshold = 64*1024;
+
+	/* Print them with windrbd run-test receive_copy_stats */
+
+atomic_t64 windrbd_receive_bytes_copied;
+atomic_t64 windrbd_receive_bytes_zero_copy;
+atomic_t64 windrbd_zero_copy_receives;
+
+	/* Consumer side of a direct receive. Returns the number of
+	 * bytes received (len on success, less if the receive timed
+	 * out or we were signalled after some data arrived), 0 if the
+	 * connection is gone or a negative error.
+	 *
+	 * Until the receive thread takes the request we wait like
+	 * the cached path (sk_rcvtimeo, interruptible). Once it took
+	 * it, it writes into buf until it sets DIRECT_RECEIVE_DONE, so
+	 * we must not return before that: wsk_recvmsg() times out in
+	 * the receive thread and if we get a signal we signal the
+	 * receive thread, which then cancels its receive.
+	 */
+
+static int receive_direct(struct socket *socket, char *buf, ULONG len, LONG_PTR timeout)
+{
+	ULONG copied, n;
+	LONG_PTR ret;
+	char *p;
+
+	socket->direct_buf = buf;
+	socket->direct_len = len;
+	socket->direct_buffered = 0;
+	socket->direct_result = 0;
+	socket->direct_abort = 0;
+	InterlockedExchange(&socket->direct_state, DIRECT_RECEIVE_REQUESTED);
+	wake_up(&socket->buffer_available);
+
+	wait_event_interruptible_timeout(ret,
+		socket->data_available,
+		socket->direct_state != DIRECT_RECEIVE_REQUESTED ||
+		socket->error_status != 0 ||
+		socket->sk->sk_state != TCP_ESTABLISHED,
+		timeout);
+
+	if (InterlockedCompareExchange(&socket->direct_state, DIRECT_RECEIVE_NONE, DIRECT_RECEIVE_REQUESTED) == DIRECT_RECEIVE_REQUESTED) {
+			/* receive thread might wait for us */
+		wake_up(&socket->buffer_available);
+
+		if (socket->error_status != 0)
+			return socket->error_status;
+		if (socket->sk->sk_state != TCP_ESTABLISHED)
+			return 0;
+		return ret == -EINTR ? -EINTR : -EAGAIN;
+	}
+
+	atomic_inc64(&windrbd_zero_copy_receives);
+
+		/* Receive thread does not touch the ring until DONE */
+	for (copied = 0; copied < socket->direct_buffered; copied += n) {
+		n = rx_ring_readable(&socket->rx_ring, &p);
+		if (n > socket->direct_buffered - copied)
+			n = socket->direct_buffered - copied;
+
+		memcpy(buf + copied, p, n);
+		rx_ring_consumed(&socket->rx_ring, n);
+	}
+	atomic_add64(copied, &windrbd_receive_bytes_copied);
+
+	wait_event_interruptible(ret, socket->data_available, socket->direct_state == DIRECT_RECEIVE_DONE);
+	if (ret == -EINTR) {
+		InterlockedExchange(&socket->direct_abort, 1);
+		force_sig(SIGHUP, socket->receive_thread);
+		wait_event(socket->data_available, socket->direct_state == DIRECT_RECEIVE_DONE);
+	}
+
+	ret = socket->direct_result;
+	InterlockedExchange(&socket->direct_state, DIRECT_RECEIVE_NONE);
+
+	return (int) ret;
+}
+
+	/* Receive thread side: takes the request and receives the
+	 * part not yet in the ring into the caller's buffer. Returns
+	 * the last wsk_recvmsg() result (> 0 if the receive thread
+	 * should go on). If it fails after some data arrived, the
+	 * caller gets what we have (like wsk_recvmsg() does on
+	 * timeout), else it would be lost from the stream.
+	 */
+
+static int do_direct_receive(struct socket *s)
+{
+	struct kvec iov;
+	struct msghdr msg = { .msg_flags = 0 };
+	ULONG buffered, received;
+	int err;
+
+	buffered = rx_ring_bytes(&s->rx_ring);
+	if (buffered > s->direct_len)
+		buffered = s->direct_len;
+	s->direct_buffered = buffered;
+
+		/* A signal from an earlier (aborted) direct receive */
+	flush_signals(current);
+
+	if (InterlockedCompareExchange(&s->direct_state, DIRECT_RECEIVE_RUNNING, DIRECT_RECEIVE_REQUESTED) != DIRECT_RECEIVE_REQUESTED)
+		return 1;	/* kernel_recvmsg() gave up */
+	wake_up(&s->data_available);
+
+	err = 1;
+	received = buffered;
+	while (received < s->direct_len) {
+		iov.iov_base = s->direct_buf + received;
+		iov.iov_len = s->direct_len - received;
+
+		err = wsk_recvmsg(s, &msg, &iov, 1, iov.iov_len, msg.msg_flags);
+		if (err > 0) {
+			received += err;
+			atomic_add64(err, &windrbd_receive_bytes_zero_copy);
+		}
+			/* Signalled by receive_direct() */
+		if (s->direct_abort) {
+			flush_signals(current);
+			if (err > 0)
+				err = -EINTR;
+			break;
+		}
+		if (err == -EINTR && s->receive_thread_should_run)
+			continue;
+		if (err <= 0)
+			break;
+	}
+	if (received > 0)
+		s->direct_result = received;
+	else
+		s->direct_result = err;
+
+	InterlockedExchange(&s->direct_state, DIRECT_RECEIVE_DONE);
+	wake_up(&s->data_available);
+
+	return err;
+}
+
 int kernel_recvmsg(struct socket *socket, struct msghdr *msg, struct kvec *vec,
                    size_t num, size_t len, int flags)
 {
 	size_t bytes_to_copy;
 	size_t return_buffer_index;
-	KIRQL irq_flags;
+	size_t cur, cur_offset;	/* position in vec */
+	char *p;
 	int ret;
 	LONG_PTR timeout, remaining_time;
 
@@ -1514,7 +2229,7 @@ int kernel_recvmsg(struct socket *socket, struct msghdr *msg, struct kvec *vec,
 			if (!socket->receiver_cache_enabled)
 				printk("Receiver cache disabled\n");
 			else
-				printk("Receiver cache enabled, buffer size is %d\n", socket->receive_buffer_size);
+				printk("Receiver cache enabled, buffer size is %d, %d receives of %d bytes outstanding\n", socket->rx_ring.size, socket->num_rx_irps, socket->rx_ring.segment_size);
 
 			socket->have_printed_status = true;
 		}
@@ -1526,157 +2241,327 @@ int kernel_recvmsg(struct socket *socket, struct msghdr *msg, struct kvec *vec,
 	if (!socket->receiver_cache_enabled) {
 		ret = wsk_recvmsg(socket, msg, vec, num, len, flags);
 		if (ret > 0)
-			dump_packet(vec[0].iov_base, ret);
+			dump_packet(vec[0].iov_base, min_t(size_t, ret, vec[0].iov_len));
 		return ret;
 	}
 
-	if (wsk_state != WSK_INITIALIZED || !socket || !socket->wsk_socket || !vec || vec[0].iov_base == NULL || ((int) vec[0].iov_len == 0))
+	if (wsk_state != WSK_INITIALIZED || !socket || !socket->wsk_socket || !vec || num == 0 || kvec_length(vec, num) == 0)
 		return -EINVAL;
 
-	if (num != 1)
-		return -EOPNOTSUPP;
+	if (len > kvec_length(vec, num))
+		len = kvec_length(vec, num);
 
 	if (socket->error_status != 0)
 		return socket->error_status;
 
 	return_buffer_index = 0;
+	cur = 0;
+	cur_offset = 0;
 
 	timeout = socket->sk->sk_rcvtimeo; 
 	while (1) {
-		wait_event_interruptible_timeout(
-			remaining_time,
-			socket->data_available, 
-			socket->write_index != socket->read_index || 
-			(socket->write_index == socket->read_index && socket->receive_buffer_full) || 
-			socket->error_status != 0 || 
-			socket->sk->sk_state != TCP_ESTABLISHED,
-			timeout);
+		while (cur_offset == vec[cur].iov_len) {
+			cur++;
+			cur_offset = 0;
+		}
+			/* Typically the payload after the header */
+		if ((flags & MSG_WAITALL) && windrbd_zero_copy_receive_threshold > 0 &&
+		    len-return_buffer_index >= (size_t) windrbd_zero_copy_receive_threshold &&
+		    len-return_buffer_index == vec[cur].iov_len-cur_offset &&
+		    rx_ring_empty(&socket->rx_ring) &&
+		    socket->sk->sk_state == TCP_ESTABLISHED) {
+			ret = receive_direct(socket, &((char*)vec[cur].iov_base)[cur_offset], (ULONG) (len-return_buffer_index), timeout);
+			if (ret <= 0)
+				return ret;
+
+			return_buffer_index += ret;
+			dump_packet(vec[0].iov_base, min_t(size_t, return_buffer_index, vec[0].iov_len));
+			return return_buffer_index;
+		}
+
+		if (rx_ring_empty(&socket->rx_ring)) {
+			InterlockedExchange(&socket->rx_ring.consumer_waiting, 1);
+			wait_event_interruptible_timeout(
+				remaining_time,
+				socket->data_available, 
+				!rx_ring_empty(&socket->rx_ring) ||
+				socket->error_status != 0 || 
+				socket->sk->sk_state != TCP_ESTABLISHED,
+				timeout);
+			socket->rx_ring.consumer_waiting = 0;
 
 /*
-		if (remaining_time == -EINTR)
-			return -EINTR;
+			if (remaining_time == -EINTR)
+				return -EINTR;
 */
-		if (remaining_time <= 0)
-			return -EAGAIN;
-		timeout = remaining_time;
+			if (remaining_time <= 0)
+				return -EAGAIN;
+			timeout = remaining_time;
+		}
 
 		if (socket->error_status != 0)
 			return socket->error_status;
 		if (socket->sk->sk_state != TCP_ESTABLISHED)
 			return 0;
 
-		spin_lock_irqsave(&socket->receive_lock, irq_flags);
-		if (socket->read_index < socket->write_index)
-			bytes_to_copy = socket->write_index - socket->read_index;
-		else {
-			if (socket->read_index == socket->write_index) {
-				if (socket->receive_buffer_full)
-					bytes_to_copy = socket->receive_buffer_size - socket->read_index;
-				else
-					bytes_to_copy = 0;
-			} else { /* read_index > write_index */
-				bytes_to_copy = socket->receive_buffer_size - socket->read_index;
-			}
-		}
-		spin_unlock_irqrestore(&socket->receive_lock, irq_flags);
+		bytes_to_copy = rx_ring_readable(&socket->rx_ring, &p);
 
 		if (bytes_to_copy > len-return_buffer_index) {
 			bytes_to_copy = len-return_buffer_index;
 		}
+		if (bytes_to_copy > vec[cur].iov_len-cur_offset) {
+			bytes_to_copy = vec[cur].iov_len-cur_offset;
+		}
 
 		if (bytes_to_copy <= 0)
 			continue;
 
-		memcpy(&((char*)vec[0].iov_base)[return_buffer_index], 
-			&socket->receive_buffer[socket->read_index],
-			bytes_to_copy);
+		memcpy(&((char*)vec[cur].iov_base)[cur_offset], p, bytes_to_copy);
+		return_buffer_index += bytes_to_copy;
+		cur_offset += bytes_to_copy;
+		atomic_add64(bytes_to_copy, &windrbd_receive_bytes_copied);
 
-		spin_lock_irqsave(&socket->receive_lock, irq_flags);
+		rx_ring_consumed(&socket->rx_ring, bytes_to_copy);
 
-		return_buffer_index += bytes_to_copy;
-		socket->read_index += bytes_to_copy;
+		if (return_buffer_index == len || !(flags & MSG_WAITALL)) {
+			dump_packet(vec[0].iov_base, min_t(size_t, return_buffer_index, vec[0].iov_len));
+			return return_buffer_index;
+		}
+	}
+	return -EINVAL;
+}
 
-		if (socket->read_index == socket->receive_buffer_size)
-			socket->read_index = 0;
+	/* One outstanding WskReceive into a ring segment */
 
-		if (socket->write_index == socket->read_index)
-			socket->receive_buffer_full = false;
+struct rx_irp {
+	struct socket *socket;
+	struct _IRP *irp;
+	WSK_BUF wsk_buffer;
+	ULONG segment;
+	NTSTATUS status;
+	ULONG len;
+};
 
-		spin_unlock_irqrestore(&socket->receive_lock, irq_flags);
+	/* Print them with windrbd run-test receive_copy_stats */
 
-		wake_up(&socket->buffer_available);
+atomic_t64 windrbd_receive_irps;
+atomic_t64 windrbd_receive_irps_cancelled;
 
-		if (flags & MSG_WAITALL) {
-			if (return_buffer_index == len) {
-				dump_packet(vec[0].iov_base, return_buffer_index);
-				return return_buffer_index;
-			}
-		} else {
-			dump_packet(vec[0].iov_base, return_buffer_index);
-			return return_buffer_index;
-		}
+static NTSTATUS NTAPI receive_irp_completion(
+	__in PDEVICE_OBJECT	DeviceObject,
+	__in PIRP			Irp,
+	__in struct rx_irp	*rx
+)
+{
+	struct socket *s = rx->socket;
+
+	/* Must not printk in here, will loop forever. Hence also no
+	 * ASSERT.
+	 */
+
+	InterlockedIncrement(&s->rx_irps_completing);
+	rx->status = Irp->IoStatus.Status;
+		/* A cancelled receive might have gotten some data */
+	if (NT_SUCCESS(rx->status) || rx->status == STATUS_CANCELLED)
+		rx->len = (ULONG) Irp->IoStatus.Information;
+	else
+		rx->len = 0;
+
+	rx_ring_completed(&s->rx_ring, rx->segment, rx->len);
+
+	MemoryBarrier();
+	if (s->rx_ring.producer_waiting)
+		wake_up(&s->buffer_available);
+
+	InterlockedDecrement(&s->rx_irps_completing);
+	return STATUS_MORE_PROCESSING_REQUIRED;
+}
+
+	/* Posts a WskReceive into the next free ring segment. */
+
+static int post_receive(struct socket *s)
+{
+	struct rx_irp *rx;
+	NTSTATUS status;
+	ULONG len;
+	char *buf;
+
+	len = rx_ring_writable(&s->rx_ring, &buf);
+	if (len == 0)
+		return -ENOSPC;
+
+	rx = &s->rx_irps[s->rx_ring.posted & (s->num_rx_irps-1)];
+	status = InitWskBuffer(buf, len, &rx->wsk_buffer, TRUE, TRUE);
+	if (!NT_SUCCESS(status))
+		return winsock_to_linux_error(status);
+
+	rx->irp = IoAllocateIrp(1, FALSE);
+	if (rx->irp == NULL) {
+		FreeWskBuffer(&rx->wsk_buffer, 1);
+		return -ENOMEM;
 	}
-	return -EINVAL;
+	IoSetCompletionRoutine(rx->irp, receive_irp_completion, rx, TRUE, TRUE, TRUE);
+
+	mutex_lock(&s->wsk_mutex);
+	if (s->wsk_socket == NULL) {
+		mutex_unlock(&s->wsk_mutex);
+		IoFreeIrp(rx->irp);
+		FreeWskBuffer(&rx->wsk_buffer, 1);
+		return -ENOTCONN;
+	}
+	rx->socket = s;
+	rx->segment = rx_ring_post(&s->rx_ring);
+
+		/* Completion routine is called in any case */
+	((PWSK_PROVIDER_CONNECTION_DISPATCH) s->wsk_socket->Dispatch)->WskReceive(
+				s->wsk_socket,
+				&rx->wsk_buffer,
+				0,
+				rx->irp);
+	mutex_unlock(&s->wsk_mutex);
+
+	atomic_inc64(&windrbd_receive_irps);
+	return 0;
 }
 
-static int socket_receive_thread(void *p)
+	/* Publishes receives completed in order and frees their IRPs.
+	 * Returns a negative error (or 0 if the connection was closed
+	 * by the peer) if one of them failed, else 1.
+	 */
+
+static int reap_receives(struct socket *s)
 {
-	struct socket *s = p;
-        struct kvec iov = { 0 };
-        struct msghdr msg = { .msg_flags = 0 };
-	int err;
-	KIRQL flags;
+	struct rx_irp *rx;
+	ULONG seg;
+	int n, ret;
 
-// printk("Receiver thread started for socket %p.\n", s);
-	while (1) {
-		wait_event(s->buffer_available, 
-			!s->receive_thread_should_run ||
-			(s->sk->sk_state == TCP_ESTABLISHED &&
-			(s->write_index != s->read_index ||
-			(s->write_index == s->read_index && !s->receive_buffer_full)))); 
+	seg = s->rx_ring.head;
+	n = rx_ring_publish(&s->rx_ring);
 
-		if (!s->receive_thread_should_run)
-			break;
+	ret = 1;
+	for (;n > 0;n--,seg++) {
+		rx = &s->rx_irps[seg & (s->num_rx_irps-1)];
 
-		spin_lock_irqsave(&s->receive_lock, flags);
-		if (s->read_index == s->write_index && !s->receive_buffer_full) {
-			s->read_index = s->write_index = 0;
-			iov.iov_len = s->receive_buffer_size;
-		} else {
-			if (s->read_index < s->write_index)
-				iov.iov_len = s->receive_buffer_size-s->write_index;
-			else
-				iov.iov_len = s->read_index-s->write_index;
-		}
-		iov.iov_base = &s->receive_buffer[s->write_index];
-		spin_unlock_irqrestore(&s->receive_lock, flags);
+		IoFreeIrp(rx->irp);
+		FreeWskBuffer(&rx->wsk_buffer, 1);
+		rx->irp = NULL;
 
-		if (iov.iov_len == 0) {
-			printk("Warning: iov.iov_len is 0 in WinDRBD receiver thread .. should not happen.\n");
-// printk("3a read_index is %d write_index is %d\n", s->read_index, s->write_index);
-			continue;	/* wait_event should block */
+		if (rx->status == STATUS_CANCELLED) {
+			atomic_inc64(&windrbd_receive_irps_cancelled);
+			continue;
 		}
-		err = wsk_recvmsg(s, &msg, &iov, 1, iov.iov_len, msg.msg_flags);
+		if (!NT_SUCCESS(rx->status)) {
+			dbg("receive completed with error %x\n", rx->status);
+			ret = winsock_to_linux_error(rx->status);
+		} else if (rx->len == 0 && ret > 0) {
+			dbg("BytesReceived is 0, socket closed by peer?\n");
+			ret = 0;
+		}
+	}
+	return ret;
+}
 
-		if (err == -EAGAIN || err == -EINTR)
-			continue;
+	/* Cancels all outstanding receives (newest first, so that
+	 * data can only go to a prefix of them) and waits until they
+	 * are completed. Returns like reap_receives().
+	 */
 
-		if (err <= 0)
-			break;
+static int cancel_receives(struct socket *s)
+{
+	ULONG seg;
+	int err, ret;
+
+	for (seg = s->rx_ring.posted; seg != s->rx_ring.head; seg--)
+		IoCancelIrp(s->rx_irps[(seg-1) & (s->num_rx_irps-1)].irp);
+
+	ret = 1;
+	while (s->rx_ring.head != s->rx_ring.posted) {
+		InterlockedExchange(&s->rx_ring.producer_waiting, 1);
+		wait_event(s->buffer_available, rx_ring_can_publish(&s->rx_ring));
+		s->rx_ring.producer_waiting = 0;
+
+		err = reap_receives(s);
+		if (err <= 0 && ret > 0)
+			ret = err;
+	}
+	return ret;
+}
 
-		spin_lock_irqsave(&s->receive_lock, flags);
+	/* A direct receive must start at the current stream position,
+	 * so no receive into the ring may be outstanding. We do not
+	 * cancel them (that would cost a cancel and re-post per DRBD
+	 * payload): we stop posting and let the direct receive consume
+	 * what they deliver. If that is already all of it, nothing is
+	 * received directly.
+	 */
 
-		s->write_index+=err;
-		if (s->write_index == s->receive_buffer_size)
-			s->write_index = 0;
+static bool direct_receive_can_start(struct socket *s)
+{
+	return s->rx_ring.head == s->rx_ring.posted ||
+		rx_ring_bytes(&s->rx_ring) >= s->direct_len;
+}
 
-		if (s->write_index == s->read_index)
-			s->receive_buffer_full = true;
+	/* Keeps up to num_rx_irps receives outstanding, so the TCP
+	 * receive window does not depend on one IRP round trip.
+	 */
+
+static int socket_receive_thread(void *arg)
+{
+	struct socket *s = arg;
+	bool can_post, direct;
+	char *buf;
+	int err;
+
+// printk("Receiver thread started for socket %p.\n", s);
+	s->receive_thread = current;
+	while (s->receive_thread_should_run) {
+		direct = s->direct_state == DIRECT_RECEIVE_REQUESTED;
+		if (direct && direct_receive_can_start(s)) {
+			err = do_direct_receive(s);
+			if (err == -EAGAIN || err == -EINTR)
+				continue;
+			if (err <= 0)
+				break;
+			continue;
+		}
 
-		spin_unlock_irqrestore(&s->receive_lock, flags);
+		can_post = !direct && s->sk->sk_state == TCP_ESTABLISHED;
+		while (can_post && s->rx_ring.posted - s->rx_ring.head < (ULONG) s->num_rx_irps) {
+			err = post_receive(s);
+			if (err < 0) {
+				can_post = false;
+					/* -ENOSPC: wait for the consumer */
+				if (err != -ENOSPC && s->rx_ring.posted == s->rx_ring.head)
+					goto out;
+			}
+		}
 
-		wake_up(&s->data_available);
+			/* IRP completions, the consumer when a segment is
+			 * free again, connect, accept and kernel_recvmsg()
+			 * (for direct receives) wake us.
+			 */
+		InterlockedExchange(&s->rx_ring.producer_waiting, 1);
+		wait_event(s->buffer_available, 
+			!s->receive_thread_should_run ||
+			(s->direct_state == DIRECT_RECEIVE_REQUESTED && direct_receive_can_start(s)) ||
+			rx_ring_can_publish(&s->rx_ring) ||
+			(s->direct_state != DIRECT_RECEIVE_REQUESTED &&
+			 s->sk->sk_state == TCP_ESTABLISHED &&
+			 s->rx_ring.posted - s->rx_ring.head < (ULONG) s->num_rx_irps &&
+			 (can_post || s->rx_ring.posted == s->rx_ring.head) &&
+			 rx_ring_writable(&s->rx_ring, &buf) != 0));
+		s->rx_ring.producer_waiting = 0;
+
+		if (reap_receives(s) <= 0)
+			break;
 	}
+out:
+		/* The IRPs point into the ring. Also the socket must
+		 * not go away while a completion routine still runs.
+		 */
+	cancel_receives(s);
+	while (s->rx_irps_completing > 0)
+		YieldProcessor();
 
 	s->sk->sk_state = TCP_NO_CONNECTION;
 	wake_up(&s->data_available);
@@ -1845,6 +2730,7 @@ static int sock_create_linux_socket(struct socket **out, unsigned short type)
 	socket->ops = &winsocket_ops;
 
 	get_registry_int(L"enable_receiver_cache", &socket->receiver_cache_enabled, 1);
+	socket->direct_state = DIRECT_RECEIVE_NONE;
 	init_waitqueue_head(&socket->buffer_available);
 	init_waitqueue_head(&socket->data_available);
 	init_waitqueue_head(&socket->connected_waitqueue);
@@ -1858,21 +2744,36 @@ static int sock_create_linux_socket(struct socket **out, unsigned short type)
 		socket->receiver_cache_enabled = false;
 
 	if (socket->receiver_cache_enabled) {
-		get_registry_int(L"receive_buffer_size", &socket->receive_buffer_size, RECEIVE_BUFFER_DEFAULT_SIZE);
-		if (socket->receive_buffer_size < 4096)
-			socket->receive_buffer_size = 4096;
-		if (socket->receive_buffer_size > 4*1024*1024)
-			socket->receive_buffer_size = 4*1024*1024;
-		socket->receive_buffer = kmalloc(socket->receive_buffer_size, GFP_KERNEL, 'XYZR');
-		if (socket->receive_buffer == NULL) {
-			printk("Warning: could not allocate memory for socket receive buffer (size is %d), receiver cache disabled\n", socket->receive_buffer_size);
+		int receive_buffer_size;
+
+		get_registry_int(L"receive_buffer_size", &receive_buffer_size, RECEIVE_BUFFER_DEFAULT_SIZE);
+		if (receive_buffer_size < 4096)
+			receive_buffer_size = 4096;
+		if (receive_buffer_size > 4*1024*1024)
+			receive_buffer_size = 4*1024*1024;
+			/* Rounded down to a power of 2 */
+		get_registry_int(L"receive_irps_per_socket", &socket->num_rx_irps, RECEIVE_IRPS_DEFAULT);
+		if (socket->num_rx_irps < 1)
+			socket->num_rx_irps = 1;
+		if (socket->num_rx_irps > RECEIVE_IRPS_MAX)
+			socket->num_rx_irps = RECEIVE_IRPS_MAX;
+			/* Also rounded down to a power of 2: receives
+			 * are indexed by the (wrapping) segment number.
+			 */
+		while (socket->num_rx_irps & (socket->num_rx_irps-1))
+			socket->num_rx_irps &= socket->num_rx_irps-1;
+		socket->rx_irps = kzalloc(socket->num_rx_irps * sizeof(*socket->rx_irps), GFP_KERNEL, 'XYZR');
+
+			/* Two segments per outstanding receive, so the
+			 * consumer can read while all receives are posted.
+			 */
+		if (socket->rx_irps == NULL || rx_ring_init(&socket->rx_ring, receive_buffer_size, socket->num_rx_irps * 2, &socket->data_available, &socket->buffer_available) < 0) {
+			printk("Warning: could not allocate memory for socket receive buffer (size is %d), receiver cache disabled\n", receive_buffer_size);
+			kfree(socket->rx_irps);
+			socket->rx_irps = NULL;
 			socket->receiver_cache_enabled = false;
-		} else {
-			socket->write_index = 0;
-			socket->read_index = 0;
-//			init_completion(&socket->receiver_thread_completion);
-			spin_lock_init(&socket->receive_lock);
 		}
+//		init_completion(&socket->receiver_thread_completion);
 	}
 
 	socket->sk->sk_sndbuf = 4*1024*1024;
@@ -2199,6 +3100,12 @@ NTSTATUS windrbd_init_wsk(void)
 	spin_lock_init(&completions_lock);
 	KeInitializeEvent(&net_initialized_event, NotificationEvent, FALSE);
 
+	get_registry_int(L"zero_copy_receive_threshold", &windrbd_zero_copy_receive_threshold, 64*1024);
+	printk("Zero copy receive threshold is %d bytes (0 is disabled)\n", windrbd_zero_copy_receive_threshold);
+	get_registry_int(L"async_send_max_size", &windrbd_async_send_max_size, ASYNC_SEND_BUFFER_SIZE);
+	printk("kernel_sendmsg() is asynchronous up to %d bytes\n", min_t(int, windrbd_async_send_max_size, ASYNC_SEND_BUFFER_SIZE));
+	init_async_send_pool();
+
 	status = windrbd_create_windows_thread(windrbd_init_wsk_thread, NULL, &init_wsk_thread);
 
 	if (!NT_SUCCESS(status))
@@ -2225,5 +3132,6 @@ void windrbd_shutdown_wsk(void)
 	 */
 
 	SocketsDeinit();
+	shutdown_async_send_pool();
 }
 
@@ -0,0 +1,577 @@
+/*
+	Copyright(C) 2017-2018, Johannes Thoma <johannes@johannesthoma.com>
+	Copyright(C) 2017-2018, LINBIT HA-Solutions GmbH  <office@linbit.com>
+
+	Windows DRBD is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2, or (at your option)
+	any later version.
+
+	Windows DRBD is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Windows DRBD; see the file COPYING. If not, write to
+	the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/* Linux workqueues (this used to be run_singlethread_workqueue()
+ * in drbd_windows.c: one thread per queue and two spin locks per
+ * queue_work()).
+ *
+ * A workqueue has one or more workers (threads). Each worker has
+ * a lock free inbox (a LIFO of work_structs linked by work->next)
+ * into which queue_work() pushes, so queue_work() takes no lock.
+ * The worker moves its inbox (reversed, so FIFO) to its local
+ * list and runs the works from there. A worker that runs out of
+ * work steals half of the local list (or the inbox) of another
+ * worker before going to sleep.
+ *
+ * queue_work() signals the target worker's KEVENT only if that
+ * worker is idle. If it is busy and other workers are idle, one
+ * of them is woken to steal the work.
+ *
+ * Per-CPU workqueues have one worker per CPU (bound to that CPU)
+ * and queue_work() uses the worker of the current CPU. Unbound
+ * workqueues have max_active workers (at most the number of CPUs
+ * by default) and queue_work() distributes round robin. Ordered
+ * workqueues have exactly one worker, so works are executed one
+ * at a time in FIFO order.
+ *
+ * Like on Linux a work is never executed by two workers at the
+ * same time: if it is requeued while running, the worker that
+ * picks it up hands it over to the worker running it.
+ */
+
+#include "drbd_windows.h"
+#include "windrbd_threads.h"
+
+#define __WQ_ORDERED	(1 << 17)
+
+	/* Upper bound of workers per workqueue */
+#define WQ_MAX_WORKERS	64
+
+struct wq_worker {
+	struct workqueue_struct *wq;
+	int cpu;			/* bound to this CPU or -1 */
+
+	struct work_struct *volatile inbox;	/* pushed by queue_work() */
+
+	spinlock_t lock;		/* protects the following */
+	struct list_head list;		/* owner takes from head, thieves from tail */
+	int nr_listed;
+	struct list_head scheduled;	/* must wait for current_work, not stolen */
+	struct work_struct *volatile current_work;
+
+	volatile LONG idle;
+	KEVENT wakeup;
+	KEVENT exited;
+	struct task_struct *thread;
+};
+
+struct wq_flusher {
+	struct list_head list;
+	KEVENT done;
+};
+
+struct workqueue_struct {
+	int flags;
+	int run;
+	int about_to_destroy;
+	char name[WQNAME_LEN];
+
+	volatile LONG nr_in_flight;	/* queued or running */
+	spinlock_t flush_lock;
+	struct list_head flushers;
+
+	volatile LONG next_worker;	/* round robin for unbound */
+	volatile LONG num_idle;
+	int num_workers;
+	struct wq_worker workers[1];
+};
+
+struct workqueue_struct *system_wq;
+
+	/* Print them with windrbd run-test workqueue_stats */
+
+atomic_t64 windrbd_wq_works_queued;
+atomic_t64 windrbd_wq_works_stolen;
+atomic_t64 windrbd_wq_worker_wakeups;
+
+static void wq_wake_worker(struct wq_worker *worker)
+{
+	if (worker->idle && InterlockedExchange(&worker->idle, 0) == 1) {
+		InterlockedDecrement(&worker->wq->num_idle);
+		atomic_inc64(&windrbd_wq_worker_wakeups);
+		KeSetEvent(&worker->wakeup, 0, FALSE);
+	}
+}
+
+static struct wq_worker *wq_select_worker(struct workqueue_struct *wq)
+{
+	ULONG n;
+
+	if (wq->num_workers == 1)
+		return &wq->workers[0];
+
+	if (wq->flags & WQ_UNBOUND)
+		n = (ULONG) InterlockedIncrement(&wq->next_worker);
+	else
+		n = KeGetCurrentProcessorNumberEx(NULL);
+
+	return &wq->workers[n % wq->num_workers];
+}
+
+void queue_work(struct workqueue_struct *queue, struct work_struct *work)
+{
+	struct wq_worker *worker;
+	struct work_struct *head;
+	int i;
+
+	if (queue->about_to_destroy) {
+		printk("Warning: Attempt to queue_work while destroying workqueue\n");
+		return;
+	}
+	if (InterlockedCompareExchange(&work->pending, 1, 0) != 0) {
+		if (queue != work->orig_queue || work->orig_func != work->func)
+			printk("work %p pending on queue %s: queue or func have changed: queue is %p (%s) work->orig_queue is %p (%s) work->orig_func is %p work->func is %p\n", queue, queue->name, work->orig_queue, work->orig_queue->name, work->orig_func, work->func);
+
+		return;
+	}
+	work->orig_queue = queue;
+	work->orig_func = work->func;
+
+	atomic_inc64(&windrbd_wq_works_queued);
+	InterlockedIncrement(&queue->nr_in_flight);
+
+	worker = wq_select_worker(queue);
+	do {
+		head = worker->inbox;
+		work->next = head;
+	} while (InterlockedCompareExchangePointer((PVOID*)&worker->inbox, work, head) != head);
+
+		/* The interlocked push above orders this against the
+		 * worker setting idle and then looking at its inbox.
+		 */
+	if (worker->idle) {
+		wq_wake_worker(worker);
+	} else if (queue->num_idle > 0) {
+		for (i=0;i<queue->num_workers;i++) {
+			if (queue->workers[i].idle) {
+				wq_wake_worker(&queue->workers[i]);
+				break;
+			}
+		}
+	}
+}
+
+	/* Takes all works from the inbox of worker and appends them
+	 * (oldest first) to list. Returns the number of works.
+	 */
+
+static int wq_take_inbox(struct wq_worker *worker, struct list_head *list)
+{
+	struct work_struct *w, *next, *fifo;
+	int n;
+
+	if (worker->inbox == NULL)
+		return 0;
+
+	w = InterlockedExchangePointer((PVOID*)&worker->inbox, NULL);
+	fifo = NULL;
+	while (w != NULL) {
+		next = w->next;
+		w->next = fifo;
+		fifo = w;
+		w = next;
+	}
+	n = 0;
+	for (w = fifo; w != NULL; w = w->next) {
+		list_add_tail(&w->work_list, list);
+		n++;
+	}
+	return n;
+}
+
+	/* Moves half of the local list of another worker (or its
+	 * inbox if the list is empty) to our local list. Returns
+	 * the number of stolen works.
+	 */
+
+static int wq_steal(struct wq_worker *thief)
+{
+	struct workqueue_struct *wq = thief->wq;
+	struct wq_worker *victim;
+	struct work_struct *w;
+	struct list_head stolen;
+	KIRQL flags;
+	int i, n, count;
+
+	INIT_LIST_HEAD(&stolen);
+	count = 0;
+	for (i=1;i<wq->num_workers && count == 0;i++) {
+		victim = &wq->workers[(thief - wq->workers + i) % wq->num_workers];
+
+		if (victim->nr_listed > 0) {
+			spin_lock_irqsave(&victim->lock, flags);
+			n = (victim->nr_listed + 1) / 2;
+			while (n-- > 0 && !list_empty(&victim->list)) {
+				w = list_entry(victim->list.prev, struct work_struct, work_list);
+				list_move(&w->work_list, &stolen);
+				victim->nr_listed--;
+				count++;
+			}
+			spin_unlock_irqrestore(&victim->lock, flags);
+		}
+		if (count == 0)
+			count = wq_take_inbox(victim, &stolen);
+	}
+	if (count > 0) {
+		spin_lock_irqsave(&thief->lock, flags);
+		list_splice_tail_init(&stolen, &thief->list);
+		thief->nr_listed += count;
+		spin_unlock_irqrestore(&thief->lock, flags);
+
+		atomic_add64(count, &windrbd_wq_works_stolen);
+	}
+	return count;
+}
+
+	/* Returns the worker currently executing w, if any. No lock
+	 * needed: w is pending (we have it) so no worker can start
+	 * executing it, and a worker that is executing it set
+	 * current_work before clearing w->pending.
+	 */
+
+static struct wq_worker *wq_find_collision(struct wq_worker *worker, struct work_struct *w)
+{
+	struct workqueue_struct *wq = worker->wq;
+	int i;
+
+	for (i=0;i<wq->num_workers;i++)
+		if (&wq->workers[i] != worker && wq->workers[i].current_work == w)
+			return &wq->workers[i];
+
+	return NULL;
+}
+
+	/* Finishes the current work (if any) and returns the next
+	 * work to execute (already marked as not pending) or NULL
+	 * if there is none.
+	 */
+
+static struct work_struct *wq_next_work(struct wq_worker *worker)
+{
+	struct wq_worker *busy;
+	struct work_struct *w;
+	KIRQL flags;
+	int stolen = 0;
+
+	spin_lock_irqsave(&worker->lock, flags);
+	worker->current_work = NULL;
+	while (1) {
+		if (!list_empty(&worker->scheduled)) {
+			w = list_first_entry(&worker->scheduled, struct work_struct, work_list);
+			list_del_init(&w->work_list);
+			break;
+		}
+		worker->nr_listed += wq_take_inbox(worker, &worker->list);
+		if (list_empty(&worker->list)) {
+			if (stolen || worker->wq->num_workers == 1) {
+				spin_unlock_irqrestore(&worker->lock, flags);
+				return NULL;
+			}
+			spin_unlock_irqrestore(&worker->lock, flags);
+			stolen = 1;
+			if (wq_steal(worker) == 0)
+				return NULL;
+
+			spin_lock_irqsave(&worker->lock, flags);
+			continue;
+		}
+		w = list_first_entry(&worker->list, struct work_struct, work_list);
+		list_del_init(&w->work_list);
+		worker->nr_listed--;
+
+		busy = wq_find_collision(worker, w);
+		if (busy == NULL)
+			break;
+
+		spin_unlock_irqrestore(&worker->lock, flags);
+		spin_lock_irqsave(&busy->lock, flags);
+		if (busy->current_work == w) {
+			list_add_tail(&w->work_list, &busy->scheduled);
+			spin_unlock_irqrestore(&busy->lock, flags);
+			spin_lock_irqsave(&worker->lock, flags);
+			continue;
+		}
+			/* Has finished meanwhile */
+		spin_unlock_irqrestore(&busy->lock, flags);
+		spin_lock_irqsave(&worker->lock, flags);
+		break;
+	}
+	worker->current_work = w;
+		/* From now on it may be queued again */
+	InterlockedExchange(&w->pending, 0);
+	spin_unlock_irqrestore(&worker->lock, flags);
+
+	return w;
+}
+
+static int wq_has_work(struct wq_worker *worker)
+{
+	struct workqueue_struct *wq = worker->wq;
+	int i;
+
+	if (!list_empty(&worker->scheduled))
+		return 1;
+
+	for (i=0;i<wq->num_workers;i++)
+		if (wq->workers[i].inbox != NULL || wq->workers[i].nr_listed > 0)
+			return 1;
+
+	return 0;
+}
+
+static void wq_worker_sleep(struct wq_worker *worker)
+{
+	struct workqueue_struct *wq = worker->wq;
+
+	InterlockedIncrement(&wq->num_idle);
+	InterlockedExchange(&worker->idle, 1);
+
+	if (wq_has_work(worker) || !wq->run) {
+			/* If a waker was faster, the event stays set
+			 * and the next wait returns at once.
+			 */
+		if (InterlockedExchange(&worker->idle, 0) == 1)
+			InterlockedDecrement(&wq->num_idle);
+		return;
+	}
+	KeWaitForSingleObject(&worker->wakeup, Executive, KernelMode, FALSE, NULL);
+
+		/* Woken by destroy_workqueue() or by a stale event */
+	if (InterlockedExchange(&worker->idle, 0) == 1)
+		InterlockedDecrement(&wq->num_idle);
+}
+
+static void wq_work_done(struct workqueue_struct *wq)
+{
+	struct wq_flusher *f;
+	KIRQL flags;
+
+	if (InterlockedDecrement(&wq->nr_in_flight) != 0)
+		return;
+
+	if (list_empty(&wq->flushers))
+		return;
+
+	spin_lock_irqsave(&wq->flush_lock, flags);
+	list_for_each_entry(struct wq_flusher, f, &wq->flushers, list)
+		KeSetEvent(&f->done, 0, FALSE);
+	spin_unlock_irqrestore(&wq->flush_lock, flags);
+}
+
+static int wq_worker_thread(void *arg)
+{
+	struct wq_worker *worker = arg;
+	struct workqueue_struct *wq = worker->wq;
+	struct work_struct *w;
+	PROCESSOR_NUMBER proc;
+	GROUP_AFFINITY affinity;
+
+	if (worker->cpu >= 0 && NT_SUCCESS(KeGetProcessorNumberFromIndex(worker->cpu, &proc))) {
+		RtlZeroMemory(&affinity, sizeof(affinity));
+		affinity.Group = proc.Group;
+		affinity.Mask = (KAFFINITY) 1 << proc.Number;
+		KeSetSystemGroupAffinityThread(&affinity, NULL);
+	}
+
+	while (1) {
+		w = wq_next_work(worker);
+		if (w != NULL) {
+				/* w might be freed by its function */
+			if (wq->about_to_destroy)
+				printk("About to destroy workqueue %s not calling function\n", wq->name);
+			else
+				w->func(w);
+
+			wq_work_done(wq);
+			continue;
+		}
+		if (!wq->run)
+			break;
+
+		wq_worker_sleep(worker);
+	}
+	KeSetEvent(&worker->exited, 0, FALSE);
+	return 0;
+}
+
+static struct workqueue_struct *alloc_workqueue_va(const char *fmt, int flags, int max_active, va_list args)
+{
+	struct workqueue_struct *wq;
+	struct wq_worker *worker;
+	int num_cpus, num_workers, i;
+
+	num_cpus = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	if (flags & __WQ_ORDERED)
+		num_workers = 1;
+	else if (flags & WQ_UNBOUND)
+		num_workers = max_active > 0 ? max_active : num_cpus;
+	else
+		num_workers = num_cpus;
+
+	if (num_workers > WQ_MAX_WORKERS)
+		num_workers = WQ_MAX_WORKERS;
+
+	wq = kzalloc(sizeof(*wq) + (num_workers-1) * sizeof(wq->workers[0]), GFP_KERNEL, '31DW');
+	if (wq == NULL) {
+		printk("Warning: not enough memory for workqueue\n");
+		return NULL;
+	}
+	wq->flags = flags;
+	wq->run = TRUE;
+	wq->about_to_destroy = 0;
+	spin_lock_init(&wq->flush_lock);
+	INIT_LIST_HEAD(&wq->flushers);
+
+		/* ignore error if string is too long */
+	(void) RtlStringCbVPrintfA(wq->name, sizeof(wq->name)-1, fmt, args);
+	wq->name[sizeof(wq->name)-1] = '\0';
+
+	for (i=0;i<num_workers;i++) {
+		worker = &wq->workers[i];
+
+		worker->wq = wq;
+		worker->cpu = (flags & (WQ_UNBOUND | __WQ_ORDERED)) ? -1 : i;
+		spin_lock_init(&worker->lock);
+		INIT_LIST_HEAD(&worker->list);
+		INIT_LIST_HEAD(&worker->scheduled);
+		KeInitializeEvent(&worker->wakeup, SynchronizationEvent, FALSE);
+		KeInitializeEvent(&worker->exited, NotificationEvent, FALSE);
+
+		worker->thread = kthread_create(wq_worker_thread, worker, "wq_%s/%d", wq->name, i);
+		if (IS_ERR(worker->thread)) {
+			printk("kthread_run failed on creating workqueue thread, err is %d\n", PTR_ERR(worker->thread));
+			break;
+		}
+	}
+	if (i == 0) {
+		kfree(wq);
+		return NULL;
+	}
+	wq->num_workers = i;
+	for (i=0;i<wq->num_workers;i++)
+		wake_up_process(wq->workers[i].thread);
+
+	return wq;
+}
+
+struct workqueue_struct *alloc_workqueue(const char *fmt, int flags, int max_active, ...)
+{
+	struct workqueue_struct *wq;
+	va_list args;
+
+	va_start(args, max_active);
+	wq = alloc_workqueue_va(fmt, flags, max_active, args);
+	va_end(args);
+
+	return wq;
+}
+
+struct workqueue_struct *alloc_ordered_workqueue(const char * fmt, int flags, ...)
+{
+	struct workqueue_struct *wq;
+	va_list args;
+
+	va_start(args, flags);
+	wq = alloc_workqueue_va(fmt, flags | WQ_UNBOUND | __WQ_ORDERED, 1, args);
+	va_end(args);
+
+	return wq;
+}
+
+/* This should ensure that all work on the workqueue is done (has finished).
+ * It is typically invoked when a driver shuts down a resource (for example
+ * on drbdadm down). Waits until no work is queued or running, so a work
+ * that always requeues itself makes this wait forever.
+ */
+void flush_workqueue(struct workqueue_struct *wq)
+{
+	struct wq_flusher f;
+	KIRQL flags;
+
+	KeInitializeEvent(&f.done, NotificationEvent, FALSE);
+
+	spin_lock_irqsave(&wq->flush_lock, flags);
+	list_add(&f.list, &wq->flushers);
+	spin_unlock_irqrestore(&wq->flush_lock, flags);
+
+		/* Pairs with InterlockedDecrement in wq_work_done() */
+	MemoryBarrier();
+	if (wq->nr_in_flight != 0)
+		KeWaitForSingleObject(&f.done, Executive, KernelMode, FALSE, NULL);
+
+	spin_lock_irqsave(&wq->flush_lock, flags);
+	list_del(&f.list);
+	spin_unlock_irqrestore(&wq->flush_lock, flags);
+}
+
+	/* Works cannot be taken out of a worker's (lock free) inbox,
+	 * so unlike on Linux a pending work is not cancelled: we wait
+	 * until it has been executed. Returns true if it was pending.
+	 * Caller must make sure the work is not queued again.
+	 */
+
+bool cancel_work_sync(struct work_struct *work)
+{
+	struct workqueue_struct *wq = work->orig_queue;
+	bool was_pending = work->pending != 0;
+	int i, running;
+
+	if (wq == NULL)		/* never queued */
+		return false;
+
+	do {
+			/* A worker sets current_work before clearing
+			 * pending (see wq_next_work()).
+			 */
+		running = work->pending != 0;
+		for (i=0;i<wq->num_workers && !running;i++)
+			if (wq->workers[i].current_work == work)
+				running = 1;
+		if (running)
+			msleep(1);
+	} while (running);
+
+	return was_pending;
+}
+
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	int i;
+
+	wq->about_to_destroy = 1;
+	flush_workqueue(wq);
+
+	wq->run = FALSE;
+	for (i=0;i<wq->num_workers;i++)
+		KeSetEvent(&wq->workers[i].wakeup, 0, FALSE);
+	for (i=0;i<wq->num_workers;i++)
+		KeWaitForSingleObject(&wq->workers[i].exited, Executive, KernelMode, FALSE, NULL);
+
+	kfree(wq);
+}
+
+const char *workqueue_name(struct workqueue_struct *wq)
+{
+	return wq->name;
+}
+
+int workqueue_num_workers(struct workqueue_struct *wq)
+{
+	return wq->num_workers;
+}